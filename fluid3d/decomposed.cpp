@@ -0,0 +1,486 @@
+#include "simulation.h"
+#include "main.h"
+#include "peer.h"
+
+/*
+ * Decomposed initialisation: a slab, its kernels and its event graph
+ * for every device queue made by main
+ */
+void DecomposedSimulation::initialize(int nx, int ny, int nz)
+{
+	Simulation::initialize(nx, ny, nz);
+
+	for(cl::CommandQueue* queue : opencl->queues)
+	{
+		Slab* slab = new Slab();
+		slab->graph.initialize(opencl, queue);
+		slab->z0 = slab->nz = 0;
+		for(int f = 0; f < FIELDS; f++)
+			slab->fields[f] = NULL;
+
+		//Fused kernels write the walls themselves, see ParallelSimulation
+		slab->diffuseKernel = new cl::Kernel(*opencl->program, fused ? "diffuseBound" : "diffuse", &opencl->err);
+		slab->advectKernel = new cl::Kernel(*opencl->program, fused ? "advectBound" : "advect", &opencl->err);
+		slab->setBoundKernel = new cl::Kernel(*opencl->program, "setBound", &opencl->err);
+		slab->addSourceKernel = new cl::Kernel(*opencl->program, "addSources", &opencl->err);
+		slab->projectKernel1 = new cl::Kernel(*opencl->program, fused ? "project1Bound" : "project1", &opencl->err);
+		slab->projectKernel2 = new cl::Kernel(*opencl->program, fused ? "project2Bound" : "project2", &opencl->err);
+		slab->projectKernel3 = new cl::Kernel(*opencl->program, fused ? "project3Bound" : "project3", &opencl->err);
+		opencl->checkErr("Kernel::Kernel() (slab)");
+		slabs.push_back(slab);
+	}
+
+	setKernelArguments();
+
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		cl::Device device = opencl->queues[k]->getInfo<CL_QUEUE_DEVICE>();
+		cout<<"Slab "<<k<<": planes "<<slabs[k]->z0 + 1<<"-"<<slabs[k]->z0 + slabs[k]->nz
+			<<" on "<<device.getInfo<CL_DEVICE_NAME>()<<endl;
+	}
+}
+
+DecomposedSimulation::~DecomposedSimulation()
+{
+	for(Slab* slab : slabs)
+	{
+		for(int f = 0; f < FIELDS; f++)
+			delete slab->fields[f];
+		delete slab->diffuseKernel;
+		delete slab->advectKernel;
+		delete slab->setBoundKernel;
+		delete slab->addSourceKernel;
+		delete slab->projectKernel1; delete slab->projectKernel2; delete slab->projectKernel3;
+		delete slab;
+	}
+	delete below;
+	delete above;
+}
+
+/*
+ * Cuts the volume into slabs of whole planes, as even as they go. With
+ * fewer planes than devices the last slabs sit out. The slab fields are
+ * only reallocated (zeroed) when the cut changes, see resize for the state.
+ */
+void DecomposedSimulation::split()
+{
+	int count = min((int)slabs.size(), Nz);
+	int plane = (Nx+2)*(Ny+2)*fieldBytes;
+	bool changed = count != activeSlabs || plane != planeBytes;
+
+	int z = 0;
+	for(int k = 0; k < (int)slabs.size(); k++)
+	{
+		Slab* slab = slabs[k];
+		int nz = k < count ? Nz / count + (k < Nz % count ? 1 : 0) : 0;
+		if(nz != slab->nz)
+			changed = true;
+		slab->z0 = z;
+		slab->nz = nz;
+		z += nz;
+	}
+	if(!changed)
+		return;
+
+	activeSlabs = count;
+	planeBytes = plane;
+	for(Slab* slab : slabs)
+		for(int f = 0; f < FIELDS; f++)
+		{
+			delete slab->fields[f];
+			slab->fields[f] = slab->nz > 0 ? newField((Nx+2)*(Ny+2)*(slab->nz+2)) : NULL;
+		}
+
+	halos.assign(2 * max(0, activeSlabs - 1), Halo());
+	for(Halo& halo : halos)
+		halo.plane.resize(planeBytes);
+}
+
+/*
+ * Non-changing arguments. Each slab's kernels get its own extents, but
+ * with the longest side of the whole volume so that the cell size and
+ * the advection are the same in all of them. Backtraces may reach the
+ * ghost planes at seams and process boundaries, only the volume's own
+ * walls keep the half-cell margin.
+ */
+void DecomposedSimulation::setKernelArguments()
+{
+	split();
+
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		cl_int4 n = extent();
+		n.s[2] = slab->nz;
+
+		slab->diffuseKernel->setArg(0, n);
+		slab->advectKernel->setArg(0, n);
+		slab->advectKernel->setArg(7, dt);
+		cl_float2 zClamp;
+		zClamp.s[0] = k > 0 || below ? 0.0f : 0.5f;
+		zClamp.s[1] = k < activeSlabs - 1 || above ? slab->nz + 1.0f : slab->nz + 0.5f;
+		slab->advectKernel->setArg(8, zClamp);
+		slab->setBoundKernel->setArg(0, n);
+		slab->addSourceKernel->setArg(0, (Nx+2)*(Ny+2)*(slab->nz+2));
+		slab->addSourceKernel->setArg(1, dt);
+		slab->projectKernel1->setArg(0, n);
+		slab->projectKernel2->setArg(0, n);
+		slab->projectKernel3->setArg(0, n);
+	}
+}
+
+/*
+ * Halo exchange of a field: the top interior plane of each slab goes to the
+ * ghost plane under the next one, and that one's bottom interior plane to
+ * the ghost plane on top of the first. Both downloads of a seam go before
+ * its uploads, so that neither direction waits for the other.
+ *
+ * The outer planes go to the processes below and above, if any. Those
+ * exchanges complete in the background, see Peer.
+ */
+void DecomposedSimulation::exchange(int field)
+{
+	for(int k = 0; k + 1 < activeSlabs; k++)
+	{
+		Slab* lower = slabs[k];
+		Slab* upper = slabs[k + 1];
+		Halo& up = halos[2*k];
+		Halo& down = halos[2*k + 1];
+
+		//The staging plane is free again once its last upload is done
+		lower->graph.download(lower->fields[field], lower->nz * planeBytes, planeBytes, &up.plane[0],
+				up.uploaded, &up.downloaded);
+		upper->graph.download(upper->fields[field], planeBytes, planeBytes, &down.plane[0],
+				down.uploaded, &down.downloaded);
+		upper->graph.upload(upper->fields[field], 0, planeBytes, &up.plane[0],
+				up.downloaded, &up.uploaded);
+		lower->graph.upload(lower->fields[field], (lower->nz + 1) * planeBytes, planeBytes, &down.plane[0],
+				down.downloaded, &down.uploaded);
+	}
+
+	if(below)
+	{
+		Slab* bottom = slabs[0];
+		below->exchange(bottom->graph, bottom->fields[field], planeBytes, 0, planeBytes);
+	}
+	if(above)
+	{
+		Slab* top = slabs[activeSlabs - 1];
+		above->exchange(top->graph, top->fields[field], top->nz * planeBytes, (top->nz + 1) * planeBytes, planeBytes);
+	}
+}
+
+//Writes a field of the slabs, ghost planes included, from a host copy of the whole volume
+void DecomposedSimulation::upload(int field, const char* volume)
+{
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		cl::Event done;
+		slab->graph.upload(slab->fields[field], 0, (slab->nz + 2) * planeBytes,
+				volume + slab->z0 * planeBytes, cl::Event(), &done);
+	}
+}
+
+//Reads a field of the slabs into a host copy of the whole volume, ghost planes left out
+void DecomposedSimulation::download(int field, char* volume)
+{
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		int first = k == 0 ? 0 : 1;
+		int last = k == activeSlabs - 1 ? slab->nz + 1 : slab->nz;
+		cl::Event done;
+		slab->graph.download(slab->fields[field], first * planeBytes, (last - first + 1) * planeBytes,
+				volume + (slab->z0 + first) * planeBytes, cl::Event(), &done);
+	}
+}
+
+//Copies a whole volume buffer into the slabs and waits for it
+void DecomposedSimulation::scatter(int field, cl::Buffer* volume)
+{
+	char* source = (char*)opencl->queue->enqueueMapBuffer(*volume, CL_TRUE, CL_MAP_READ, 0, size, NULL, NULL, &opencl->err);
+	opencl->checkErr("CommandQueue::enqueueMapBuffer()");
+	upload(field, source);
+	finish();
+
+	cl::Event unmapped;
+	opencl->queue->enqueueUnmapMemObject(*volume, source, NULL, &unmapped);
+	unmapped.wait();
+}
+
+//Copies the slabs into a whole volume buffer (for the raycaster or a resize) and waits for it
+void DecomposedSimulation::gather(int field, cl::Buffer* volume)
+{
+	char* target = (char*)opencl->queue->enqueueMapBuffer(*volume, CL_TRUE, CL_MAP_WRITE, 0, size, NULL, NULL, &opencl->err);
+	opencl->checkErr("CommandQueue::enqueueMapBuffer()");
+	download(field, target);
+	finish();
+
+	cl::Event unmapped;
+	opencl->queue->enqueueUnmapMemObject(*volume, target, NULL, &unmapped);
+	unmapped.wait();
+}
+
+//Submits every slab's work before waiting on any, they depend on each other
+void DecomposedSimulation::finish()
+{
+	for(int k = 0; k < activeSlabs; k++)
+		slabs[k]->graph.flush();
+	for(int k = 0; k < activeSlabs; k++)
+		slabs[k]->graph.finish();
+}
+
+/*
+ * Pipeline stages, like those of ParallelSimulation but launched per slab
+ * and followed by the exchange of the fields they write. Fields are given
+ * by their index in the slabs.
+ *
+ * The sources are uploaded from the host arrays, ghost planes included, so
+ * after adding them the ghosts still match their neighbours.
+ */
+void DecomposedSimulation::addSources()
+{
+	float* sources[] = {dens_prev, u_prev, v_prev, w_prev};
+	int mask = 0;
+	for(int b = 0; b < 4; b++)
+		if(!emptySource[b])
+		{
+			mask |= 1 << b;
+			upload(DENS_PREV + b, (const char*)sources[b]);
+		}
+	if(mask == 0)
+		return;
+
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		std::vector<cl::Buffer*> reads, writes;
+		for(int b = 0; b < 4; b++)
+		{
+			slab->addSourceKernel->setArg(3 + 2*b, *slab->fields[b]);
+			slab->addSourceKernel->setArg(4 + 2*b, *slab->fields[DENS_PREV + b]);
+			if(mask & (1 << b))
+			{
+				reads.push_back(slab->fields[DENS_PREV + b]);
+				writes.push_back(slab->fields[b]);
+			}
+		}
+		slab->addSourceKernel->setArg(2, mask);
+		int cells = (Nx+2)*(Ny+2)*(slab->nz+2);
+		slab->graph.launch(*slab->addSourceKernel, cl::NDRange((cells + 3) / 4), reads, writes);
+	}
+}
+
+void DecomposedSimulation::setBound(Slab* slab, int b, int x)
+{
+	int side = max(Nx, max(Ny, slab->nz));
+	slab->setBoundKernel->setArg(1, b);
+	slab->setBoundKernel->setArg(2, *slab->fields[x]);
+	slab->graph.launch(*slab->setBoundKernel, cl::NDRange(side + 1, side + 1), {}, {slab->fields[x]});
+}
+
+void DecomposedSimulation::diffuse(int b, int x, int x0, float diff)
+{
+	float a = dt*diff*longest()*longest();
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		slab->diffuseKernel->setArg(1, a);
+		slab->diffuseKernel->setArg(2, *slab->fields[x]);
+		slab->diffuseKernel->setArg(3, *slab->fields[x0]);
+		if(fused)
+			slab->diffuseKernel->setArg(4, b);
+	}
+
+	for(int i = 0; i < solverSteps; i++)
+	{
+		for(int k = 0; k < activeSlabs; k++)
+		{
+			Slab* slab = slabs[k];
+			slab->graph.launch(*slab->diffuseKernel, cl::NDRange(Nx, Ny, slab->nz),
+					{slab->fields[x0]}, {slab->fields[x]});
+			if(!fused)
+				setBound(slab, b, x);
+		}
+		exchange(x);
+	}
+}
+
+void DecomposedSimulation::project(int u, int v, int w, int p, int div)
+{
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		cl::Kernel* kernels[] = {slab->projectKernel1, slab->projectKernel2, slab->projectKernel3};
+		for(cl::Kernel* kernel : kernels)
+		{
+			kernel->setArg(1, *slab->fields[u]);
+			kernel->setArg(2, *slab->fields[v]);
+			kernel->setArg(3, *slab->fields[w]);
+			kernel->setArg(4, *slab->fields[p]);
+			kernel->setArg(5, *slab->fields[div]);
+		}
+	}
+
+	//(part 1) - p starts at zero ghosts included, so it needs no exchange yet,
+	//and div is only read at its own cell
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		slab->graph.launch(*slab->projectKernel1, cl::NDRange(Nx, Ny, slab->nz),
+				{slab->fields[u], slab->fields[v], slab->fields[w]}, {slab->fields[p], slab->fields[div]});
+		if(!fused)
+		{
+			setBound(slab, 0, div);
+			setBound(slab, 0, p);
+		}
+	}
+
+	//(part 2)
+	for(int i = 0; i < solverSteps; i++)
+	{
+		for(int k = 0; k < activeSlabs; k++)
+		{
+			Slab* slab = slabs[k];
+			slab->graph.launch(*slab->projectKernel2, cl::NDRange(Nx, Ny, slab->nz),
+					{slab->fields[div]}, {slab->fields[p]});
+			if(!fused)
+				setBound(slab, 0, p);
+		}
+		exchange(p);
+	}
+
+	//(part 3)
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		slab->graph.launch(*slab->projectKernel3, cl::NDRange(Nx, Ny, slab->nz),
+				{slab->fields[p]}, {slab->fields[u], slab->fields[v], slab->fields[w]});
+		if(!fused)
+		{
+			setBound(slab, 1, u);
+			setBound(slab, 2, v);
+			setBound(slab, 3, w);
+		}
+	}
+	exchange(u);
+	exchange(v);
+	exchange(w);
+}
+
+/*
+ * Backtraces into a neighbour are clamped to the ghost plane, so at the
+ * seams fluid coming from more than a cell away is sampled from the plane
+ * next to the slab rather than from where it started.
+ */
+void DecomposedSimulation::advect(int b, int d, int d0, int u, int v, int w)
+{
+	for(int k = 0; k < activeSlabs; k++)
+	{
+		Slab* slab = slabs[k];
+		slab->advectKernel->setArg(1, b);
+		slab->advectKernel->setArg(2, *slab->fields[d]);
+		slab->advectKernel->setArg(3, *slab->fields[d0]);
+		slab->advectKernel->setArg(4, *slab->fields[u]);
+		slab->advectKernel->setArg(5, *slab->fields[v]);
+		slab->advectKernel->setArg(6, *slab->fields[w]);
+		slab->graph.launch(*slab->advectKernel, cl::NDRange(Nx, Ny, slab->nz),
+				{slab->fields[d0], slab->fields[u], slab->fields[v], slab->fields[w]}, {slab->fields[d]});
+		if(!fused)
+			setBound(slab, b, d);
+	}
+	exchange(d);
+}
+
+/*
+ * One decomposed step - the same pipeline as ParallelSimulation::step,
+ * with all slabs submitted before waiting on any of them. The density is
+ * then gathered into the whole volume for the raycaster.
+ */
+void DecomposedSimulation::step()
+{
+//vel_step:
+	//add_source for u, v, w and the density
+		addSources();
+
+	//SWAP ( u0, u ); diffuse ( N, 1, u, u0, visc, dt); (and v, w)
+		diffuse(1, U_PREV, U, visc);
+		diffuse(2, V_PREV, V, visc);
+		diffuse(3, W_PREV, W, visc);
+
+	//project ( N, u, v, w, u0, v0 );
+		project(U_PREV, V_PREV, W_PREV, U, V);
+
+	//SWAP ( u0, u ); SWAP ( v0, v ); SWAP ( w0, w ); advect u, v, w
+		advect(1, U, U_PREV, U_PREV, V_PREV, W_PREV);
+		advect(2, V, V_PREV, U_PREV, V_PREV, W_PREV);
+		advect(3, W, W_PREV, U_PREV, V_PREV, W_PREV);
+
+	//project ( N, u, v, w, u0, v0 );
+		project(U, V, W, U_PREV, V_PREV);
+
+//dens_step:
+	//SWAP ( x0,x ); diffuse ( N, 0, x, x0, diff, dt );
+		diffuse(0, DENS_PREV, DENS, diff);
+
+	// SWAP ( x0,x ); advect ( N, 0, x, x0, u, v, w, dt );
+		advect(0, DENS, DENS_PREV, U, V, W);
+
+	finish();
+
+	//Device time per slab, to see how even the load is
+	if(logging)
+	{
+		profileLog<<"Slabs busy";
+		for(int k = 0; k < activeSlabs; k++)
+			profileLog<<" "<<slabs[k]->graph.busyTime();
+		profileLog<<endl;
+	}
+
+	if(render)
+		gather(DENS, buf_dens);
+
+	//The sources are used up by the slabs, the host arrays only carry new ones
+	float* sources[] = {dens_prev, u_prev, v_prev, w_prev};
+	for(int b = 0; b < 4; b++)
+	{
+		if(!emptySource[b])
+			memset(sources[b], 0, size);
+		emptySource[b] = true;
+	}
+}
+
+//Clears everything, the slabs included
+void DecomposedSimulation::reset()
+{
+	Simulation::reset();
+	float* fields[] = {dens, u, v, w};
+	for(int f = DENS; f <= W; f++)
+		upload(f, (const char*)fields[f]);
+	finish();
+}
+
+/*
+ * The slabs hold the state, so it's gathered into the whole volume to be
+ * resampled there as usual, then cut up again at the new extents.
+ */
+void DecomposedSimulation::resize(int nx, int ny, int nz)
+{
+	//Every process would have to follow
+	if(below || above)
+	{
+		cout<<"A distributed simulation can't be resized"<<endl;
+		return;
+	}
+
+	cl::Buffer* fields[] = {buf_dens, buf_u, buf_v, buf_w};
+	for(int f = DENS; f <= W; f++)
+		gather(f, fields[f]);
+
+	Simulation::resize(nx, ny, nz);
+
+	cl::Buffer* resized[] = {buf_dens, buf_u, buf_v, buf_w};
+	for(int f = DENS; f <= W; f++)
+		scatter(f, resized[f]);
+}
@@ -0,0 +1,221 @@
+#include "eventgraph.h"
+#include "main.h"
+
+void EventGraph::initialize(OpenCL* backend, cl::CommandQueue* q)
+{
+	opencl = backend;
+	queue = q;
+}
+
+//Adds the events a launch has to wait for because of one buffer
+void EventGraph::dependOn(std::vector<cl::Event>& waitList, cl::Buffer* buffer, bool write)
+{
+	cl_mem handle = (*buffer)();
+
+	//Read after write, write after write
+	auto writer = lastWrite.find(handle);
+	if(writer != lastWrite.end())
+		waitList.push_back(writer->second);
+
+	//Write after read
+	if(write)
+	{
+		auto reading = readers.find(handle);
+		if(reading != readers.end())
+			waitList.insert(waitList.end(), reading->second.begin(), reading->second.end());
+	}
+}
+
+/*
+ * Enqueues a kernel after everything it depends on. Buffers that are
+ * both read and written only need to be listed in writes.
+ */
+void EventGraph::launch(const cl::Kernel& kernel, const cl::NDRange& global,
+		const std::vector<cl::Buffer*>& reads,
+		const std::vector<cl::Buffer*>& writes,
+		const cl::NDRange& local)
+{
+	cl::Event event;
+
+	if(serialized)
+	{
+		opencl->err = queue->enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL, &event);
+		opencl->checkErr("Kernel enqueuing failed");
+		event.wait();
+		if(logging)
+			opencl->profile(kernel, event);
+		return;
+	}
+
+	std::vector<cl::Event> waitList;
+	for(cl::Buffer* buffer : reads)
+		dependOn(waitList, buffer, false);
+	for(cl::Buffer* buffer : writes)
+		dependOn(waitList, buffer, true);
+
+	opencl->err = queue->enqueueNDRangeKernel(kernel, cl::NullRange, global, local,
+			waitList.empty() ? NULL : &waitList, &event);
+	opencl->checkErr("Kernel enqueuing failed");
+
+	//This launch is now the one to wait for
+	for(cl::Buffer* buffer : reads)
+		readers[(*buffer)()].push_back(event);
+	for(cl::Buffer* buffer : writes)
+	{
+		lastWrite[(*buffer)()] = event;
+		readers.erase((*buffer)());
+	}
+
+	events.push_back(event);
+	if(logging)
+		kernels.push_back(kernel);
+}
+
+/*
+ * Blocking read of a buffer, once the kernels writing it have finished.
+ * Only for the few values the host has to decide on in the middle of a step.
+ */
+void EventGraph::read(cl::Buffer* buffer, size_t offset, size_t size, void* destination)
+{
+	std::vector<cl::Event> waitList;
+	if(!serialized)
+		dependOn(waitList, buffer, false);
+
+	opencl->err = queue->enqueueReadBuffer(*buffer, CL_TRUE, offset, size, destination,
+			waitList.empty() ? NULL : &waitList);
+	opencl->checkErr("CommandQueue::enqueueReadBuffer()");
+}
+
+//Device-side copy between buffers, ordered like a kernel reading source and writing destination
+void EventGraph::copy(cl::Buffer* source, cl::Buffer* destination, size_t size)
+{
+	cl::Event event;
+	std::vector<cl::Event> waitList;
+	if(!serialized)
+	{
+		dependOn(waitList, source, false);
+		dependOn(waitList, destination, true);
+	}
+
+	opencl->err = queue->enqueueCopyBuffer(*source, *destination, 0, 0, size,
+			waitList.empty() ? NULL : &waitList, &event);
+	opencl->checkErr("CommandQueue::enqueueCopyBuffer()");
+
+	if(serialized)
+	{
+		event.wait();
+		return;
+	}
+	readers[(*source)()].push_back(event);
+	lastWrite[(*destination)()] = event;
+	readers.erase((*destination)());
+}
+
+//Records a finished enqueue of a transfer like a launch reading or writing the buffer
+void EventGraph::transferred(cl::Buffer* buffer, bool write, cl::Event& event)
+{
+	if(serialized)
+	{
+		event.wait();
+		return;
+	}
+	if(write)
+	{
+		lastWrite[(*buffer)()] = event;
+		readers.erase((*buffer)());
+	}
+	else
+		readers[(*buffer)()].push_back(event);
+	if(logging)
+		transfers.push_back(event);
+}
+
+/*
+ * Non-blocking read of part of a buffer into host memory, once the kernels
+ * writing it and the after event (if any, e.g. an upload on another device
+ * still using the destination) have finished. done is signalled with the data.
+ */
+void EventGraph::download(cl::Buffer* buffer, size_t offset, size_t size, void* destination,
+		const cl::Event& after, cl::Event* done)
+{
+	std::vector<cl::Event> waitList;
+	if(!serialized)
+		dependOn(waitList, buffer, false);
+	if(after() != NULL)
+		waitList.push_back(after);
+
+	opencl->err = queue->enqueueReadBuffer(*buffer, CL_FALSE, offset, size, destination,
+			waitList.empty() ? NULL : &waitList, done);
+	opencl->checkErr("CommandQueue::enqueueReadBuffer()");
+	transferred(buffer, false, *done);
+}
+
+//Non-blocking write of host memory into part of a buffer, after the after event (if any)
+void EventGraph::upload(cl::Buffer* buffer, size_t offset, size_t size, const void* source,
+		const cl::Event& after, cl::Event* done)
+{
+	std::vector<cl::Event> waitList;
+	if(!serialized)
+		dependOn(waitList, buffer, true);
+	if(after() != NULL)
+		waitList.push_back(after);
+
+	opencl->err = queue->enqueueWriteBuffer(*buffer, CL_FALSE, offset, size, source,
+			waitList.empty() ? NULL : &waitList, done);
+	opencl->checkErr("CommandQueue::enqueueWriteBuffer()");
+	transferred(buffer, true, *done);
+}
+
+/*
+ * A command outside the graph (on another queue) reading a buffer, which
+ * the launches writing the buffer from here on wait for.
+ */
+void EventGraph::readElsewhere(cl::Buffer* buffer, const cl::Event& event)
+{
+	if(serialized)
+		event.wait();
+	else
+		readers[(*buffer)()].push_back(event);
+}
+
+/*
+ * Submits what has been enqueued so far. With several graphs waiting on
+ * each other's events all of them have to be flushed before any finish.
+ */
+void EventGraph::flush()
+{
+	queue->flush();
+}
+
+/*
+ * Submits the frame and waits for all of it - the only host sync
+ * of the step in event graph mode.
+ */
+void EventGraph::finish()
+{
+	if(!serialized)
+	{
+		queue->flush();
+		queue->finish();
+	}
+
+	//Device time of the frame, kernels and transfers
+	busy = 0;
+	for(size_t i = 0; i < kernels.size(); i++)
+		opencl->profile(kernels[i], events[i]);
+	if(logging)
+		for(std::vector<cl::Event>* list : {&events, &transfers})
+			for(cl::Event& event : *list)
+			{
+				cl_ulong start, end;
+				event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+				event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+				busy += end - start;
+			}
+
+	lastWrite.clear();
+	readers.clear();
+	events.clear();
+	kernels.clear();
+	transfers.clear();
+}
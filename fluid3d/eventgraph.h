@@ -0,0 +1,60 @@
+/*
+ * Dependency tracker for the kernels of one simulation step.
+ *
+ * Each launch names the buffers it reads and writes, and the graph
+ * turns that into cl::Event wait lists. On an out-of-order queue the
+ * independent branches (the u, v, w and density chains) can then run
+ * side by side, and the host only waits once, at the end of the frame.
+ *
+ * In serialized mode (-serial) every launch is waited on straight away,
+ * which is how the simulation used to run - useful for comparison.
+ *
+ * The decomposed simulation has one graph per device. Halo planes go
+ * between them through host memory with download and upload, which
+ * take events of the other graph to wait for.
+ */
+#pragma once
+#include <CL/cl.hpp>
+#include <vector>
+#include <map>
+
+struct OpenCL;
+
+class EventGraph
+{
+public:
+	EventGraph() : opencl(NULL), queue(NULL), busy(0) {}
+
+	void initialize(OpenCL*, cl::CommandQueue*);
+	void launch(const cl::Kernel&, const cl::NDRange&,
+			const std::vector<cl::Buffer*>& reads,
+			const std::vector<cl::Buffer*>& writes,
+			const cl::NDRange& local = cl::NullRange);
+	void read(cl::Buffer*, size_t offset, size_t size, void* destination);
+	void copy(cl::Buffer* source, cl::Buffer* destination, size_t size);
+	void download(cl::Buffer*, size_t offset, size_t size, void* destination,
+			const cl::Event& after, cl::Event* done);
+	void upload(cl::Buffer*, size_t offset, size_t size, const void* source,
+			const cl::Event& after, cl::Event* done);
+	void readElsewhere(cl::Buffer*, const cl::Event&);
+	void flush();
+	void finish();
+	cl_ulong busyTime() { return busy; } //ns the device spent on the last frame, when logging
+
+private:
+	void dependOn(std::vector<cl::Event>&, cl::Buffer*, bool write);
+	void transferred(cl::Buffer*, bool write, cl::Event&);
+
+	OpenCL* opencl;
+	cl::CommandQueue* queue;
+
+	//Last kernel that wrote each buffer, and the kernels reading it since
+	std::map<cl_mem, cl::Event> lastWrite;
+	std::map<cl_mem, std::vector<cl::Event> > readers;
+
+	//Everything enqueued this frame, with kernel names for the profile log
+	std::vector<cl::Event> events;
+	std::vector<cl::Kernel> kernels;
+	std::vector<cl::Event> transfers;
+	cl_ulong busy;
+};
@@ -3,7 +3,9 @@
 * Main simulation code, contains kernels for all the stages.
 * 
 * Variables:
-* N - the simulation resolution
+* N - the simulation resolution: N.x, N.y, N.z interior cells along each
+*     axis and N.w the longest of them, the length the cell size h = 1/N.w
+*     and the velocities are scaled by (so cells stay cubic)
 * dt - the timestep
 * a - an intermediate value derived from the viscosity parameters
 * u, v, w - velocity field
@@ -13,19 +15,75 @@
 #pragma OPENCL EXTENSION cl_khr_3d_image_writes : enable
 
 //Index and swap
-#define IX(i,j,l) ((i)+(N+2)*(j)+(N+2)*(N+2)*(l))
+//(IXn indexes a volume of other extents n, e.g. another multigrid level)
+#define IXn(n,i,j,l) ((i)+((n).x+2)*((j)+((n).y+2)*(l)))
+#define IX(i,j,l) IXn(N,i,j,l)
 #define SWAP(x0,x) {float *tmp=x0;x0=x;x=tmp;}
 
-//addSource: adds a field (s) to another (x)
-__kernel void addSource (float dt, __global float * x, __global float * s)
+/*
+ * Extents of the simulation volume. The kernels working on it take them as
+ * n and begin with EXTENTS(n), which makes them N. Built specialized to the
+ * extents (-DNX, -DNY, -DNZ and -DNW, see -specialize) N is a compile-time
+ * constant instead and the argument is ignored, so IX has constant strides
+ * and the bounds are known. Multigrid levels and resampling take theirs
+ * as N, they differ from the volume's.
+ */
+#ifdef NX
+#define EXTENTS(n) const int4 N = (int4)(NX, NY, NZ, NW)
+#else
+#define EXTENTS(n) const int4 N = (n)
+#endif
+
+/*
+ * Storage type of the fields. Built with -DHALF_STORAGE they are kept as
+ * half, which halves the memory traffic, and converted on every load and
+ * store - all the arithmetic is still done in float. Fields are only
+ * accessed through LD and ST (LD4 and ST4 for 4 consecutive values).
+ * The working vectors of the conjugate gradient solve stay float.
+ */
+#ifdef HALF_STORAGE
+typedef half store_t;
+#define LD(x,i) vload_half((i), (x))
+#define ST(x,i,value) vstore_half((value), (i), (x))
+#define LD4(x,i) vload_half4(0, (x) + (i))
+#define ST4(x,i,value) vstore_half4((value), 0, (x) + (i))
+#else
+typedef float store_t;
+#define LD(x,i) ((x)[i])
+#define ST(x,i,value) ((x)[i] = (value))
+#define LD4(x,i) vload4(0, (x) + (i))
+#define ST4(x,i,value) vstore4((value), 0, (x) + (i))
+#endif
+
+//addSource: adds a field (s) to another (x), 4 voxels from i on.
+//The last work-item gets the voxels % 4 left over one by one.
+void addSource (int voxels, float dt, __global store_t * x, __global store_t * s, int i)
+{
+	//Use coalesced memory accesses
+	if(i + 4 <= voxels)
+		ST4(x, i, LD4(x, i) + dt*LD4(s, i));
+	else for(; i < voxels; i++)
+		ST(x, i, LD(x, i) + dt*LD(s, i));
+}
+
+//addSources: addSource for up to 4 field/source pairs in one launch,
+//those with their bit set in fields. Launched over (voxels + 3) / 4 work-items.
+__kernel void addSources (int voxels, float dt, int fields,
+	__global store_t * x0, __global store_t * s0, __global store_t * x1, __global store_t * s1,
+	__global store_t * x2, __global store_t * s2, __global store_t * x3, __global store_t * s3)
 {
 	int i = get_global_id(0) * 4;
 
-	//Use coalesced memory accesses
-	x[i] += dt*s[i];
-	x[i+1] += dt*s[i+1];
-	x[i+2] += dt*s[i+2];
-	x[i+3] += dt*s[i+3];
+	if(fields & 1) addSource(voxels, dt, x0, s0, i);
+	if(fields & 2) addSource(voxels, dt, x1, s1, i);
+	if(fields & 4) addSource(voxels, dt, x2, s2, i);
+	if(fields & 8) addSource(voxels, dt, x3, s3, i);
+}
+
+//clearField: zeroes a field, one work-item per voxel (walls included)
+__kernel void clearField (__global store_t * x)
+{
+	ST(x, get_global_id(0), 0.0f);
 }
 
 //setBound: zero out velocity and density on the walls that would otherwies make the fluid leave the container
@@ -33,8 +91,11 @@ __kernel void addSource (float dt, __global float * x, __global float * s)
 //1 - flip sign for y-aligned sides
 //2 - flip sign for x-aligned sides
 //3 - flip sign for z-aligned sides
-__kernel void setBound(int N, int b, __global float * x) 
-{ 
+//Launched over (M+1, M+1), M being the longest side. Each face and edge is
+//written by the work-items within its own extents.
+__kernel void setBound(int4 n, int b, __global store_t * x) 
+{
+	EXTENTS(n);
 	int i = get_global_id(0);
 	int j = get_global_id(1);
 
@@ -42,110 +103,187 @@ __kernel void setBound(int N, int b, __global float * x)
 	if(i >= 1 && j >= 1)
 	{
 		//Front, back faces
-		x[IX(i, j, 0)] = b==3 ? -x[IX(i,j,1)] : x[IX(i,j,1)]; 
-		x[IX(i, j, N+1)] = b==3 ? -x[IX(i,j,N)] : x[IX(i,j,N)]; 
+		if(i <= N.x && j <= N.y)
+		{
+			ST(x, IX(i, j, 0), b==3 ? -LD(x, IX(i,j,1)) : LD(x, IX(i,j,1)));
+			ST(x, IX(i, j, N.z+1), b==3 ? -LD(x, IX(i,j,N.z)) : LD(x, IX(i,j,N.z)));
+		}
 		//Top, bottom faces
-		x[IX(i, N+1, j)] = b==2 ? -x[IX(i,N,j)] : x[IX(i,N,j)]; 
-		x[IX(i, 0, j)] = b==2 ? -x[IX(i,1,j)] : x[IX(i,1,j)]; 
+		if(i <= N.x && j <= N.z)
+		{
+			ST(x, IX(i, N.y+1, j), b==2 ? -LD(x, IX(i,N.y,j)) : LD(x, IX(i,N.y,j)));
+			ST(x, IX(i, 0, j), b==2 ? -LD(x, IX(i,1,j)) : LD(x, IX(i,1,j)));
+		}
 		//Left, right faces
-		x[IX(0, i, j)] = b==1 ? -x[IX(1,i,j)] : x[IX(1,i,j)]; 
-		x[IX(N+1,i, j)] = b==1 ? -x[IX(N,i,j)] : x[IX(N,i,j)]; 
+		if(i <= N.y && j <= N.z)
+		{
+			ST(x, IX(0, i, j), b==1 ? -LD(x, IX(1,i,j)) : LD(x, IX(1,i,j)));
+			ST(x, IX(N.x+1,i, j), b==1 ? -LD(x, IX(N.x,i,j)) : LD(x, IX(N.x,i,j)));
+		}
 	}
 	//Edges (12 in total)
 	else if(i >= 1 && j == 0)
 	{
 		//Front face edges
-		x[IX(0  ,i, 0)] = x[IX(1,i,1)]; 
-		x[IX(N+1,i, 0)] = x[IX(N,i,1)]; 
-		x[IX(i,0  , 0)] = x[IX(i,1,1)]; 		
-		x[IX(i,N+1, 0)] = x[IX(i,N,1)]; 		
+		if(i <= N.y)
+		{
+			ST(x, IX(0    ,i, 0), LD(x, IX(1,i,1)));
+			ST(x, IX(N.x+1,i, 0), LD(x, IX(N.x,i,1)));
+		}
+		if(i <= N.x)
+		{
+			ST(x, IX(i,0    , 0), LD(x, IX(i,1,1)));
+			ST(x, IX(i,N.y+1, 0), LD(x, IX(i,N.y,1)));
+		}
 
 		//Back face edges
-		x[IX(0  ,i, N+1)] = x[IX(1,i,N)]; 
-		x[IX(N+1,i, N+1)] = x[IX(N,i,N)]; 
-		x[IX(i,0  , N+1)] = x[IX(i,1,N)]; 		
-		x[IX(i,N+1, N+1)] = x[IX(i,N,N)]; 		
+		if(i <= N.y)
+		{
+			ST(x, IX(0    ,i, N.z+1), LD(x, IX(1,i,N.z)));
+			ST(x, IX(N.x+1,i, N.z+1), LD(x, IX(N.x,i,N.z)));
+		}
+		if(i <= N.x)
+		{
+			ST(x, IX(i,0    , N.z+1), LD(x, IX(i,1,N.z)));
+			ST(x, IX(i,N.y+1, N.z+1), LD(x, IX(i,N.y,N.z)));
+		}
 		
-		//Bottom edges of the z-faces
-		x[IX(0  ,0, i)] =  x[IX(1,1,i)]; 
-		x[IX(N+1,0, i)] =  x[IX(N,1,i)]; 
-		//Top edges of the z-faces
-		x[IX(0,  N+1,i)] = x[IX(1,N,i)]; 		
-		x[IX(N+1,N+1,i)] = x[IX(N,N,i)]; 		
+		if(i <= N.z)
+		{
+			//Bottom edges of the z-faces
+			ST(x, IX(0    ,0, i), LD(x, IX(1,1,i)));
+			ST(x, IX(N.x+1,0, i), LD(x, IX(N.x,1,i)));
+			//Top edges of the z-faces
+			ST(x, IX(0,    N.y+1,i), LD(x, IX(1,N.y,i)));
+			ST(x, IX(N.x+1,N.y+1,i), LD(x, IX(N.x,N.y,i)));
+		}
 	} 
 	//Corners
 	else if(i == 0 && j == 0)
 	{
-		x[IX(0  ,0  , 0  )] = x[IX(1, 1, 1)];
-		x[IX(0  ,N+1, 0  )] = x[IX(1, N, 1)];
-		x[IX(N+1,0  , 0  )] = x[IX(N, 1, 1)];
-		x[IX(N+1,N+1, 0  )] = x[IX(N, N, 1)];
-		x[IX(0  ,0  , N+1)] = x[IX(1, 1, N)];
-		x[IX(0  ,N+1, N+1)] = x[IX(1, N, N)];
-		x[IX(N+1,0  , N+1)] = x[IX(N, 1, N)];
-		x[IX(N+1,N+1, N+1)] = x[IX(N, N, N)];
+		ST(x, IX(0    ,0    , 0    ), LD(x, IX(1, 1, 1)));
+		ST(x, IX(0    ,N.y+1, 0    ), LD(x, IX(1, N.y, 1)));
+		ST(x, IX(N.x+1,0    , 0    ), LD(x, IX(N.x, 1, 1)));
+		ST(x, IX(N.x+1,N.y+1, 0    ), LD(x, IX(N.x, N.y, 1)));
+		ST(x, IX(0    ,0    , N.z+1), LD(x, IX(1, 1, N.z)));
+		ST(x, IX(0    ,N.y+1, N.z+1), LD(x, IX(1, N.y, N.z)));
+		ST(x, IX(N.x+1,0    , N.z+1), LD(x, IX(N.x, 1, N.z)));
+		ST(x, IX(N.x+1,N.y+1, N.z+1), LD(x, IX(N.x, N.y, N.z)));
 	}
 } 
 
+//boundCell: the part of setBound that depends on one interior cell (i,j,l).
+//A kernel that has just computed the cell writes the walls next to it in the same
+//launch, instead of a separate setBound pass over the faces. Faces get the sign
+//flip of mode b, edges and corners are plain copies, exactly as in setBound.
+//(The body is a macro so that it also serves the float working vectors of
+//the conjugate gradient solve, boundCellScratch, whatever the storage type.)
+#define BOUND_CELL(STORE) \
+	/*Direction of the wall along each axis, 0 if the cell isn't next to one*/ \
+	int di = i == 1 ? -1 : (i == N.x ? 1 : 0); \
+	int dj = j == 1 ? -1 : (j == N.y ? 1 : 0); \
+	int dl = l == 1 ? -1 : (l == N.z ? 1 : 0); \
+ \
+	/*Faces*/ \
+	if(di != 0) STORE(x, IX(i+di, j, l), b==1 ? -value : value); \
+	if(dj != 0) STORE(x, IX(i, j+dj, l), b==2 ? -value : value); \
+	if(dl != 0) STORE(x, IX(i, j, l+dl), b==3 ? -value : value); \
+ \
+	/*Edges*/ \
+	if(di != 0 && dj != 0) STORE(x, IX(i+di, j+dj, l), value); \
+	if(di != 0 && dl != 0) STORE(x, IX(i+di, j, l+dl), value); \
+	if(dj != 0 && dl != 0) STORE(x, IX(i, j+dj, l+dl), value); \
+ \
+	/*Corners*/ \
+	if(di != 0 && dj != 0 && dl != 0) STORE(x, IX(i+di, j+dj, l+dl), value);
+
+#define STORE_FLOAT(x,i,value) ((x)[i] = (value))
+
+void boundCell(int4 N, int b, __global store_t * x, int i, int j, int l, float value)
+{
+	BOUND_CELL(ST)
+}
+
+void boundCellScratch(int4 N, int b, __global float * x, int i, int j, int l, float value)
+{
+	BOUND_CELL(STORE_FLOAT)
+}
+
 //Project phase 1
-__kernel void project1( int N, __global float * u, __global float * v, __global float * w, __global float * p, __global float * div )
+__kernel void project1( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div )
 {
+	EXTENTS(n);
 	int i = get_global_id(0) + 1;
 	int j = get_global_id(1) + 1;
 	int l = get_global_id(2) + 1;
-	float h = 1.0/N;
+	float h = 1.0/N.w;
+
+	ST(div, IX(i,j,l), -0.5*h*(
+			LD(u, IX(i+1,j,l))-LD(u, IX(i-1,j,l))+
+			LD(v, IX(i,j+1,l))-LD(v, IX(i,j-1,l))+
+			LD(w, IX(i,j,l+1))-LD(w, IX(i,j,l-1))));
+	ST(p, IX(i,j,l), 0);
+}
 
-	div[IX(i,j,l)] = -0.5*h*(
-			u[IX(i+1,j,l)]-u[IX(i-1,j,l)]+
-			v[IX(i,j+1,l)]-v[IX(i,j-1,l)]+
-			w[IX(i,j,l+1)]-w[IX(i,j,l-1)]);
-	p[IX(i,j,l)] = 0;
+//Project phase 2 (iterative) - one cell
+float project2Cell( int4 N, __global store_t * p, __global store_t * div, int i, int j, int l )
+{
+	return (LD(div, IX(i,j,l))
+		+LD(p, IX(i-1,j,l))+LD(p, IX(i+1,j,l))
+		+LD(p, IX(i,j-1,l))+LD(p, IX(i,j+1,l))
+		+LD(p, IX(i,j,l-1))+LD(p, IX(i,j,l+1)))/6;
 }
 
 //Project phase 2 (iterative)
-__kernel void project2( int N, __global float * u, __global float * v, __global float * w, __global float * p, __global float * div )
+__kernel void project2( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div )
 {
+	EXTENTS(n);
 	int i = get_global_id(0) + 1;
 	int j = get_global_id(1) + 1;
 	int l = get_global_id(2) + 1;
 
-	p[IX(i,j,l)] = (div[IX(i,j,l)]
-		+p[IX(i-1,j,l)]+p[IX(i+1,j,l)]
-		+p[IX(i,j-1,l)]+p[IX(i,j+1,l)]
-		+p[IX(i,j,l-1)]+p[IX(i,j,l+1)])/6;
+	ST(p, IX(i,j,l), project2Cell(N, p, div, i, j, l));
 }
 
 //Project phase 3
-__kernel void project3( int N, __global float * u, __global float * v, __global float * w, __global float * p, __global float * div )
+__kernel void project3( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div )
 {
+	EXTENTS(n);
 	int i = get_global_id(0) + 1;
 	int j = get_global_id(1) + 1;
 	int l = get_global_id(2) + 1;
 
-	float h = 1.0/N;
+	float h = 1.0/N.w;
+
+	ST(u, IX(i,j,l), LD(u, IX(i,j,l)) - (0.5*(LD(p, IX(i+1,j,l))-LD(p, IX(i-1,j,l)))/h));
+	ST(v, IX(i,j,l), LD(v, IX(i,j,l)) - (0.5*(LD(p, IX(i,j+1,l))-LD(p, IX(i,j-1,l)))/h));
+	ST(w, IX(i,j,l), LD(w, IX(i,j,l)) - (0.5*(LD(p, IX(i,j,l+1))-LD(p, IX(i,j,l-1)))/h));
+}
+
+//Diffusion part (also iterative) - one cell
+float diffuseCell (int4 N, float a, __global store_t * x, __global store_t * x0, int i, int j, int l)
+{
+	float t1 = LD(x, IX(i-1,j,l))+LD(x, IX(i+1,j,l));
+	float t2 = LD(x, IX(i,j-1,l))+LD(x, IX(i,j+1,l));
+	float t3 = LD(x, IX(i,j,l-1))+LD(x, IX(i,j,l+1));
 
-	u[IX(i,j,l)] -= 0.5*(p[IX(i+1,j,l)]-p[IX(i-1,j,l)])/h;
-	v[IX(i,j,l)] -= 0.5*(p[IX(i,j+1,l)]-p[IX(i,j-1,l)])/h;
-	w[IX(i,j,l)] -= 0.5*(p[IX(i,j,l+1)]-p[IX(i,j,l-1)])/h;
+	return (LD(x0, IX(i,j,l)) +	a*(t1 + t2 + t3)) / (1+6*a);
 }
 
 //Diffusion part (also iterative)
-__kernel void diffuse (int N, float a, __global float * x, __global float * x0)
+__kernel void diffuse (int4 n, float a, __global store_t * x, __global store_t * x0)
 {
+	EXTENTS(n);
 	int i = get_global_id(0) + 1;
 	int j = get_global_id(1) + 1;
 	int l = get_global_id(2) + 1;
 
-	float t1 = x[IX(i-1,j,l)]+x[IX(i+1,j,l)];
-	float t2 = x[IX(i,j-1,l)]+x[IX(i,j+1,l)];
-	float t3 = x[IX(i,j,l-1)]+x[IX(i,j,l+1)];
-
-	x[IX(i,j,l)] = (x0[IX(i,j,l)] +	a*(t1 + t2 + t3)) / (1+6*a);;
+	ST(x, IX(i,j,l), diffuseCell(N, a, x, x0, i, j, l));
 }
 
 //The twice slower image3d version (not used)
 /*
-__kernel void diffuse_image3d (int N, float a, __read_only image3d_t x, __read_only image3d_t x0, __write_only image3d_t x_out)
+__kernel void diffuse_image3d (int4 N, float a, __read_only image3d_t x, __read_only image3d_t x0, __write_only image3d_t x_out)
 {
 	int i = get_global_id(0) + 1;
 	int j = get_global_id(1) + 1;
@@ -163,38 +301,35 @@ __kernel void diffuse_image3d (int N, float a, __read_only image3d_t x, __read_o
 }
 */
 
-//Advection
-__kernel void advect ( int N, int b,
-	__global float * d, __global float * d0, 
-	__global float * u, __global float * v, __global float * w, float dt )
+//Advection - one cell
+//zClamp bounds the z backtrace: (0.5, N.z + 0.5) at walls, (0, N.z + 1) to reach into ghost planes
+float advectCell ( int4 N, __global store_t * d0,
+	__global store_t * u, __global store_t * v, __global store_t * w, float dt, float2 zClamp, int i, int j, int l )
 {
-	int i = get_global_id(0) + 1;
-	int j = get_global_id(1) + 1;
-	int l = get_global_id(2) + 1;
 	int i0, j0, l0, i1, j1, l1;
 	float x, y, z, s0, t0, r0, s1, t1, r1, dt0;
-	dt0 = dt*N;
+	dt0 = dt*N.w;
 
 	//Trace velocity back to corrdinates (x, y, z)
 	//(current cell) - (velocity vector) = (source point)
-	x = (float)i-dt0*u[IX(i,j,l)];
-	y = (float)j-dt0*v[IX(i,j,l)];
-	z = (float)l-dt0*w[IX(i,j,l)];
+	x = (float)i-dt0*LD(u, IX(i,j,l));
+	y = (float)j-dt0*LD(v, IX(i,j,l));
+	z = (float)l-dt0*LD(w, IX(i,j,l));
 
 	//1. Prevent going out of bounds
 	//2. Convert coordinates (xyz : float) to cells (ijl : int)
 	//(i1,j1,l1) are (i0,j0,l1) + 1
 
 	/* Non-linear:
-	if (x<0.5) x=0.5; if (x>N+0.5) x=N+ 0.5; i0=(int)x; i1=i0+1;
-	if (y<0.5) y=0.5; if (y>N+0.5) y=N+ 0.5; j0=(int)y; j1=j0+1;
-	if (z<0.5) z=0.5; if (z>N+0.5) z=N+ 0.5; l0=(int)z; l1=l0+1;
+	if (x<0.5) x=0.5; if (x>N.x+0.5) x=N.x+ 0.5; i0=(int)x; i1=i0+1;
+	if (y<0.5) y=0.5; if (y>N.y+0.5) y=N.y+ 0.5; j0=(int)y; j1=j0+1;
+	if (z<0.5) z=0.5; if (z>N.z+0.5) z=N.z+ 0.5; l0=(int)z; l1=l0+1;
 	*/
 
 	//Optimised for linearity:
-	x = clamp(x, (float)0.5, (float)(N + 0.5)); i0=(int)x; i1=i0+1;
-	y = clamp(y, (float)0.5, (float)(N + 0.5)); j0=(int)y; j1=j0+1;
-	z = clamp(z, (float)0.5, (float)(N + 0.5)); l0=(int)z; l1=l0+1;
+	x = clamp(x, (float)0.5, (float)(N.x + 0.5)); i0=(int)x; i1=i0+1;
+	y = clamp(y, (float)0.5, (float)(N.y + 0.5)); j0=(int)y; j1=j0+1;
+	z = clamp(z, zClamp.x, zClamp.y); l0=(int)z; l1=min(l0+1, N.z+1);
 
 
 	//str = the error of (i,j,l) from (xyz) from the rounding
@@ -203,80 +338,1055 @@ __kernel void advect ( int N, int b,
 	t1 = y-j0; t0 = 1-t1;
 	r1 = z-l0; r0 = 1-r1;
 
-	//Set current cell (ijl) to interpolated values
-	//sampled from the source point's surrounding cells
-	d[IX(i,j,l)] = 
+	//Interpolated value sampled from the source point's surrounding cells
+	return
+		 s0*(r0*(t0*LD(d0, IX(i0,j0,l0))+t1*LD(d0, IX(i0,j1,l0)))
+		+r1*(t0*LD(d0, IX(i0,j0,l1))+t1*LD(d0, IX(i0,j1,l1))))
+		+s1*(r0*(t0*LD(d0, IX(i1,j0,l0))+t1*LD(d0, IX(i1,j1,l0)))
+		+r1*(t0*LD(d0, IX(i1,j0,l1))+t1*LD(d0, IX(i1,j1,l1))));
+}
+
+//Advection
+__kernel void advect ( int4 n, int b,
+	__global store_t * d, __global store_t * d0, 
+	__global store_t * u, __global store_t * v, __global store_t * w, float dt, float2 zClamp )
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	//Set current cell (ijl) to the value found at the source point
+	ST(d, IX(i,j,l), advectCell(N, d0, u, v, w, dt, zClamp, i, j, l));
+}
+
+/*
+ * Fused variants - each computes its cells and then writes the walls next
+ * to them (boundCell), so no setBound launch is needed after them.
+ * Arguments are the same as for the plain kernels, diffuseBound has b at the end.
+ */
+__kernel void diffuseBound (int4 n, float a, __global store_t * x, __global store_t * x0, int b)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	float value = diffuseCell(N, a, x, x0, i, j, l);
+	ST(x, IX(i,j,l), value);
+	boundCell(N, b, x, i, j, l, value);
+}
+
+__kernel void project1Bound( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div )
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	float h = 1.0/N.w;
+
+	float value = -0.5*h*(
+			LD(u, IX(i+1,j,l))-LD(u, IX(i-1,j,l))+
+			LD(v, IX(i,j+1,l))-LD(v, IX(i,j-1,l))+
+			LD(w, IX(i,j,l+1))-LD(w, IX(i,j,l-1)));
+	ST(div, IX(i,j,l), value);
+	boundCell(N, 0, div, i, j, l, value);
+	ST(p, IX(i,j,l), 0);
+	boundCell(N, 0, p, i, j, l, 0);
+}
+
+__kernel void project2Bound( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div )
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	float value = project2Cell(N, p, div, i, j, l);
+	ST(p, IX(i,j,l), value);
+	boundCell(N, 0, p, i, j, l, value);
+}
+
+__kernel void project3Bound( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div )
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	float h = 1.0/N.w;
+
+	float value = LD(u, IX(i,j,l)) - 0.5*(LD(p, IX(i+1,j,l))-LD(p, IX(i-1,j,l)))/h;
+	ST(u, IX(i,j,l), value);
+	boundCell(N, 1, u, i, j, l, value);
+	value = LD(v, IX(i,j,l)) - 0.5*(LD(p, IX(i,j+1,l))-LD(p, IX(i,j-1,l)))/h;
+	ST(v, IX(i,j,l), value);
+	boundCell(N, 2, v, i, j, l, value);
+	value = LD(w, IX(i,j,l)) - 0.5*(LD(p, IX(i,j,l+1))-LD(p, IX(i,j,l-1)))/h;
+	ST(w, IX(i,j,l), value);
+	boundCell(N, 3, w, i, j, l, value);
+}
+
+__kernel void advectBound ( int4 n, int b,
+	__global store_t * d, __global store_t * d0, 
+	__global store_t * u, __global store_t * v, __global store_t * w, float dt, float2 zClamp )
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	float value = advectCell(N, d0, u, v, w, dt, zClamp, i, j, l);
+	ST(d, IX(i,j,l), value);
+	boundCell(N, b, d, i, j, l, value);
+}
+
+/*
+ * Red-black Gauss-Seidel with over-relaxation (SOR).
+ *
+ * Cells with ((i+j+l) & 1) == parity are updated in one launch and only read
+ * cells of the other colour, so unlike the in-place diffuse/project2 there is
+ * no race and convergence is the same on every device. One solver step is a
+ * red launch followed by a black one, each over ((N.x+1)/2, N.y, N.z) work-items.
+ */
+int redBlackI(int j, int l, int parity)
+{
+	return 2*get_global_id(0) + 1 + ((parity + 1 + j + l) & 1);
+}
+
+__kernel void diffuseRedBlack (int4 n, float a, __global store_t * x, __global store_t * x0, int b, int parity, float omega)
+{
+	EXTENTS(n);
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	int i = redBlackI(j, l, parity);
+	if(i > N.x)
+		return;
+
+	float value = (1 - omega)*LD(x, IX(i,j,l)) + omega*diffuseCell(N, a, x, x0, i, j, l);
+	ST(x, IX(i,j,l), value);
+	boundCell(N, b, x, i, j, l, value);
+}
+
+__kernel void project2RedBlack( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div, int parity, float omega )
+{
+	EXTENTS(n);
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	int i = redBlackI(j, l, parity);
+	if(i > N.x)
+		return;
+
+	float value = (1 - omega)*LD(p, IX(i,j,l)) + omega*project2Cell(N, p, div, i, j, l);
+	ST(p, IX(i,j,l), value);
+	boundCell(N, 0, p, i, j, l, value);
+}
+
+/*
+ * Tiled variants of the stencil kernels. Each work-group first copies its
+ * brick of cells plus a one-cell halo from global into local memory, so the
+ * 6 neighbour reads of every cell come from local memory and each value is
+ * fetched from global memory about once per group instead of 7 times.
+ *
+ * The brick is the work-group size, the global size is rounded up to a
+ * multiple of it and the work-items outside the volume only help with the
+ * load. tile has (lx+2)*(ly+2)*(lz+2) floats per field. Walls are written
+ * in the same launch, as in the fused kernels.
+ */
+void loadTile(int4 N, __global store_t * x, __local float * tile)
+{
+	int sx = get_local_size(0) + 2;
+	int sy = get_local_size(1) + 2;
+	int count = sx * sy * (get_local_size(2) + 2);
+	int threads = get_local_size(0) * get_local_size(1) * get_local_size(2);
+
+	//Corner of the brick's halo in the volume
+	int i0 = get_group_id(0) * get_local_size(0);
+	int j0 = get_group_id(1) * get_local_size(1);
+	int l0 = get_group_id(2) * get_local_size(2);
+
+	for(int t = get_local_id(0) + get_local_size(0) * (get_local_id(1) + get_local_size(1) * get_local_id(2)); t < count; t += threads)
+	{
+		int i = min(i0 + t % sx, N.x + 1);
+		int j = min(j0 + (t / sx) % sy, N.y + 1);
+		int l = min(l0 + t / (sx * sy), N.z + 1);
+		tile[t] = LD(x, IX(i,j,l));
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+//Value in the tile at an offset from this work-item's cell
+float tileAt(__local float * tile, int di, int dj, int dl)
+{
+	int sx = get_local_size(0) + 2;
+	int sy = get_local_size(1) + 2;
+	return tile[(get_local_id(0) + 1 + di) + sx * ((get_local_id(1) + 1 + dj) + sy * (get_local_id(2) + 1 + dl))];
+}
+
+//Sum of the 6 neighbours in the tile
+float tileNeighbours(__local float * tile)
+{
+	return tileAt(tile, -1, 0, 0) + tileAt(tile, 1, 0, 0)
+		+ tileAt(tile, 0, -1, 0) + tileAt(tile, 0, 1, 0)
+		+ tileAt(tile, 0, 0, -1) + tileAt(tile, 0, 0, 1);
+}
+
+__kernel void diffuseTiled (int4 n, float a, __global store_t * x, __global store_t * x0, int b, __local float * tile)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	loadTile(N, x, tile);
+	if(i > N.x || j > N.y || l > N.z)
+		return;
+
+	float value = (LD(x0, IX(i,j,l)) + a*tileNeighbours(tile)) / (1+6*a);
+	ST(x, IX(i,j,l), value);
+	boundCell(N, b, x, i, j, l, value);
+}
+
+//tile holds u, v and w one after the other here
+__kernel void project1Tiled( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div, __local float * tile )
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	int count = (get_local_size(0) + 2) * (get_local_size(1) + 2) * (get_local_size(2) + 2);
+	float h = 1.0/N.w;
+
+	loadTile(N, u, tile);
+	loadTile(N, v, tile + count);
+	loadTile(N, w, tile + 2*count);
+	if(i > N.x || j > N.y || l > N.z)
+		return;
+
+	float value = -0.5*h*(
+			tileAt(tile, 1, 0, 0) - tileAt(tile, -1, 0, 0) +
+			tileAt(tile + count, 0, 1, 0) - tileAt(tile + count, 0, -1, 0) +
+			tileAt(tile + 2*count, 0, 0, 1) - tileAt(tile + 2*count, 0, 0, -1));
+	ST(div, IX(i,j,l), value);
+	boundCell(N, 0, div, i, j, l, value);
+	ST(p, IX(i,j,l), 0);
+	boundCell(N, 0, p, i, j, l, 0);
+}
+
+__kernel void project2Tiled( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div, __local float * tile )
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	loadTile(N, p, tile);
+	if(i > N.x || j > N.y || l > N.z)
+		return;
+
+	float value = (LD(div, IX(i,j,l)) + tileNeighbours(tile))/6;
+	ST(p, IX(i,j,l), value);
+	boundCell(N, 0, p, i, j, l, value);
+}
+
+__kernel void project3Tiled( int4 n, __global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div, __local float * tile )
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	float h = 1.0/N.w;
+
+	loadTile(N, p, tile);
+	if(i > N.x || j > N.y || l > N.z)
+		return;
+
+	float value = LD(u, IX(i,j,l)) - 0.5*(tileAt(tile, 1, 0, 0) - tileAt(tile, -1, 0, 0))/h;
+	ST(u, IX(i,j,l), value);
+	boundCell(N, 1, u, i, j, l, value);
+	value = LD(v, IX(i,j,l)) - 0.5*(tileAt(tile, 0, 1, 0) - tileAt(tile, 0, -1, 0))/h;
+	ST(v, IX(i,j,l), value);
+	boundCell(N, 2, v, i, j, l, value);
+	value = LD(w, IX(i,j,l)) - 0.5*(tileAt(tile, 0, 0, 1) - tileAt(tile, 0, 0, -1))/h;
+	ST(w, IX(i,j,l), value);
+	boundCell(N, 3, w, i, j, l, value);
+}
+
+/*
+ * Temporal blocking: several Jacobi sweeps of c x - a (sum of neighbours) = x0
+ * in one launch (diffusion: a, 1+6a; pressure: 1, 6 with x0 = div).
+ *
+ * Each work-group loads its brick with a halo as deep as the number of
+ * sweeps, then sweeps in local memory. After sweep s the cells less than s
+ * from the edge of the tile are stale, so the updated region shrinks by one
+ * cell a sweep and only the brick itself is written out, with its walls.
+ * Neighbouring tiles overlap and recompute some cells, but the volume goes
+ * through global memory once per launch instead of once per sweep.
+ *
+ * The tiles read x around the brick, so the result goes to another buffer (out).
+ * tile, next and source have (lx+2*sweeps)*(ly+2*sweeps)*(lz+2*sweeps) floats.
+ */
+__kernel void jacobiBlocked (int4 n, float a, float c, __global store_t * x, __global store_t * x0, __global store_t * out,
+	int b, int sweeps, __local float * tile, __local float * next, __local float * source)
+{
+	EXTENTS(n);
+	int sx = get_local_size(0) + 2*sweeps;
+	int sy = get_local_size(1) + 2*sweeps;
+	int sz = get_local_size(2) + 2*sweeps;
+	int count = sx * sy * sz;
+	int threads = get_local_size(0) * get_local_size(1) * get_local_size(2);
+	int first = get_local_id(0) + get_local_size(0) * (get_local_id(1) + get_local_size(1) * get_local_id(2));
+
+	//Volume coordinates of the first cell of the tile
+	int i0 = get_group_id(0) * get_local_size(0) + 1 - sweeps;
+	int j0 = get_group_id(1) * get_local_size(1) + 1 - sweeps;
+	int l0 = get_group_id(2) * get_local_size(2) + 1 - sweeps;
+
+	for(int t = first; t < count; t += threads)
+	{
+		int i = clamp(i0 + t % sx, 0, N.x + 1);
+		int j = clamp(j0 + (t / sx) % sy, 0, N.y + 1);
+		int l = clamp(l0 + t / (sx * sy), 0, N.z + 1);
+		tile[t] = LD(x, IX(i,j,l));
+		source[t] = LD(x0, IX(i,j,l));
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(int s = 1; s <= sweeps; s++)
+	{
+		//Interior cells still valid after this sweep
+		for(int t = first; t < count; t += threads)
+		{
+			int ti = t % sx, tj = (t / sx) % sy, tl = t / (sx * sy);
+			int i = i0 + ti, j = j0 + tj, l = l0 + tl;
+			if(ti < s || tj < s || tl < s || ti >= sx - s || tj >= sy - s || tl >= sz - s)
+				continue;
+			if(i < 1 || j < 1 || l < 1 || i > N.x || j > N.y || l > N.z)
+				continue;
+
+			next[t] = (source[t] + a*(tile[t-1] + tile[t+1] + tile[t-sx] + tile[t+sx]
+				+ tile[t-sx*sy] + tile[t+sx*sy])) / c;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		//Walls in the same region, from the new interior values as in setBound
+		for(int t = first; t < count; t += threads)
+		{
+			int ti = t % sx, tj = (t / sx) % sy, tl = t / (sx * sy);
+			int i = i0 + ti, j = j0 + tj, l = l0 + tl;
+			if(ti < s || tj < s || tl < s || ti >= sx - s || tj >= sy - s || tl >= sz - s)
+				continue;
+			if(i < 0 || j < 0 || l < 0 || i > N.x + 1 || j > N.y + 1 || l > N.z + 1)
+				continue;
+
+			//Interior cell the wall copies from, diagonal for edges and corners
+			int si = clamp(i, 1, N.x), sj = clamp(j, 1, N.y), sl = clamp(l, 1, N.z);
+			int walls = (si != i) + (sj != j) + (sl != l);
+			if(walls == 0)
+				continue;
+
+			float value = next[t + (si - i) + sx * ((sj - j) + sy * (sl - l))];
+			if(walls == 1 && ((b == 1 && si != i) || (b == 2 && sj != j) || (b == 3 && sl != l)))
+				value = -value;
+			next[t] = value;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		__local float * swap = tile;
+		tile = next;
+		next = swap;
+	}
+
+	//Write the brick
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	if(i > N.x || j > N.y || l > N.z)
+		return;
+
+	float value = tile[(get_local_id(0) + sweeps) + sx * ((get_local_id(1) + sweeps) + sy * (get_local_id(2) + sweeps))];
+	ST(out, IX(i,j,l), value);
+	boundCell(N, b, out, i, j, l, value);
+}
+
+/*
+ * Packed velocity: u, v, w of a cell in one float4 (w component unused),
+ * so one launch diffuses, advects or projects all three of them.
+ * The walls are written as in the fused kernels, each component with its
+ * own setBound mode (u flips on the x walls, v on y, w on z).
+ */
+void boundCellPacked(int4 N, __global float4 * x, int i, int j, int l, float4 value)
+{
+	int di = i == 1 ? -1 : (i == N.x ? 1 : 0);
+	int dj = j == 1 ? -1 : (j == N.y ? 1 : 0);
+	int dl = l == 1 ? -1 : (l == N.z ? 1 : 0);
+
+	//Faces
+	if(di != 0) x[IX(i+di, j, l)] = (float4)(-value.x, value.y, value.z, 0);
+	if(dj != 0) x[IX(i, j+dj, l)] = (float4)(value.x, -value.y, value.z, 0);
+	if(dl != 0) x[IX(i, j, l+dl)] = (float4)(value.x, value.y, -value.z, 0);
+
+	//Edges
+	if(di != 0 && dj != 0) x[IX(i+di, j+dj, l)] = value;
+	if(di != 0 && dl != 0) x[IX(i+di, j, l+dl)] = value;
+	if(dj != 0 && dl != 0) x[IX(i, j+dj, l+dl)] = value;
+
+	//Corners
+	if(di != 0 && dj != 0 && dl != 0) x[IX(i+di, j+dj, l+dl)] = value;
+}
+
+//add_source for u, v, w into the packed field
+__kernel void packVelocity (float dt, __global store_t * u, __global store_t * v, __global store_t * w,
+	__global store_t * u0, __global store_t * v0, __global store_t * w0, __global float4 * velocity)
+{
+	int i = get_global_id(0);
+
+	velocity[i] = (float4)(LD(u, i) + dt*LD(u0, i), LD(v, i) + dt*LD(v0, i), LD(w, i) + dt*LD(w0, i), 0);
+}
+
+//Back to the separate fields, which the rest of the program uses. u0, v0, w0
+//are left as the unpacked step leaves them: the pressure and divergence of
+//the last projection and w before the advection.
+__kernel void unpackVelocity (__global float4 * velocity, __global store_t * u, __global store_t * v, __global store_t * w,
+	__global float4 * velocity0, __global store_t * p, __global store_t * div,
+	__global store_t * u0, __global store_t * v0, __global store_t * w0)
+{
+	int i = get_global_id(0);
+
+	float4 value = velocity[i];
+	ST(u, i, value.x);
+	ST(v, i, value.y);
+	ST(w, i, value.z);
+	ST(u0, i, LD(p, i));
+	ST(v0, i, LD(div, i));
+	ST(w0, i, velocity0[i].z);
+}
+
+__kernel void diffusePacked (int4 n, float a, __global float4 * x, __global float4 * x0)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	float4 value = (x0[IX(i,j,l)] + a*(
+		x[IX(i-1,j,l)] + x[IX(i+1,j,l)] +
+		x[IX(i,j-1,l)] + x[IX(i,j+1,l)] +
+		x[IX(i,j,l-1)] + x[IX(i,j,l+1)])) / (1+6*a);
+	x[IX(i,j,l)] = value;
+	boundCellPacked(N, x, i, j, l, value);
+}
+
+//Same backtrace and weights as advectCell, computed once for all three components
+__kernel void advectPacked (int4 n, __global float4 * d, __global float4 * d0, __global float4 * velocity, float dt)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	float dt0 = dt*N.w;
+
+	float4 back = velocity[IX(i,j,l)];
+	float x = clamp((float)i - dt0*back.x, 0.5f, N.x + 0.5f);
+	float y = clamp((float)j - dt0*back.y, 0.5f, N.y + 0.5f);
+	float z = clamp((float)l - dt0*back.z, 0.5f, N.z + 0.5f);
+	int i0 = (int)x, i1 = i0 + 1;
+	int j0 = (int)y, j1 = j0 + 1;
+	int l0 = (int)z, l1 = l0 + 1;
+
+	float s1 = x - i0, s0 = 1 - s1;
+	float t1 = y - j0, t0 = 1 - t1;
+	float r1 = z - l0, r0 = 1 - r1;
+
+	float4 value =
 		 s0*(r0*(t0*d0[IX(i0,j0,l0)]+t1*d0[IX(i0,j1,l0)])
 		+r1*(t0*d0[IX(i0,j0,l1)]+t1*d0[IX(i0,j1,l1)]))
 		+s1*(r0*(t0*d0[IX(i1,j0,l0)]+t1*d0[IX(i1,j1,l0)])
 		+r1*(t0*d0[IX(i1,j0,l1)]+t1*d0[IX(i1,j1,l1)]));
+	d[IX(i,j,l)] = value;
+	boundCellPacked(N, d, i, j, l, value);
+}
+
+__kernel void project1Packed (int4 n, __global float4 * velocity, __global store_t * p, __global store_t * div)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	float h = 1.0f/N.w;
+
+	float value = -0.5f*h*(
+			velocity[IX(i+1,j,l)].x - velocity[IX(i-1,j,l)].x +
+			velocity[IX(i,j+1,l)].y - velocity[IX(i,j-1,l)].y +
+			velocity[IX(i,j,l+1)].z - velocity[IX(i,j,l-1)].z);
+	ST(div, IX(i,j,l), value);
+	boundCell(N, 0, div, i, j, l, value);
+	ST(p, IX(i,j,l), 0);
+	boundCell(N, 0, p, i, j, l, 0);
+}
+
+__kernel void project3Packed (int4 n, __global float4 * velocity, __global store_t * p)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	float h = 1.0f/N.w;
+
+	float4 gradient = (float4)(
+			LD(p, IX(i+1,j,l)) - LD(p, IX(i-1,j,l)),
+			LD(p, IX(i,j+1,l)) - LD(p, IX(i,j-1,l)),
+			LD(p, IX(i,j,l+1)) - LD(p, IX(i,j,l-1)), 0);
+	float4 value = velocity[IX(i,j,l)] - 0.5f*gradient/h;
+	velocity[IX(i,j,l)] = value;
+	boundCellPacked(N, velocity, i, j, l, value);
+}
+
+/*
+ * Sparse mode: the volume is cut into bricks of BRICK^3 cells and the
+ * stencils only run over the active ones, listed in an indirection table.
+ *
+ * markBricks flags the bricks holding density or velocity above a threshold
+ * and finds the fastest velocity. listBricks dilates the flags by as many
+ * bricks as that velocity crosses in a step (at least one), so the fluid can
+ * move into the bricks around it, and appends the active bricks to list.
+ * Bricks that were active last frame but aren't anymore go to a list of
+ * retired bricks, which clearBricks zeroes so no stale temporaries are left
+ * next to active ones. count holds the lengths of the two lists and the
+ * squared fastest speed (as int bits, which order like the floats).
+ *
+ * The lengths stay on the device: the launches over the lists are as large
+ * as the whole brick grid and the work-items past the length return at
+ * once, so they're the same every frame and go into the step plan.
+ */
+#define BRICK 8
+#define BRICK_CELLS (BRICK*BRICK*BRICK)
+
+__kernel void markBricks (int4 n, float threshold, __global store_t * dens,
+	__global store_t * u, __global store_t * v, __global store_t * w, __global int * flags, __global int * count)
+{
+	EXTENTS(n);
+	int bi = get_global_id(0);
+	int bj = get_global_id(1);
+	int bl = get_global_id(2);
+	if(bi == 0 && bj == 0 && bl == 0)
+	{
+		count[0] = 0;
+		count[1] = 0;
+	}
+
+	//Squared, compared to the density and the squared velocity magnitude
+	float limit = threshold*threshold;
+	int found = 0;
+	float fastest = 0;
+	for(int l = bl*BRICK + 1; l <= min(bl*BRICK + BRICK, N.z); l++)
+		for(int j = bj*BRICK + 1; j <= min(bj*BRICK + BRICK, N.y); j++)
+			for(int i = bi*BRICK + 1; i <= min(bi*BRICK + BRICK, N.x); i++)
+			{
+				float d = LD(dens, IX(i,j,l));
+				float x = LD(u, IX(i,j,l));
+				float y = LD(v, IX(i,j,l));
+				float z = LD(w, IX(i,j,l));
+				float speed = x*x + y*y + z*z;
+				found |= d*d > limit || speed > limit;
+				fastest = fmax(fastest, speed);
+			}
+	flags[bi + get_global_size(0)*(bj + get_global_size(1)*bl)] = found;
+	if(found)
+		atomic_max(&count[2], as_int(fastest));
+}
+
+//reach: bricks crossed per step at unit speed, dt*N.w/BRICK
+__kernel void listBricks (int4 bricks, __global int * flags, __global int * active, __global int * wasActive,
+	__global int * list, __global int * retired, __global int * count, float reach)
+{
+	int bi = get_global_id(0);
+	int bj = get_global_id(1);
+	int bl = get_global_id(2);
+	int brick = bi + bricks.x*(bj + bricks.y*bl);
+	int r = clamp((int)ceil(reach * sqrt(as_float(count[2]))), 1, max(bricks.x, max(bricks.y, bricks.z)));
+
+	//Active if the brick or any within r bricks of it has fluid
+	int on = 0;
+	for(int dl = -r; dl <= r && !on; dl++)
+		for(int dj = -r; dj <= r && !on; dj++)
+			for(int di = -r; di <= r && !on; di++)
+			{
+				int ni = bi + di, nj = bj + dj, nl = bl + dl;
+				if(ni >= 0 && ni < bricks.x && nj >= 0 && nj < bricks.y && nl >= 0 && nl < bricks.z)
+					on |= flags[ni + bricks.x*(nj + bricks.y*nl)];
+			}
+
+	active[brick] = on;
+	if(on)
+		list[atomic_inc(&count[0])] = brick;
+	else if(wasActive[brick])
+		retired[atomic_inc(&count[1])] = brick;
+}
+
+//Cell (i,j,l) of the work-item in a launch over listed bricks, false past
+//the length of the list or the edge of the volume
+bool brickCell(int4 N, __global int * list, int length, int * i, int * j, int * l)
+{
+	int bx = (N.x + BRICK - 1) / BRICK;
+	int by = (N.y + BRICK - 1) / BRICK;
+	int slot = get_global_id(0) / BRICK_CELLS;
+	if(slot >= length)
+		return false;
+	int brick = list[slot];
+	int cell = get_global_id(0) % BRICK_CELLS;
+
+	*i = brick % bx * BRICK + cell % BRICK + 1;
+	*j = brick / bx % by * BRICK + cell / BRICK % BRICK + 1;
+	*l = brick / (bx*by) * BRICK + cell / (BRICK*BRICK) + 1;
+	return *i <= N.x && *j <= N.y && *l <= N.z;
+}
+
+//Also starts the next frame's fastest speed over, listBricks is done with it
+__kernel void clearBricks (int4 n, __global int * list, __global int * count,
+	__global store_t * dens, __global store_t * u, __global store_t * v, __global store_t * w,
+	__global store_t * dens0, __global store_t * u0, __global store_t * v0, __global store_t * w0)
+{
+	EXTENTS(n);
+	int i, j, l;
+	if(get_global_id(0) == 0)
+		count[2] = 0;
+	if(!brickCell(N, list, count[1], &i, &j, &l))
+		return;
+
+	ST(dens, IX(i,j,l), 0); boundCell(N, 0, dens, i, j, l, 0);
+	ST(u, IX(i,j,l), 0); boundCell(N, 0, u, i, j, l, 0);
+	ST(v, IX(i,j,l), 0); boundCell(N, 0, v, i, j, l, 0);
+	ST(w, IX(i,j,l), 0); boundCell(N, 0, w, i, j, l, 0);
+	ST(dens0, IX(i,j,l), 0); boundCell(N, 0, dens0, i, j, l, 0);
+	ST(u0, IX(i,j,l), 0); boundCell(N, 0, u0, i, j, l, 0);
+	ST(v0, IX(i,j,l), 0); boundCell(N, 0, v0, i, j, l, 0);
+	ST(w0, IX(i,j,l), 0); boundCell(N, 0, w0, i, j, l, 0);
+}
+
+//The fused stencils over the listed bricks, with the list as the second argument
+__kernel void diffuseSparse (int4 n, __global int * list, __global int * count, float a, __global store_t * x, __global store_t * x0, int b)
+{
+	EXTENTS(n);
+	int i, j, l;
+	if(!brickCell(N, list, count[0], &i, &j, &l))
+		return;
+
+	float value = diffuseCell(N, a, x, x0, i, j, l);
+	ST(x, IX(i,j,l), value);
+	boundCell(N, b, x, i, j, l, value);
+}
+
+__kernel void advectSparse (int4 n, __global int * list, __global int * count, int b,
+	__global store_t * d, __global store_t * d0,
+	__global store_t * u, __global store_t * v, __global store_t * w, float dt)
+{
+	EXTENTS(n);
+	int i, j, l;
+	if(!brickCell(N, list, count[0], &i, &j, &l))
+		return;
+
+	float value = advectCell(N, d0, u, v, w, dt, (float2)(0.5f, N.z + 0.5f), i, j, l);
+	ST(d, IX(i,j,l), value);
+	boundCell(N, b, d, i, j, l, value);
+}
+
+__kernel void project1Sparse (int4 n, __global int * list, __global int * count,
+	__global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p, __global store_t * div)
+{
+	EXTENTS(n);
+	int i, j, l;
+	if(!brickCell(N, list, count[0], &i, &j, &l))
+		return;
+	float h = 1.0/N.w;
+
+	float value = -0.5*h*(
+			LD(u, IX(i+1,j,l))-LD(u, IX(i-1,j,l))+
+			LD(v, IX(i,j+1,l))-LD(v, IX(i,j-1,l))+
+			LD(w, IX(i,j,l+1))-LD(w, IX(i,j,l-1)));
+	ST(div, IX(i,j,l), value);
+	boundCell(N, 0, div, i, j, l, value);
+	ST(p, IX(i,j,l), 0);
+	boundCell(N, 0, p, i, j, l, 0);
+}
+
+__kernel void project2Sparse (int4 n, __global int * list, __global int * count, __global store_t * p, __global store_t * div)
+{
+	EXTENTS(n);
+	int i, j, l;
+	if(!brickCell(N, list, count[0], &i, &j, &l))
+		return;
+
+	float value = project2Cell(N, p, div, i, j, l);
+	ST(p, IX(i,j,l), value);
+	boundCell(N, 0, p, i, j, l, value);
+}
+
+__kernel void project3Sparse (int4 n, __global int * list, __global int * count,
+	__global store_t * u, __global store_t * v, __global store_t * w, __global store_t * p)
+{
+	EXTENTS(n);
+	int i, j, l;
+	if(!brickCell(N, list, count[0], &i, &j, &l))
+		return;
+	float h = 1.0/N.w;
+
+	float value = LD(u, IX(i,j,l)) - 0.5*(LD(p, IX(i+1,j,l))-LD(p, IX(i-1,j,l)))/h;
+	ST(u, IX(i,j,l), value);
+	boundCell(N, 1, u, i, j, l, value);
+	value = LD(v, IX(i,j,l)) - 0.5*(LD(p, IX(i,j+1,l))-LD(p, IX(i,j-1,l)))/h;
+	ST(v, IX(i,j,l), value);
+	boundCell(N, 2, v, i, j, l, value);
+	value = LD(w, IX(i,j,l)) - 0.5*(LD(p, IX(i,j,l+1))-LD(p, IX(i,j,l-1)))/h;
+	ST(w, IX(i,j,l), value);
+	boundCell(N, 3, w, i, j, l, value);
+}
+
+/*
+ * Resampling of dens, u, v and w to new extents N from the old ones N0, on
+ * a resize. Both are interior extents, and cell i along an axis covers
+ * (i-1)/N to i/N of the volume. The kernels are launched over the whole
+ * new volume and write every cell of it; the walls take the value of the
+ * interior cell next to them, until setBound sets them.
+ *
+ * Velocities are in cells of size 1/N.w per unit of time, so a component
+ * is scaled by how much the axis' share of the longest side changes - the
+ * flow still crosses the same part of the volume.
+ */
+float4 velocityScale(int4 N, int4 N0)
+{
+	return (float4)((float)N.x / N0.x, (float)N.y / N0.y, (float)N.z / N0.z, 1) * ((float)N0.w / N.w);
+}
+
+//Area-weighted average of the old cells under a new one (box filter), which
+//keeps the total over the volume for any ratio
+float downsampleCell(int4 N, int4 N0, __global store_t * x0, int i, int j, int l)
+{
+	float rx = (float)N0.x / N.x;
+	float ry = (float)N0.y / N.y;
+	float rz = (float)N0.z / N.z;
+	i = clamp(i, 1, N.x);
+	j = clamp(j, 1, N.y);
+	l = clamp(l, 1, N.z);
+
+	//The cell in old cells, from its low to its high corner (old cell s spans s-1 to s)
+	float x0a = (i - 1) * rx, x0b = i * rx;
+	float y0a = (j - 1) * ry, y0b = j * ry;
+	float z0a = (l - 1) * rz, z0b = l * rz;
+
+	float sum = 0;
+	for(int c = (int)z0a; c < N0.z && c < z0b; c++)
+	{
+		float wz = min(z0b, c + 1.0f) - max(z0a, (float)c);
+		for(int b = (int)y0a; b < N0.y && b < y0b; b++)
+		{
+			float wy = wz * (min(y0b, b + 1.0f) - max(y0a, (float)b));
+			for(int a = (int)x0a; a < N0.x && a < x0b; a++)
+				sum += LD(x0, IXn(N0, a + 1, b + 1, c + 1)) * wy * (min(x0b, a + 1.0f) - max(x0a, (float)a));
+		}
+	}
+	return sum / (rx * ry * rz);
+}
+
+//Trilinear interpolation of the old cells at the centre of a new one
+float upsampleCell(int4 N, int4 N0, __global store_t * x0, int i, int j, int l)
+{
+	//The centre in old cells, where old cell s is centred at s
+	float x = clamp((clamp(i, 1, N.x) - 0.5f) * N0.x / N.x + 0.5f, 1.0f, (float)N0.x);
+	float y = clamp((clamp(j, 1, N.y) - 0.5f) * N0.y / N.y + 0.5f, 1.0f, (float)N0.y);
+	float z = clamp((clamp(l, 1, N.z) - 0.5f) * N0.z / N.z + 0.5f, 1.0f, (float)N0.z);
+	int i0 = (int)x, j0 = (int)y, l0 = (int)z;
+	int i1 = min(i0 + 1, N0.x), j1 = min(j0 + 1, N0.y), l1 = min(l0 + 1, N0.z);
+	float s1 = x - i0, s0 = 1 - s1;
+	float t1 = y - j0, t0 = 1 - t1;
+	float u1 = z - l0, u0 = 1 - u1;
+
+	return s0 * (t0 * (u0 * LD(x0, IXn(N0, i0, j0, l0)) + u1 * LD(x0, IXn(N0, i0, j0, l1))) +
+			t1 * (u0 * LD(x0, IXn(N0, i0, j1, l0)) + u1 * LD(x0, IXn(N0, i0, j1, l1)))) +
+		s1 * (t0 * (u0 * LD(x0, IXn(N0, i1, j0, l0)) + u1 * LD(x0, IXn(N0, i1, j0, l1))) +
+			t1 * (u0 * LD(x0, IXn(N0, i1, j1, l0)) + u1 * LD(x0, IXn(N0, i1, j1, l1))));
+}
+
+//To extents no larger along any axis (launched over the whole new volume)
+__kernel void downsample(int4 N, int4 N0, __global store_t * dens, __global store_t * dens0,
+			__global store_t * u, __global store_t * u0,
+			__global store_t * v, __global store_t * v0,
+			__global store_t * w, __global store_t * w0)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int l = get_global_id(2);
+	float4 scale = velocityScale(N, N0);
+
+	ST(dens, IX(i,j,l), downsampleCell(N, N0, dens0, i, j, l));
+	ST(u, IX(i,j,l), downsampleCell(N, N0, u0, i, j, l) * scale.x);
+	ST(v, IX(i,j,l), downsampleCell(N, N0, v0, i, j, l) * scale.y);
+	ST(w, IX(i,j,l), downsampleCell(N, N0, w0, i, j, l) * scale.z);
+}
+
+//To extents no smaller along any axis (launched over the whole new volume)
+__kernel void upsample(int4 N, int4 N0, __global store_t * dens, __global store_t * dens0,
+			__global store_t * u, __global store_t * u0,
+			__global store_t * v, __global store_t * v0,
+			__global store_t * w, __global store_t * w0)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	int l = get_global_id(2);
+	float4 scale = velocityScale(N, N0);
+
+	ST(dens, IX(i,j,l), upsampleCell(N, N0, dens0, i, j, l));
+	ST(u, IX(i,j,l), upsampleCell(N, N0, u0, i, j, l) * scale.x);
+	ST(v, IX(i,j,l), upsampleCell(N, N0, v0, i, j, l) * scale.y);
+	ST(w, IX(i,j,l), upsampleCell(N, N0, w0, i, j, l) * scale.z);
+}
+
+/*
+ * Geometric multigrid for the pressure Poisson equation (V-cycles).
+ *
+ * Level 0 is the simulation grid, each coarser level has (n+1)/2 cells along
+ * each side of n cells. A level solves 6e - (sum of neighbours) = r, the
+ * same equation as project2, so the smoother is red-black Gauss-Seidel with project2Cell.
+ * The coarse right hand side is scaled by 4 on restriction (the grid spacing
+ * doubles), which keeps the operator identical on every level.
+ */
+
+//Red-black smoothing sweep on one level (launched over ((N.x+1)/2, N.y, N.z))
+__kernel void mgSmooth(int4 N, __global store_t * e, __global store_t * r, int parity)
+{
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	int i = redBlackI(j, l, parity);
+	if(i > N.x)
+		return;
+
+	float value = project2Cell(N, e, r, i, j, l);
+	ST(e, IX(i,j,l), value);
+	boundCell(N, 0, e, i, j, l, value);
+}
+
+//res = r - Ae on the interior; the walls of res stay zero
+__kernel void mgResidual(int4 N, __global store_t * e, __global store_t * r, __global store_t * res)
+{
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	ST(res, IX(i,j,l), LD(r, IX(i,j,l)) - 6*LD(e, IX(i,j,l))
+		+LD(e, IX(i-1,j,l))+LD(e, IX(i+1,j,l))
+		+LD(e, IX(i,j-1,l))+LD(e, IX(i,j+1,l))
+		+LD(e, IX(i,j,l-1))+LD(e, IX(i,j,l+1)));
+}
+
+//Restriction: the coarse right hand side is 4 x the mean of the 8 fine cells
+//it covers (N is the coarse size), the coarse guess starts at zero. Along an
+//odd fine side the last coarse cell covers only one interior fine cell, the
+//other is the wall, so the mean is over the interior ones.
+__kernel void mgRestrict(int4 N, int4 Nf, __global store_t * res, __global store_t * r, __global store_t * e)
+{
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	int fi = 2*i - 1, fj = 2*j - 1, fl = 2*l - 1;
+	int ni = min(2, Nf.x - fi + 1), nj = min(2, Nf.y - fj + 1), nl = min(2, Nf.z - fl + 1);
+
+	float sum = 0;
+	for(int dl = 0; dl < nl; dl++)
+		for(int dj = 0; dj < nj; dj++)
+			for(int di = 0; di < ni; di++)
+				sum += LD(res, IXn(Nf, fi+di, fj+dj, fl+dl));
+
+	ST(r, IX(i,j,l), 4*sum/(ni*nj*nl));
+	ST(e, IX(i,j,l), 0);
+	boundCell(N, 0, e, i, j, l, 0);
+}
+
+//Prolongation: adds the trilinearly interpolated coarse correction to the
+//fine guess (N is the fine size). A fine cell sits a quarter of a coarse
+//cell away from its parent, towards the neighbour at (I+di, J+dj, L+dl).
+__kernel void mgProlong(int4 N, int4 Nc, __global store_t * e, __global store_t * ec)
+{
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+	int I = (i + 1)/2, J = (j + 1)/2, L = (l + 1)/2;
+	int di = (i & 1) ? -1 : 1;
+	int dj = (j & 1) ? -1 : 1;
+	int dl = (l & 1) ? -1 : 1;
+
+	float correction =
+		 0.75f*(0.75f*(0.75f*LD(ec, IXn(Nc, I, J, L)) + 0.25f*LD(ec, IXn(Nc, I+di, J, L)))
+		       +0.25f*(0.75f*LD(ec, IXn(Nc, I, J+dj, L)) + 0.25f*LD(ec, IXn(Nc, I+di, J+dj, L))))
+		+0.25f*(0.75f*(0.75f*LD(ec, IXn(Nc, I, J, L+dl)) + 0.25f*LD(ec, IXn(Nc, I+di, J, L+dl)))
+		       +0.25f*(0.75f*LD(ec, IXn(Nc, I, J+dj, L+dl)) + 0.25f*LD(ec, IXn(Nc, I+di, J+dj, L+dl))));
+
+	float value = LD(e, IX(i,j,l)) + correction;
+	ST(e, IX(i,j,l), value);
+	boundCell(N, 0, e, i, j, l, value);
 }
 
-//Special volume indexer - takes size into account
-#define IXs(size,i,j,l) (int)((i)+(size)*(j)+(size)*(size)*(l))
-//Floor/ceiling functions that don't overstep the bounds of the volume
-float xfloor(float value)
-{
-	return ceil(value - 1);
-}
-float xceil(float value)
-{
-	return floor(value + 1);
-}
-
-//Single voxel resampling from N0 to N
-void resampleVoxel(int N, int N0, __global float* source, __global float* destination)
-{
-	//ijl indexes destination
-	size_t i = get_global_id(0);
-	size_t j = get_global_id(1);
-	size_t l = get_global_id(2);
-
-	//N0 > N
-	float ratio = (float)N0 / N;	
-
-
-	//Find which points in source to sample from:
-	//Base of source cube
-	float ib0 = (float)i * ratio;
-	float jb0 = (float)j * ratio;
-	float lb0 = (float)l * ratio;
-	//Furthest corner of source cube
-	float ib1 = (float)(i + 1) * ratio;
-	float jb1 = (float)(j + 1) * ratio;
-	float lb1 = (float)(l + 1) * ratio;
-
-	//Fix possible floating point error caused by the addition above
-	ib1 = round(ib1 * 10000) / 10000;
-	jb1 = round(jb1 * 10000) / 10000;
-	lb1 = round(lb1 * 10000) / 10000;
-
-	//Accumulate volume density from each corner of the cube
-	float deposit = 0;
-	deposit += source[IXs(N0, (int)      (ib0), (int)      (jb0), (int)      (lb0))] * (xceil(ib0) - ib0 ) * (xceil(jb0) - jb0 ) * (xceil(lb0) - lb0 );
-	deposit += source[IXs(N0, (int)      (ib0), (int)      (jb0), (int)xfloor(lb1))] * (xceil(ib0) - ib0 ) * (xceil(jb0) - jb0 ) * (lb1 - xfloor(lb1));
-	deposit += source[IXs(N0, (int)      (ib0), (int)xfloor(jb1), (int)      (lb0))] * (xceil(ib0) - ib0 ) * (jb1 - xfloor(jb1)) * (xceil(lb0) - lb0 );
-	deposit += source[IXs(N0, (int)      (ib0), (int)xfloor(jb1), (int)xfloor(lb1))] * (xceil(ib0) - ib0 ) * (jb1 - xfloor(jb1)) * (lb1 - xfloor(lb1));
-	deposit += source[IXs(N0, (int)xfloor(ib1), (int)      (jb0), (int)      (lb0))] * (ib1 - xfloor(ib1)) * (xceil(jb0) - jb0 ) * (xceil(lb0) - lb0 );
-	deposit += source[IXs(N0, (int)xfloor(ib1), (int)      (jb0), (int)xfloor(lb1))] * (ib1 - xfloor(ib1)) * (xceil(jb0) - jb0 ) * (lb1 - xfloor(lb1));
-	deposit += source[IXs(N0, (int)xfloor(ib1), (int)xfloor(jb1), (int)      (lb0))] * (ib1 - xfloor(ib1)) * (jb1 - xfloor(jb1)) * (xceil(lb0) - lb0 );
-	deposit += source[IXs(N0, (int)xfloor(ib1), (int)xfloor(jb1), (int)xfloor(lb1))] * (ib1 - xfloor(ib1)) * (jb1 - xfloor(jb1)) * (lb1 - xfloor(lb1));
-	
-	destination[IXs(N,i,j,l)] += deposit;
-}
-
-//This is called from the program, it resamples all fields that constitute the volume
-__kernel void resample(int N, int N0, __global float* dens, __global float* dens0, 
-			__global float* u, __global float* u0, 
-			__global float* v, __global float* v0, 
-			__global float* w, __global float* w0)
-{
-	/*
-	if(get_global_id(0) + get_global_id(1) + get_global_id(2) == 0)
-		printf("resampling from %i to %i\n", N0, N);
-		*/
-	resampleVoxel(N, N0, dens0, dens);	
-	resampleVoxel(N, N0, u0, u);	
-	resampleVoxel(N, N0, v0, v);	
-	resampleVoxel(N, N0, w0, w);	
+/*
+ * Preconditioned conjugate gradient for the pressure Poisson equation.
+ *
+ * Matrix-free: A is the project2 stencil (6p - neighbours, walls through the
+ * ghost cells), applied by pcgApply. The preconditioner is Jacobi with the
+ * true diagonal, which is 6 minus the number of walls next to the cell.
+ * All scalars (r.z, d.q) stay on the device in a small buffer, so no
+ * iteration has to come back to the host.
+ */
+
+float pcgDiagonal(int4 N, int i, int j, int l)
+{
+	return 6 - (i == 1) - (i == N.x) - (j == 1) - (j == N.y) - (l == 1) - (l == N.z);
+}
+
+//r = div - Ap, z = r / diag, d = z
+__kernel void pcgInit(int4 n, __global store_t * p, __global store_t * div,
+	__global float * r, __global float * z, __global float * d)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	float residual = LD(div, IX(i,j,l)) - 6*LD(p, IX(i,j,l))
+		+LD(p, IX(i-1,j,l))+LD(p, IX(i+1,j,l))
+		+LD(p, IX(i,j-1,l))+LD(p, IX(i,j+1,l))
+		+LD(p, IX(i,j,l-1))+LD(p, IX(i,j,l+1));
+	float precond = residual / pcgDiagonal(N, i, j, l);
+
+	r[IX(i,j,l)] = residual;
+	z[IX(i,j,l)] = precond;
+	d[IX(i,j,l)] = precond;
+	boundCellScratch(N, 0, d, i, j, l, precond);
+}
+
+//q = Ad (sparse matrix-vector product as a stencil)
+__kernel void pcgApply(int4 n, __global float * d, __global float * q)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	q[IX(i,j,l)] = 6*d[IX(i,j,l)]
+		-d[IX(i-1,j,l)]-d[IX(i+1,j,l)]
+		-d[IX(i,j-1,l)]-d[IX(i,j+1,l)]
+		-d[IX(i,j,l-1)]-d[IX(i,j,l+1)];
+}
+
+//Sums the values in scratch (one per work-item of the group) into scratch[0]
+void groupSum(__local float * scratch)
+{
+	int id = get_local_id(0);
+	for(int stride = get_local_size(0) / 2; stride > 0; stride /= 2)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if(id < stride)
+			scratch[id] += scratch[id + stride];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+//Dot product of a and b over the interior, first stage: one partial sum per
+//work-group. Launched 1D over the interior cells rounded up to the group size.
+__kernel void dotPartial(int4 n, __global float * a, __global float * b,
+	__global float * partial, __local float * scratch)
+{
+	EXTENTS(n);
+	int cell = get_global_id(0);
+	float value = 0;
+	if(cell < N.x*N.y*N.z)
+	{
+		int i = cell % N.x + 1;
+		int j = (cell / N.x) % N.y + 1;
+		int l = cell / (N.x*N.y) + 1;
+		value = a[IX(i,j,l)] * b[IX(i,j,l)];
+	}
+
+	scratch[get_local_id(0)] = value;
+	groupSum(scratch);
+	if(get_local_id(0) == 0)
+		partial[get_group_id(0)] = scratch[0];
+}
+
+//Second stage: a single work-group adds up the partial sums into scalars[slot]
+__kernel void dotFinal(int count, __global float * partial, __global float * scalars, int slot,
+	__local float * scratch)
+{
+	int id = get_local_id(0);
+	float value = 0;
+	for(int k = id; k < count; k += get_local_size(0))
+		value += partial[k];
+
+	scratch[id] = value;
+	groupSum(scratch);
+	if(id == 0)
+		scalars[slot] = scratch[0];
+}
+
+//alpha = r.z / d.q; p += alpha d, r -= alpha q, z = r / diag
+__kernel void pcgUpdate(int4 n, __global store_t * p, __global float * r, __global float * z,
+	__global float * d, __global float * q, __global float * scalars, int rz, int dq)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	float alpha = scalars[dq] != 0 ? scalars[rz] / scalars[dq] : 0;
+
+	float value = LD(p, IX(i,j,l)) + alpha*d[IX(i,j,l)];
+	ST(p, IX(i,j,l), value);
+	boundCell(N, 0, p, i, j, l, value);
+
+	float residual = r[IX(i,j,l)] - alpha*q[IX(i,j,l)];
+	r[IX(i,j,l)] = residual;
+	z[IX(i,j,l)] = residual / pcgDiagonal(N, i, j, l);
+}
+
+//beta = new r.z / old r.z; d = z + beta d
+__kernel void pcgDirection(int4 n, __global float * z, __global float * d,
+	__global float * scalars, int rzNew, int rzOld)
+{
+	EXTENTS(n);
+	int i = get_global_id(0) + 1;
+	int j = get_global_id(1) + 1;
+	int l = get_global_id(2) + 1;
+
+	float beta = scalars[rzOld] != 0 ? scalars[rzNew] / scalars[rzOld] : 0;
+
+	float value = z[IX(i,j,l)] + beta*d[IX(i,j,l)];
+	d[IX(i,j,l)] = value;
+	boundCellScratch(N, 0, d, i, j, l, value);
+}
+
+/*
+ * Residual of an iterative solve, for early termination. The system is
+ * c x - a (sum of neighbours) = x0, which covers both diffuse (c = 1 + 6a)
+ * and project2 (a = 1, c = 6, x0 = div). First stage of the reduction of
+ * the squared residual, finished by dotFinal like a dot product.
+ */
+__kernel void residualPartial(int4 n, float a, float c, __global store_t * x, __global store_t * x0,
+	__global float * partial, __local float * scratch)
+{
+	EXTENTS(n);
+	int cell = get_global_id(0);
+	float value = 0;
+	if(cell < N.x*N.y*N.z)
+	{
+		int i = cell % N.x + 1;
+		int j = (cell / N.x) % N.y + 1;
+		int l = cell / (N.x*N.y) + 1;
+		float t1 = LD(x, IX(i-1,j,l))+LD(x, IX(i+1,j,l));
+		float t2 = LD(x, IX(i,j-1,l))+LD(x, IX(i,j+1,l));
+		float t3 = LD(x, IX(i,j,l-1))+LD(x, IX(i,j,l+1));
+		value = LD(x0, IX(i,j,l)) - c*LD(x, IX(i,j,l)) + a*(t1 + t2 + t3);
+		value *= value;
+	}
+
+	scratch[get_local_id(0)] = value;
+	groupSum(scratch);
+	if(get_local_id(0) == 0)
+		partial[get_group_id(0)] = scratch[0];
 }
@@ -4,6 +4,8 @@ Sequential version of the fluid simulator - one kernel
 
 #pragma OPENCL EXTENSION cl_khr_byte_addressable_store : enable
 
+//Cube of side N, unlike the extents of fluid.cl
+#undef IX
 #define IX(i,j,l) ((i)+(N+2)*(j)+(N+2)*(N+2)*(l))
 #define SWAP(x0,x) {float *tmp=x0;x0=x;x=tmp;}
 
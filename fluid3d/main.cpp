@@ -4,19 +4,40 @@
 #include "camera.h"
 #include "graphics.h"
 #include "File.h"
-
-// OpenCL instance
-OpenCL opencl;
+#include "peer.h"
+#include <chrono>
 
 // Main program
 Main mainProgram;
 cl_device_type deviceType;
 bool sequential;
 bool render;
+bool serialized;
+bool fused;
+bool tiled;
+bool specialized; //kernels built for the extents they run at
+Simulation::Solver solver;
+float omega;
+float tolerance;
+int checkEvery;
+int sweepsPerLaunch;
+bool packed;
+bool halfStorage;
+Simulation::Placement placement;
+bool sparse;
+int slabs; //devices to decompose the volume over, 1 = off
+int processRank, ranks; //this process and how many share the volume, 1 = not distributed
+const char* peerAddress; //socket path or host:port the processes find each other at
+bool native; //simulate on the host, without OpenCL
+int nativeThreads; //threads of the native simulation, 0 = one per hardware thread
+int volumeSize[3]; //starting size of the simulation
+int capacitySize[3]; //extents the fields have room for from the start (0: the starting size)
+const char* tuneAxes; //axes the tuner may resize, any of "xyz"
 
 //Logs
 Log profileLog("profile.log");
 Log framesLog("frames.log");
+Log solverLog("solver.log");
 bool logging;
 
 // Camera
@@ -86,22 +107,26 @@ static void keyCallback(GLFWwindow* window, int key, int scancode, int action, i
 		mainProgram.simulation->reset();
 	if(key == GLFW_KEY_C && action == GLFW_PRESS)
 		mainProgram.simulation->clearEffects();
+	if(key == GLFW_KEY_M && action == GLFW_PRESS) //cycle through the solvers
+		mainProgram.simulation->setSolver(Simulation::Solver((mainProgram.simulation->getSolver() + 1) % Simulation::SOLVERS));
 
 	if(key == GLFW_KEY_EQUAL && action == GLFW_PRESS)
 	{
-		mainProgram.simulation->resize(mainProgram.simulation->getN() + 1);
+		cl_int4 n = mainProgram.simulation->getExtent();
+		mainProgram.simulation->resize(n.s[0] + 1, n.s[1] + 1, n.s[2] + 1);
 		if(render)
 		{
-			mainProgram.rayCaster.setN(mainProgram.simulation->getN());
+			mainProgram.rayCaster.setExtent(mainProgram.simulation->getExtent());
 			mainProgram.rayCaster.setVolume(mainProgram.simulation->getOutputVolume());
 		}
 	}
 	if(key == GLFW_KEY_MINUS && action == GLFW_PRESS)
 	{
-		mainProgram.simulation->resize(mainProgram.simulation->getN() - 1);
+		cl_int4 n = mainProgram.simulation->getExtent();
+		mainProgram.simulation->resize(n.s[0] - 1, n.s[1] - 1, n.s[2] - 1);
 		if(render)
 		{
-			mainProgram.rayCaster.setN(mainProgram.simulation->getN());
+			mainProgram.rayCaster.setExtent(mainProgram.simulation->getExtent());
 			mainProgram.rayCaster.setVolume(mainProgram.simulation->getOutputVolume());
 		}
 	}
@@ -121,8 +146,86 @@ static void mouseCallback(GLFWwindow* window, int button, int action, int mods)
  */
 void Main::initialize(int fps)
 {
+	double start = highResTime(); //cold start, reported at the end
 	targetFPS = fps;
 
+	//The native simulation runs the Jacobi step on plain float fields
+	if(native)
+	{
+		if(sequential || slabs > 1 || ranks > 1)
+			cout<<"The native simulation is neither sequential, decomposed nor distributed"<<endl;
+		if(halfStorage || solver != Simulation::JACOBI || tolerance > 0 || sweepsPerLaunch > 1 || packed || sparse)
+			cout<<"The native simulation uses Jacobi solves on unpacked float fields over the whole volume"<<endl;
+		sequential = false;
+		slabs = ranks = 1;
+		halfStorage = false;
+		solver = Simulation::JACOBI;
+		tolerance = 0;
+		sweepsPerLaunch = 1;
+		packed = sparse = false;
+	}
+
+	//The sequential kernel works on plain float fields, in a cube
+	if(sequential && halfStorage)
+	{
+		cout<<"Half storage is not supported by the sequential simulation"<<endl;
+		halfStorage = false;
+	}
+	if(sequential && (volumeSize[1] != volumeSize[0] || volumeSize[2] != volumeSize[0]))
+	{
+		cout<<"The sequential simulation is a cube, using "<<volumeSize[0]<<" along every axis"<<endl;
+		volumeSize[1] = volumeSize[2] = volumeSize[0];
+	}
+	if(sequential)
+		tuneAxes = "xyz";
+	if(sequential && ranks > 1)
+	{
+		cout<<"The sequential simulation can't be distributed"<<endl;
+		ranks = 1;
+	}
+	if(sequential && slabs > 1)
+	{
+		cout<<"The sequential simulation can't be decomposed"<<endl;
+		slabs = 1;
+	}
+
+	//The packed velocity step diffuses with Jacobi sweeps on float4 fields
+	if(packed && (halfStorage || solver != Simulation::JACOBI || tolerance > 0 || sweepsPerLaunch > 1))
+	{
+		cout<<"The packed velocity step uses Jacobi solves on float fields, velocity left unpacked"<<endl;
+		packed = false;
+	}
+
+	//The native and decomposed simulations work on the host arrays
+	if((native || slabs > 1 || ranks > 1) && placement != Simulation::HOST)
+	{
+		cout<<"The native and decomposed simulations keep their fields in host memory"<<endl;
+		placement = Simulation::HOST;
+	}
+
+	//Without rendering, the native simulation needs no OpenCL at all.
+	//The program only has the kernels the mode uses (fluid.cl's unless it's
+	//native, the raycaster's when rendering, the sequential one) and is
+	//built while the window is set up.
+	if(!native || render)
+	{
+		vector<string> sources;
+		if(!native)
+			sources.push_back("fluid.cl");
+		if(render)
+			sources.push_back("raycaster.cl");
+		if(sequential)
+			sources.push_back("fluid_sequential.cl");
+		opencl.initialize(deviceType, slabs, placement, sources);
+		slabs = opencl.queues.size();
+		if(tiled)
+			cout<<"Stencils: local-memory tiles"<<endl;
+		if(specialized && !native && !sequential && slabs == 1)
+			cout<<"Kernels: built for the extents they run at"<<endl;
+		cout<<"Storage: "<<(halfStorage ? "half" : "float")<<" ("<<(halfStorage ? 2 : sizeof(float))<<" bytes per value)"<<endl;
+	}
+	OpenCL* backend = opencl.context ? &opencl : NULL;
+
 	//Initialize OpenGL, set up a GLFW application (the window)
 	if(!render)
 		cout<<"No rendering will take place"<<endl;
@@ -141,64 +244,73 @@ void Main::initialize(int fps)
 		glfwSetWindowSizeCallback(window, globalResize);
 	}
 
+	if(backend)
+		backend->finishBuild();
 
-	//Initialize OpenCL context
-	vector<cl::Platform> platformList;
-	cl::Platform::get(&platformList);
-	checkErr(platformList.size()!=0 ? CL_SUCCESS : -1, "cl::Platform::get");
-	std::string platformVendor;
-	platformList[0].getInfo((cl_platform_info)CL_PLATFORM_VENDOR, &platformVendor);
-	std::cerr << "Platform is by: " << platformVendor << "\n";
-	platformList[0].getInfo((cl_platform_info)CL_PLATFORM_VERSION, &platformVendor);
-	std::cerr << platformVendor << "\n";
-			
-	cl_context_properties cprops[3] =
-	{CL_CONTEXT_PLATFORM, (cl_context_properties)(platformList[0])(), 0};
-	opencl.context = new cl::Context(deviceType, cprops, NULL, NULL, &opencl.err);
-	opencl.checkErr("Conext::Context()");
-
-	//Find devices
-	vector<cl::Device> devices;
-	devices = opencl.context->getInfo<CL_CONTEXT_DEVICES>();
-	checkErr(devices.size() > 0 ? CL_SUCCESS : -1, "devices.size() > 0");
-
-	//Compile CL program from sources in fluid.cl, raycast.cl and fluid_sequential.cl
-	File raycastSourceFile("raycaster.cl");
-	File fluidSourceFile("fluid.cl");
-	File seqFluidSourceFile("fluid_sequential.cl");
-	char* raycastSource = raycastSourceFile.ReadAll();
-	char* fluidSource = fluidSourceFile.ReadAll();
-	char* seqFluidSource = seqFluidSourceFile.ReadAll();
-
-	cl::Program::Sources source;
-	source.push_back(std::make_pair(raycastSource, raycastSourceFile.GetLength()));
-	source.push_back(std::make_pair(fluidSource, fluidSourceFile.GetLength()));
-	source.push_back(std::make_pair(seqFluidSource, seqFluidSourceFile.GetLength()));
-	opencl.program = new cl::Program(*opencl.context, source);
-	opencl.err = opencl.program->build(devices,"");
-	cout<<opencl.program->getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
-	opencl.checkErr("Program::build()");
-
-	//Make queue
-        opencl.queue = new cl::CommandQueue(*opencl.context, devices[0], logging ? CL_QUEUE_PROFILING_ENABLE : 0, &opencl.err);
-        opencl.checkErr("CommandQueue::CommandQueue()");
+	//Distributed: this process holds a range of the z planes, and is connected
+	//to the processes holding the ranges below and above it
+	int planes = volumeSize[2], planesBelow = 0;
+	Peer *below = NULL, *above = NULL;
+	if(ranks > 1)
+	{
+		checkErr(processRank < ranks && ranks <= volumeSize[2] ? CL_SUCCESS : -1, "-rank, -ranks (a plane each at least)");
+		planes = volumeSize[2] / ranks + (processRank < volumeSize[2] % ranks ? 1 : 0);
+		planesBelow = processRank * (volumeSize[2] / ranks) + min(processRank, volumeSize[2] % ranks);
+		int listener = processRank < ranks - 1 ? Peer::listen(peerAddress, processRank) : -1;
+		if(processRank > 0)
+		{
+			below = new Peer(backend);
+			checkErr(below->connect(peerAddress, processRank - 1) ? CL_SUCCESS : -1, "Peer::connect()");
+		}
+		if(processRank < ranks - 1)
+		{
+			above = new Peer(backend);
+			checkErr(listener >= 0 && above->accept(listener) ? CL_SUCCESS : -1, "Peer::accept()");
+		}
+		cout<<"Distributed: rank "<<processRank<<" of "<<ranks<<", planes "<<planesBelow + 1<<"-"<<planesBelow + planes
+			<<" of "<<volumeSize[2]<<" (not tuned)"<<endl;
+	}
 
 	// Simulation and raycasting components
-	if(sequential)
-		simulation = new SequentialSimulation();
+	if(native)
+		simulation = new NativeSimulation(backend, nativeThreads);
+	else if(sequential)
+		simulation = new SequentialSimulation(backend);
+	else if(slabs > 1 || ranks > 1)
+	{
+		cout<<"Decomposed: "<<slabs<<" slabs along z (Jacobi solves, unpacked velocity, whole volume)"<<endl;
+		simulation = new DecomposedSimulation(backend, below, above);
+	}
 	else
-		simulation = new ParallelSimulation();
-	simulation->initialize(20);
-	tuner.initialize(simulation, 10, targetFPS, deviceType);
+		simulation = new ParallelSimulation(backend);
+	if(ranks > 1)
+		simulation->setDomain(planesBelow, volumeSize[2]);
+	if(capacitySize[0] > 0)
+		simulation->reserve(capacitySize[0], capacitySize[1], capacitySize[2]);
+	simulation->initialize(volumeSize[0], volumeSize[1], planes);
+	simulation->setRelaxation(omega);
+	simulation->setSolver(solver);
+	simulation->setTolerance(tolerance, checkEvery);
+	simulation->setSweepsPerLaunch(sweepsPerLaunch);
+	if(!sequential && slabs == 1 && ranks == 1)
+	{
+		simulation->setPackedVelocity(packed);
+		simulation->setSparse(sparse);
+		if(sparse)
+			cout<<"Sparse: active bricks only (Jacobi solves, unpacked velocity)"<<endl;
+	}
+	tuner.initialize(simulation, 10, targetFPS, native ? CL_DEVICE_TYPE_CPU : deviceType, tuneAxes);
 
 	if(render)
-		rayCaster.initialize(simulation->getN(), simulation->getOutputVolume());
+		rayCaster.initialize(backend, simulation->getExtent(), simulation->getOutputVolume());
+
+	cout<<"Startup: "<<(highResTime() - start) * 1000<<" ms"<<endl;
 }
 
-//Timer - should be precise enough, at least on UNIX
-inline double highResTime()
+//Timer - wall clock time, clock() would add up the time of every thread
+double highResTime()
 {
-	return (double)clock() / CLOCKS_PER_SEC;
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 //Main loop
@@ -253,11 +365,15 @@ void Main::run()
 		*/
 
 		//A major change is that of the resolution, in which case
-		//the raycaster also needs to know.
-		bool changed = tuner.report(delta);
+		//the raycaster also needs to know. Distributed processes
+		//have to stay in step, so they aren't tuned. A resize the
+		//tuner asked for earlier may be ready only now.
+		bool changed = simulation->switchOver();
+		if(ranks == 1 && tuner.report(delta))
+			changed = true;
 		if(render && changed)
 		{
-			rayCaster.setN(simulation->getN());
+			rayCaster.setExtent(simulation->getExtent());
 			rayCaster.setVolume(simulation->getOutputVolume());
 		}
 
@@ -271,6 +387,7 @@ void Main::run()
 				framesLog<<"FPS "<<frames - frameAtBase<<endl;		
 				framesLog.Commit();
 				profileLog.Commit();
+				solverLog.Commit();
 			}
 			frameAtBase = frames;
 			baseTime = highResTime();
@@ -286,6 +403,28 @@ int main(int argc, char* argv[])
 	logging = true;
 	sequential = false;
 	render = true;
+	serialized = false;
+	fused = true;
+	tiled = false;
+	specialized = false;
+	solver = Simulation::JACOBI;
+	omega = 0;
+	tolerance = 0;
+	checkEvery = 4;
+	sweepsPerLaunch = 1;
+	packed = false;
+	halfStorage = false;
+	placement = Simulation::HOST;
+	sparse = false;
+	slabs = 1;
+	processRank = 0;
+	ranks = 1;
+	peerAddress = "/tmp/fluid3d";
+	native = false;
+	nativeThreads = 0;
+	volumeSize[0] = volumeSize[1] = volumeSize[2] = 20;
+	capacitySize[0] = capacitySize[1] = capacitySize[2] = 0;
+	tuneAxes = "xyz";
 	deviceType = CL_DEVICE_TYPE_ALL;
 	int targetFPS = 20;
 
@@ -304,6 +443,76 @@ int main(int argc, char* argv[])
 			targetFPS = atoi(argv[i+1]);
 		else if(strcmp(argv[i], "-norender") == 0)
 			render = false;
+		else if(strcmp(argv[i], "-serial") == 0)
+			serialized = true;
+		else if(strcmp(argv[i], "-nofuse") == 0)
+			fused = false;
+		else if(strcmp(argv[i], "-tiled") == 0)
+			tiled = true;
+		else if(strcmp(argv[i], "-specialize") == 0)
+			specialized = true;
+		else if(strcmp(argv[i], "-solver") == 0)
+		{
+			if(strcmp(argv[i+1], "sor") == 0)
+				solver = Simulation::SOR;
+			else if(strcmp(argv[i+1], "multigrid") == 0)
+				solver = Simulation::MULTIGRID;
+			else if(strcmp(argv[i+1], "pcg") == 0)
+				solver = Simulation::PCG;
+			else
+				solver = Simulation::JACOBI;
+		}
+		else if(strcmp(argv[i], "-omega") == 0)
+			omega = atof(argv[i+1]);
+		else if(strcmp(argv[i], "-tolerance") == 0)
+			tolerance = atof(argv[i+1]);
+		else if(strcmp(argv[i], "-check") == 0)
+			checkEvery = atoi(argv[i+1]);
+		else if(strcmp(argv[i], "-sweeps") == 0)
+			sweepsPerLaunch = atoi(argv[i+1]);
+		else if(strcmp(argv[i], "-packed") == 0)
+			packed = true;
+		else if(strcmp(argv[i], "-half") == 0)
+			halfStorage = true;
+		else if(strcmp(argv[i], "-memory") == 0)
+		{
+			if(strcmp(argv[i+1], "device") == 0)
+				placement = Simulation::DEVICE;
+			else if(strcmp(argv[i+1], "pinned") == 0)
+				placement = Simulation::PINNED;
+			else if(strcmp(argv[i+1], "svm") == 0)
+				placement = Simulation::SVM;
+			else
+				placement = Simulation::HOST;
+		}
+		else if(strcmp(argv[i], "-sparse") == 0)
+			sparse = true;
+		else if(strcmp(argv[i], "-slabs") == 0)
+			slabs = max(1, atoi(argv[i+1]));
+		else if(strcmp(argv[i], "-rank") == 0)
+			processRank = atoi(argv[i+1]);
+		else if(strcmp(argv[i], "-ranks") == 0)
+			ranks = max(1, atoi(argv[i+1]));
+		else if(strcmp(argv[i], "-peer") == 0)
+			peerAddress = argv[i+1];
+		else if(strcmp(argv[i], "-native") == 0)
+			native = true;
+		else if(strcmp(argv[i], "-threads") == 0)
+			nativeThreads = max(0, atoi(argv[i+1]));
+		else if(strcmp(argv[i], "-size") == 0)
+		{
+			volumeSize[0] = atoi(argv[i+1]);
+			volumeSize[1] = atoi(argv[i+2]);
+			volumeSize[2] = atoi(argv[i+3]);
+		}
+		else if(strcmp(argv[i], "-capacity") == 0)
+		{
+			capacitySize[0] = atoi(argv[i+1]);
+			capacitySize[1] = atoi(argv[i+2]);
+			capacitySize[2] = atoi(argv[i+3]);
+		}
+		else if(strcmp(argv[i], "-tune") == 0)
+			tuneAxes = argv[i+1];
 	}
 
 	//Start simulating!
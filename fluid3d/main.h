@@ -12,6 +12,8 @@
 #include <cstring> //for memset
 #include <cmath>
 #include <unistd.h>
+#include <thread>
+#include <atomic>
 using namespace std;
 
 #define GLFW_INCLUDE_GLU
@@ -25,6 +27,7 @@ using namespace std;
 #define CL_USE_DEPRECATED_OPENCL_1_1_APIS
 #include <CL/cl.h>
 #undef CL_VERSION_1_2
+#undef CL_VERSION_2_0
 #endif
 #include <CL/cl.hpp>
 
@@ -36,24 +39,84 @@ using namespace std;
 #include "Log.h"
 extern Log profileLog;
 extern Log framesLog;
+extern Log solverLog;
 extern bool logging;
 extern bool render;
+extern bool serialized;
+extern bool fused;
+extern bool tiled;
+extern bool specialized;
+extern bool halfStorage;
 
 //Timer
 double highResTime();
 
 /*
- * Global singleton structure to hold the OpenCL state.
+ * OpenCL backend: a context with its program and a queue per device.
+ * Simulations and the raycaster are handed the one they run on and make
+ * their buffers and kernels with it.
  * Has many convenient wrappers that make the simulation step function shorter.
  */
 struct OpenCL
 {
+	OpenCL() : specializedUses(0), specializedInUse(NULL), queued(false), specializeDone(false), specializeProgram(NULL),
+		buildStatus(CL_SUCCESS), buildCached(false), buildTime(0),
+		context(NULL), queue(NULL), background(NULL), program(NULL), placement(Simulation::HOST), fineSVM(false) {}
+	~OpenCL() { destroy(); }
+
+	//Context over the devices of a type, at most the given number of them,
+	//with the field placement the devices allow (SVM needs OpenCL 2.0).
+	//The program of the sources is built in the background until finishBuild.
+	void initialize(cl_device_type type, int devices, Simulation::Placement placement, const vector<string>& sources);
+	void finishBuild();
+
+	//fluid.cl built for volumes of the given extents (-specialize), cached
+	//by build options - the extents and storage type - for these devices.
+	//specializeLater builds it on the build thread, specializedReady tells
+	//without waiting whether it's there, specialize waits for it.
+	cl::Program* specialize(cl_int4 extents);
+	void specializeLater(cl_int4 extents);
+	bool specializedReady(cl_int4 extents);
+	struct Specialized
+	{
+		cl::Program* program;
+		unsigned long used; //specializedUses when last asked for
+	};
+	std::map<std::string, Specialized> specializedPrograms; //at most specializedLimit, least recently used go
+	static const size_t specializedLimit = 8;
+	unsigned long specializedUses;
+	cl::Program* specializedInUse; //returned last by specialize, never dropped
+	std::string specializing; //options of the build running, if any
+	cl_int4 specializingExtents, queuedExtents; //of it and of the one asked for after it
+	bool queued;
+	std::atomic<bool> specializeDone;
+	cl::Program* specializeProgram;
+	void startSpecializing(cl_int4 extents);
+	void finishSpecializing();
+	void keepSpecialized(const std::string& options, cl::Program* program);
+
+	//Programs are built through an on-disk cache of their binaries (clcache/),
+	//a file per device keyed by its name and driver version, the build options
+	//and the source
+	cl::Program* build(const std::string& source, const std::string& options, cl_int* status, std::string* log, bool* cached);
+	std::thread builder;
+	cl_int buildStatus;
+	std::string buildLog;
+	bool buildCached;
+	double buildTime;
+
 	// OpenCL system
 	cl_int err;
 	cl::Context* context;
 	cl::CommandQueue* queue;
+	vector<cl::CommandQueue*> queues; //one per device, queue is the first
+	cl::CommandQueue* background; //in-order, on the first device, for work done between frames
 	cl::Program* program;
 	cl::Event event;
+	std::string buildOptions; //of every program, the storage type
+	std::string fluidSource; //fluid.cl, for the specialized programs
+	Simulation::Placement placement; //of the simulations' fields
+	bool fineSVM; //SVM fields are fine-grained, coarse-grained otherwise
 
 	void enqueue(const cl::Kernel &kernel, const cl::NDRange &offset, const cl::NDRange &global, const cl::NDRange &local)
 	{
@@ -62,16 +125,22 @@ struct OpenCL
 
 		if(logging) //Output log?
 		{
-			string kernelFunction;
-			kernel.getInfo(CL_KERNEL_FUNCTION_NAME, &kernelFunction);
 			wait();
-			cl_ulong startTime, endTime;
-			event.getProfilingInfo(CL_PROFILING_COMMAND_START, &startTime);
-			event.getProfilingInfo(CL_PROFILING_COMMAND_END, &endTime);
-			profileLog<<kernelFunction<<" "<<endTime - startTime<<endl;
+			profile(kernel, event);
 		}
 	}
 
+	//Writes the execution time of a finished kernel to the profile log
+	void profile(const cl::Kernel &kernel, const cl::Event &kernelEvent)
+	{
+		string kernelFunction;
+		kernel.getInfo(CL_KERNEL_FUNCTION_NAME, &kernelFunction);
+		cl_ulong startTime, endTime;
+		kernelEvent.getProfilingInfo(CL_PROFILING_COMMAND_START, &startTime);
+		kernelEvent.getProfilingInfo(CL_PROFILING_COMMAND_END, &endTime);
+		profileLog<<kernelFunction<<" "<<endTime - startTime<<endl;
+	}
+
 	void wait()
 	{
 		event.wait();
@@ -90,11 +159,27 @@ struct OpenCL
 
 	void destroy()
 	{
+		if(builder.joinable())
+			builder.join();
 		delete context;
-		delete queue;
+		for(cl::CommandQueue* q : queues)
+			delete q;
+		delete background;
 		delete program;
+		for(auto& p : specializedPrograms)
+			delete p.second.program;
+		specializedPrograms.clear();
+		if(!specializing.empty())
+			delete specializeProgram;
+		specializing.clear();
+		queued = false;
+		context = NULL;
+		queue = NULL;
+		background = NULL;
+		queues.clear();
+		program = NULL;
 	}
-} extern opencl;
+};
 
 
 /*
@@ -109,7 +194,6 @@ public:
 	}
 	~Main()
 	{
-		opencl.destroy();
 		delete simulation;
 	}
 
@@ -118,6 +202,7 @@ public:
 
 
 
+	OpenCL opencl; //backend of the simulation and the raycaster
 	Graphics g; //OpenGL gateway
 	Simulation *simulation;
 	Tuner tuner;
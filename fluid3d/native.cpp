@@ -0,0 +1,606 @@
+#include "simulation.h"
+#include "main.h"
+#include "threadpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NATIVE_X86
+#define AVX2 __attribute__((target("avx2,fma")))
+#define AVX512 __attribute__((target("avx512f")))
+#endif
+
+//Cache the blocks of rows the stencils go over are sized for (L2)
+static const int blockBytes = 256 * 1024;
+
+#define AT(i,j,l) ((i) + sy*(j) + sz*(l))
+
+/*
+ * Row functions: one row of interior cells, i = 1 to n, the pointers being
+ * at its first cell. Each comes in a scalar version, which also does what
+ * the vector ones leave over at the end of the row, and AVX2 and AVX-512
+ * versions of the same arithmetic.
+ */
+
+//Where a row is in the volume, for the advection
+struct Row
+{
+	int n; //interior cells along x
+	int sy, sz; //strides of y and z
+	int j, l;
+	float limit[3]; //N + 0.5 along each axis, where back-traces are clamped to
+	float dt0;
+};
+
+//Jacobi sweep of c x - a (sum of neighbours) = x0 (diffuseCell, project2Cell)
+static void jacobiRow(float* out, const float* x, const float* x0, int n, int sy, int sz, float a, float c, int from)
+{
+	for(int i = from; i < n; i++)
+	{
+		float t1 = x[i-1] + x[i+1];
+		float t2 = x[i-sy] + x[i+sy];
+		float t3 = x[i-sz] + x[i+sz];
+		out[i] = (x0[i] + a*(t1 + t2 + t3)) / c;
+	}
+}
+
+//Trilinear sample of d0 at the back-traced point of every cell (advectCell)
+static void advectRow(float* d, const float* d0, const float* u, const float* v, const float* w, const Row& r, int from)
+{
+	for(int c = from; c < r.n; c++)
+	{
+		float x = min(max((float)(c + 1) - r.dt0*u[c], 0.5f), r.limit[0]);
+		float y = min(max((float)r.j - r.dt0*v[c], 0.5f), r.limit[1]);
+		float z = min(max((float)r.l - r.dt0*w[c], 0.5f), r.limit[2]);
+		int i0 = (int)x, j0 = (int)y, l0 = (int)z;
+		float s1 = x - i0, s0 = 1 - s1;
+		float t1 = y - j0, t0 = 1 - t1;
+		float r1 = z - l0, r0 = 1 - r1;
+
+		const float* p = d0 + i0 + r.sy*j0 + r.sz*l0;
+		d[c] = s0*(r0*(t0*p[0] + t1*p[r.sy]) + r1*(t0*p[r.sz] + t1*p[r.sy + r.sz]))
+			+ s1*(r0*(t0*p[1] + t1*p[r.sy + 1]) + r1*(t0*p[r.sz + 1] + t1*p[r.sy + r.sz + 1]));
+	}
+}
+
+#ifdef NATIVE_X86
+AVX2 static void jacobiRowAVX2(float* out, const float* x, const float* x0, int n, int sy, int sz, float a, float c, int from)
+{
+	__m256 va = _mm256_set1_ps(a), vc = _mm256_set1_ps(c);
+	int i = from;
+	for(; i + 8 <= n; i += 8)
+	{
+		__m256 t1 = _mm256_add_ps(_mm256_loadu_ps(x + i - 1), _mm256_loadu_ps(x + i + 1));
+		__m256 t2 = _mm256_add_ps(_mm256_loadu_ps(x + i - sy), _mm256_loadu_ps(x + i + sy));
+		__m256 t3 = _mm256_add_ps(_mm256_loadu_ps(x + i - sz), _mm256_loadu_ps(x + i + sz));
+		__m256 sum = _mm256_add_ps(_mm256_add_ps(t1, t2), t3);
+		_mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_fmadd_ps(va, sum, _mm256_loadu_ps(x0 + i)), vc));
+	}
+	jacobiRow(out, x, x0, n, sy, sz, a, c, i);
+}
+
+AVX2 static inline __m256 lerp8(__m256 p, __m256 q, __m256 t)
+{
+	return _mm256_fmadd_ps(t, _mm256_sub_ps(q, p), p);
+}
+
+AVX2 static void advectRowAVX2(float* d, const float* d0, const float* u, const float* v, const float* w, const Row& r, int from)
+{
+	const __m256 half = _mm256_set1_ps(0.5f), dt0 = _mm256_set1_ps(r.dt0);
+	const __m256 xMax = _mm256_set1_ps(r.limit[0]), yMax = _mm256_set1_ps(r.limit[1]), zMax = _mm256_set1_ps(r.limit[2]);
+	const __m256 jj = _mm256_set1_ps(r.j), ll = _mm256_set1_ps(r.l);
+	const __m256 ramp = _mm256_setr_ps(1, 2, 3, 4, 5, 6, 7, 8);
+	const __m256i sy = _mm256_set1_epi32(r.sy), sz = _mm256_set1_epi32(r.sz);
+	int c = from;
+	for(; c + 8 <= r.n; c += 8)
+	{
+		__m256 ii = _mm256_add_ps(_mm256_set1_ps(c), ramp);
+		__m256 x = _mm256_min_ps(_mm256_max_ps(_mm256_fnmadd_ps(dt0, _mm256_loadu_ps(u + c), ii), half), xMax);
+		__m256 y = _mm256_min_ps(_mm256_max_ps(_mm256_fnmadd_ps(dt0, _mm256_loadu_ps(v + c), jj), half), yMax);
+		__m256 z = _mm256_min_ps(_mm256_max_ps(_mm256_fnmadd_ps(dt0, _mm256_loadu_ps(w + c), ll), half), zMax);
+		__m256i i0 = _mm256_cvttps_epi32(x), j0 = _mm256_cvttps_epi32(y), l0 = _mm256_cvttps_epi32(z);
+		__m256 s = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i0));
+		__m256 t = _mm256_sub_ps(y, _mm256_cvtepi32_ps(j0));
+		__m256 q = _mm256_sub_ps(z, _mm256_cvtepi32_ps(l0));
+		__m256i k = _mm256_add_epi32(i0, _mm256_add_epi32(_mm256_mullo_epi32(j0, sy), _mm256_mullo_epi32(l0, sz)));
+
+		//The 8 corners, interpolated along x, then y, then z
+		__m256 c00 = lerp8(_mm256_i32gather_ps(d0, k, 4), _mm256_i32gather_ps(d0 + 1, k, 4), s);
+		__m256 c10 = lerp8(_mm256_i32gather_ps(d0 + r.sy, k, 4), _mm256_i32gather_ps(d0 + r.sy + 1, k, 4), s);
+		__m256 c01 = lerp8(_mm256_i32gather_ps(d0 + r.sz, k, 4), _mm256_i32gather_ps(d0 + r.sz + 1, k, 4), s);
+		__m256 c11 = lerp8(_mm256_i32gather_ps(d0 + r.sy + r.sz, k, 4), _mm256_i32gather_ps(d0 + r.sy + r.sz + 1, k, 4), s);
+		_mm256_storeu_ps(d + c, lerp8(lerp8(c00, c10, t), lerp8(c01, c11, t), q));
+	}
+	advectRow(d, d0, u, v, w, r, c);
+}
+
+AVX512 static void jacobiRowAVX512(float* out, const float* x, const float* x0, int n, int sy, int sz, float a, float c, int from)
+{
+	__m512 va = _mm512_set1_ps(a), vc = _mm512_set1_ps(c);
+	int i = from;
+	for(; i + 16 <= n; i += 16)
+	{
+		__m512 t1 = _mm512_add_ps(_mm512_loadu_ps(x + i - 1), _mm512_loadu_ps(x + i + 1));
+		__m512 t2 = _mm512_add_ps(_mm512_loadu_ps(x + i - sy), _mm512_loadu_ps(x + i + sy));
+		__m512 t3 = _mm512_add_ps(_mm512_loadu_ps(x + i - sz), _mm512_loadu_ps(x + i + sz));
+		__m512 sum = _mm512_add_ps(_mm512_add_ps(t1, t2), t3);
+		_mm512_storeu_ps(out + i, _mm512_div_ps(_mm512_fmadd_ps(va, sum, _mm512_loadu_ps(x0 + i)), vc));
+	}
+	jacobiRow(out, x, x0, n, sy, sz, a, c, i);
+}
+
+AVX512 static inline __m512 lerp16(__m512 p, __m512 q, __m512 t)
+{
+	return _mm512_fmadd_ps(t, _mm512_sub_ps(q, p), p);
+}
+
+AVX512 static void advectRowAVX512(float* d, const float* d0, const float* u, const float* v, const float* w, const Row& r, int from)
+{
+	const __m512 half = _mm512_set1_ps(0.5f), dt0 = _mm512_set1_ps(r.dt0);
+	const __m512 xMax = _mm512_set1_ps(r.limit[0]), yMax = _mm512_set1_ps(r.limit[1]), zMax = _mm512_set1_ps(r.limit[2]);
+	const __m512 jj = _mm512_set1_ps(r.j), ll = _mm512_set1_ps(r.l);
+	const __m512 ramp = _mm512_setr_ps(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+	const __m512i sy = _mm512_set1_epi32(r.sy), sz = _mm512_set1_epi32(r.sz);
+	int c = from;
+	for(; c + 16 <= r.n; c += 16)
+	{
+		__m512 ii = _mm512_add_ps(_mm512_set1_ps(c), ramp);
+		__m512 x = _mm512_min_ps(_mm512_max_ps(_mm512_fnmadd_ps(dt0, _mm512_loadu_ps(u + c), ii), half), xMax);
+		__m512 y = _mm512_min_ps(_mm512_max_ps(_mm512_fnmadd_ps(dt0, _mm512_loadu_ps(v + c), jj), half), yMax);
+		__m512 z = _mm512_min_ps(_mm512_max_ps(_mm512_fnmadd_ps(dt0, _mm512_loadu_ps(w + c), ll), half), zMax);
+		__m512i i0 = _mm512_cvttps_epi32(x), j0 = _mm512_cvttps_epi32(y), l0 = _mm512_cvttps_epi32(z);
+		__m512 s = _mm512_sub_ps(x, _mm512_cvtepi32_ps(i0));
+		__m512 t = _mm512_sub_ps(y, _mm512_cvtepi32_ps(j0));
+		__m512 q = _mm512_sub_ps(z, _mm512_cvtepi32_ps(l0));
+		__m512i k = _mm512_add_epi32(i0, _mm512_add_epi32(_mm512_mullo_epi32(j0, sy), _mm512_mullo_epi32(l0, sz)));
+
+		__m512 c00 = lerp16(_mm512_i32gather_ps(k, d0, 4), _mm512_i32gather_ps(k, d0 + 1, 4), s);
+		__m512 c10 = lerp16(_mm512_i32gather_ps(k, d0 + r.sy, 4), _mm512_i32gather_ps(k, d0 + r.sy + 1, 4), s);
+		__m512 c01 = lerp16(_mm512_i32gather_ps(k, d0 + r.sz, 4), _mm512_i32gather_ps(k, d0 + r.sz + 1, 4), s);
+		__m512 c11 = lerp16(_mm512_i32gather_ps(k, d0 + r.sy + r.sz, 4), _mm512_i32gather_ps(k, d0 + r.sy + r.sz + 1, 4), s);
+		_mm512_storeu_ps(d + c, lerp16(lerp16(c00, c10, t), lerp16(c01, c11, t), q));
+	}
+	advectRow(d, d0, u, v, w, r, c);
+}
+#endif
+
+NativeSimulation::NativeSimulation(OpenCL* opencl, int threads) : Simulation(opencl), pool(new ThreadPool(threads)), scratch(NULL),
+	jacobiRows(jacobiRow), advectRows(advectRow)
+{
+	const char* instructions = "scalar";
+#ifdef NATIVE_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+	{
+		jacobiRows = jacobiRowAVX512;
+		advectRows = advectRowAVX512;
+		instructions = "AVX-512";
+	}
+	else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		jacobiRows = jacobiRowAVX2;
+		advectRows = advectRowAVX2;
+		instructions = "AVX2";
+	}
+#endif
+	cout<<"Native: "<<pool->size()<<" threads, "<<instructions<<" stencils"<<endl;
+}
+
+NativeSimulation::~NativeSimulation()
+{
+	releaseField(scratch, NULL);
+	delete pool;
+}
+
+void NativeSimulation::initialize(int nx, int ny, int nz)
+{
+	Simulation::initialize(nx, ny, nz);
+	scratch = allocateField(NULL);
+}
+
+/*
+ * Runs body(j0, j1, l0, l1) over the interior in blocks: rows j0 to j1-1 of
+ * planes l0 to l1-1. The planes are cut into about 4 slabs per thread, and
+ * the slabs into bands of rows whose neighbourhood fits in the cache, which
+ * a block goes through plane by plane.
+ */
+void NativeSimulation::forBlocks(const std::function<void(int, int, int, int)>& body)
+{
+	int depth = max(1, Nz / (4 * pool->size()));
+	int rows = max(1, min(Ny, blockBytes / (5 * (Nx + 2) * (int)sizeof(float))));
+	int slabs = (Nz + depth - 1) / depth, bands = (Ny + rows - 1) / rows;
+	pool->run(slabs * bands, [&](int task)
+	{
+		int l0 = 1 + (task / bands) * depth;
+		int j0 = 1 + (task % bands) * rows;
+		body(j0, min(Ny + 1, j0 + rows), l0, min(Nz + 1, l0 + depth));
+	});
+}
+
+//Logs how long a stage took, like the kernels' profiling in the OpenCL simulations
+void NativeSimulation::profile(const char* stage, double since)
+{
+	if(logging)
+		profileLog<<stage<<" "<<(long)((highResTime() - since) * 1e9)<<endl;
+}
+
+void NativeSimulation::addSources()
+{
+	float* fields[] = {dens, u, v, w};
+	float* sources[] = {dens_prev, u_prev, v_prev, w_prev};
+	int chunk = 1 << 16;
+	for(int b = 0; b < 4; b++)
+	{
+		if(emptySource[b])
+			continue;
+		float* x = fields[b];
+		float* s = sources[b];
+		pool->run((voxels + chunk - 1) / chunk, [&](int task)
+		{
+			int end = min(voxels, (task + 1) * chunk);
+			for(int i = task * chunk; i < end; i++)
+				x[i] += dt*s[i];
+		});
+	}
+}
+
+//setBound of fluid.cl: faces with the sign flip of mode b, then edges and corners
+void NativeSimulation::setBound(int b, float* x)
+{
+	int sy = Nx + 2, sz = sy * (Ny + 2);
+
+	//Faces (6 in total)
+	for(int l = 1; l <= Nz; l++)
+		for(int j = 1; j <= Ny; j++)
+		{
+			x[AT(0, j, l)] = b==1 ? -x[AT(1, j, l)] : x[AT(1, j, l)];
+			x[AT(Nx+1, j, l)] = b==1 ? -x[AT(Nx, j, l)] : x[AT(Nx, j, l)];
+		}
+	for(int l = 1; l <= Nz; l++)
+		for(int i = 1; i <= Nx; i++)
+		{
+			x[AT(i, 0, l)] = b==2 ? -x[AT(i, 1, l)] : x[AT(i, 1, l)];
+			x[AT(i, Ny+1, l)] = b==2 ? -x[AT(i, Ny, l)] : x[AT(i, Ny, l)];
+		}
+	for(int j = 1; j <= Ny; j++)
+		for(int i = 1; i <= Nx; i++)
+		{
+			x[AT(i, j, 0)] = b==3 ? -x[AT(i, j, 1)] : x[AT(i, j, 1)];
+			x[AT(i, j, Nz+1)] = b==3 ? -x[AT(i, j, Nz)] : x[AT(i, j, Nz)];
+		}
+
+	//Edges (12 in total)
+	for(int i = 1; i <= Ny; i++)
+	{
+		x[AT(0, i, 0)] = x[AT(1, i, 1)];
+		x[AT(Nx+1, i, 0)] = x[AT(Nx, i, 1)];
+		x[AT(0, i, Nz+1)] = x[AT(1, i, Nz)];
+		x[AT(Nx+1, i, Nz+1)] = x[AT(Nx, i, Nz)];
+	}
+	for(int i = 1; i <= Nx; i++)
+	{
+		x[AT(i, 0, 0)] = x[AT(i, 1, 1)];
+		x[AT(i, Ny+1, 0)] = x[AT(i, Ny, 1)];
+		x[AT(i, 0, Nz+1)] = x[AT(i, 1, Nz)];
+		x[AT(i, Ny+1, Nz+1)] = x[AT(i, Ny, Nz)];
+	}
+	for(int i = 1; i <= Nz; i++)
+	{
+		x[AT(0, 0, i)] = x[AT(1, 1, i)];
+		x[AT(Nx+1, 0, i)] = x[AT(Nx, 1, i)];
+		x[AT(0, Ny+1, i)] = x[AT(1, Ny, i)];
+		x[AT(Nx+1, Ny+1, i)] = x[AT(Nx, Ny, i)];
+	}
+
+	//Corners
+	x[AT(0, 0, 0)] = x[AT(1, 1, 1)];
+	x[AT(0, Ny+1, 0)] = x[AT(1, Ny, 1)];
+	x[AT(Nx+1, 0, 0)] = x[AT(Nx, 1, 1)];
+	x[AT(Nx+1, Ny+1, 0)] = x[AT(Nx, Ny, 1)];
+	x[AT(0, 0, Nz+1)] = x[AT(1, 1, Nz)];
+	x[AT(0, Ny+1, Nz+1)] = x[AT(1, Ny, Nz)];
+	x[AT(Nx+1, 0, Nz+1)] = x[AT(Nx, 1, Nz)];
+	x[AT(Nx+1, Ny+1, Nz+1)] = x[AT(Nx, Ny, Nz)];
+}
+
+/*
+ * Jacobi solve of c x - a (sum of neighbours) = x0. Sweeps go out of place,
+ * alternating between x and the scratch field, so the result doesn't depend
+ * on the order the threads get to the blocks in (the kernels update x in place).
+ * If the result ends up in the scratch field the two are swapped (SWAP of the
+ * C version) rather than copied back - x is one of the fields, by reference.
+ */
+void NativeSimulation::jacobi(int b, float*& x, float* x0, float a, float c)
+{
+	int sy = Nx + 2, sz = sy * (Ny + 2);
+	float* in = x;
+	float* out = scratch;
+	for(int k = 0; k < solverSteps; k++)
+	{
+		forBlocks([&](int j0, int j1, int l0, int l1)
+		{
+			for(int l = l0; l < l1; l++)
+				for(int j = j0; j < j1; j++)
+				{
+					int first = AT(1, j, l);
+					jacobiRows(out + first, in + first, x0 + first, Nx, sy, sz, a, c, 0);
+				}
+		});
+		setBound(b, out);
+		std::swap(in, out);
+	}
+	if(in != x)
+		std::swap(x, scratch);
+}
+
+void NativeSimulation::diffuse(int b, float*& x, float* x0, float diff)
+{
+	double start = highResTime();
+	float a = dt*diff*longest()*longest();
+	jacobi(b, x, x0, a, 1 + 6*a);
+	const char* names[] = {"diffuse-dens", "diffuse-u", "diffuse-v", "diffuse-w"};
+	profile(names[b], start);
+}
+
+void NativeSimulation::project(float* u, float* v, float* w, float*& p, float* div)
+{
+	double start = highResTime();
+	int sy = Nx + 2, sz = sy * (Ny + 2);
+	float h = 1.0 / longest();
+
+	//(part 1)
+	forBlocks([&](int j0, int j1, int l0, int l1)
+	{
+		for(int l = l0; l < l1; l++)
+			for(int j = j0; j < j1; j++)
+				for(int i = 1; i <= Nx; i++)
+				{
+					int k = AT(i, j, l);
+					div[k] = -0.5f*h*(u[k+1] - u[k-1] + v[k+sy] - v[k-sy] + w[k+sz] - w[k-sz]);
+					p[k] = 0;
+				}
+	});
+	setBound(0, div);
+	setBound(0, p);
+
+	//(part 2)
+	jacobi(0, p, div, 1, 6);
+
+	//(part 3)
+	forBlocks([&](int j0, int j1, int l0, int l1)
+	{
+		for(int l = l0; l < l1; l++)
+			for(int j = j0; j < j1; j++)
+				for(int i = 1; i <= Nx; i++)
+				{
+					int k = AT(i, j, l);
+					u[k] -= 0.5f*(p[k+1] - p[k-1])/h;
+					v[k] -= 0.5f*(p[k+sy] - p[k-sy])/h;
+					w[k] -= 0.5f*(p[k+sz] - p[k-sz])/h;
+				}
+	});
+	setBound(1, u);
+	setBound(2, v);
+	setBound(3, w);
+	profile("project", start);
+}
+
+void NativeSimulation::advect(int b, float* d, float* d0, float* u, float* v, float* w)
+{
+	double start = highResTime();
+	int sy = Nx + 2, sz = sy * (Ny + 2);
+	forBlocks([&](int j0, int j1, int l0, int l1)
+	{
+		Row row;
+		row.n = Nx;
+		row.sy = sy;
+		row.sz = sz;
+		row.limit[0] = Nx + 0.5f;
+		row.limit[1] = Ny + 0.5f;
+		row.limit[2] = Nz + 0.5f;
+		row.dt0 = dt*longest();
+		for(row.l = l0; row.l < l1; row.l++)
+			for(row.j = j0; row.j < j1; row.j++)
+			{
+				int first = AT(1, row.j, row.l);
+				advectRows(d + first, d0, u + first, v + first, w + first, row, 0);
+			}
+	});
+	setBound(b, d);
+	const char* names[] = {"advect-dens", "advect-u", "advect-v", "advect-w"};
+	profile(names[b], start);
+}
+
+/*
+ * One step, in the order of ParallelSimulation::step (see there for the
+ * lines of the C version), with the same use of the _prev fields
+ */
+void NativeSimulation::step()
+{
+	addSources();
+
+	diffuse(1, u_prev, u, visc);
+	diffuse(2, v_prev, v, visc);
+	diffuse(3, w_prev, w, visc);
+	project(u_prev, v_prev, w_prev, u, v);
+	advect(1, u, u_prev, u_prev, v_prev, w_prev);
+	advect(2, v, v_prev, u_prev, v_prev, w_prev);
+	advect(3, w, w_prev, u_prev, v_prev, w_prev);
+	project(u, v, w, u_prev, v_prev);
+
+	diffuse(0, dens_prev, dens, diff);
+	advect(0, dens, dens_prev, u, v, w);
+
+	//Clear the garbage in dens_prev (it was used as a temp buffer), a part per thread
+	pool->run(pool->size(), [&](int t)
+	{
+		int first = (long long)voxels * t / pool->size(), last = (long long)voxels * (t + 1) / pool->size();
+		memset(dens_prev + first, 0, (last - first) * sizeof(float));
+	});
+	emptySource[0] = true;
+	for(int b = 1; b < 4; b++)
+		emptySource[b] = false;
+
+	//Rendering: the raycaster's buffer wraps dens, mapping it over
+	//tells the device it has been written on the host
+	if(buf_dens)
+	{
+		void* mapped = opencl->queue->enqueueMapBuffer(*buf_dens, CL_TRUE, CL_MAP_WRITE, 0, size);
+		opencl->queue->enqueueUnmapMemObject(*buf_dens, mapped);
+	}
+}
+
+/*
+ * The downsample and upsample kernels of fluid.cl for one field: every cell
+ * of the new volume, walls included, from the old one. n and n0 are the new
+ * and old interior extents, the longest side in n[3] and n0[3], and scale
+ * what the values are multiplied by (a velocity component's scale).
+ */
+static void downsampleField(const int* n, const int* n0, const float* source, float* destination, float scale, ThreadPool* pool)
+{
+	float ratio[3];
+	for(int a = 0; a < 3; a++)
+		ratio[a] = (float)n0[a] / n[a];
+	scale /= ratio[0] * ratio[1] * ratio[2];
+	pool->run(n[2] + 2, [&](int l)
+	{
+		for(int j = 0; j < n[1] + 2; j++)
+			for(int i = 0; i < n[0] + 2; i++)
+			{
+				//The cell in old cells, from its low to its high corner (old cell s spans s-1 to s)
+				int cell[3] = {i, j, l};
+				float from[3], to[3];
+				for(int a = 0; a < 3; a++)
+				{
+					int c = min(max(cell[a], 1), n[a]);
+					from[a] = (c - 1) * ratio[a];
+					to[a] = c * ratio[a];
+				}
+
+				float sum = 0;
+				for(int c = (int)from[2]; c < n0[2] && c < to[2]; c++)
+				{
+					float wz = min(to[2], c + 1.0f) - max(from[2], (float)c);
+					for(int b = (int)from[1]; b < n0[1] && b < to[1]; b++)
+					{
+						float wy = wz * (min(to[1], b + 1.0f) - max(from[1], (float)b));
+						for(int a = (int)from[0]; a < n0[0] && a < to[0]; a++)
+							sum += source[(a + 1) + (n0[0] + 2)*((b + 1) + (n0[1] + 2)*(c + 1))] * wy * (min(to[0], a + 1.0f) - max(from[0], (float)a));
+					}
+				}
+				destination[i + (n[0] + 2)*(j + (n[1] + 2)*l)] = sum * scale;
+			}
+	});
+}
+
+static void upsampleField(const int* n, const int* n0, const float* source, float* destination, float scale, ThreadPool* pool)
+{
+	pool->run(n[2] + 2, [&](int l)
+	{
+		for(int j = 0; j < n[1] + 2; j++)
+			for(int i = 0; i < n[0] + 2; i++)
+			{
+				//The centre in old cells, where old cell s is centred at s
+				int cell[3] = {i, j, l}, at0[3], at1[3];
+				float t1[3];
+				for(int a = 0; a < 3; a++)
+				{
+					float x = (min(max(cell[a], 1), n[a]) - 0.5f) * n0[a] / n[a] + 0.5f;
+					x = min(max(x, 1.0f), (float)n0[a]);
+					at0[a] = (int)x;
+					at1[a] = min(at0[a] + 1, n0[a]);
+					t1[a] = x - at0[a];
+				}
+
+				float sum = 0;
+				for(int corner = 0; corner < 8; corner++)
+				{
+					int at[3];
+					float weight = 1;
+					for(int a = 0; a < 3; a++)
+					{
+						bool high = corner & (4 >> a);
+						at[a] = high ? at1[a] : at0[a];
+						weight *= high ? t1[a] : 1 - t1[a];
+					}
+					sum += source[at[0] + (n0[0] + 2)*(at[1] + (n0[1] + 2)*at[2])] * weight;
+				}
+				destination[i + (n[0] + 2)*(j + (n[1] + 2)*l)] = sum * scale;
+			}
+	});
+}
+
+//Resizes on the host, the same way as the resample kernels. Within the
+//capacity the fields are resampled into the _prev ones, which then take
+//their place (as in Simulation::resize); beyond it from copies of them.
+void NativeSimulation::resize(int nx, int ny, int nz)
+{
+	double start = highResTime();
+	cl_int4 e0 = extent();
+	int n0[4] = {Nx, Ny, Nz, e0.s[3]};
+	float** fields[] = {&dens, &u, &v, &w};
+	float** temporaries[] = {&dens_prev, &u_prev, &v_prev, &w_prev};
+	cl::Buffer** buffers[] = {&buf_dens, &buf_u, &buf_v, &buf_w};
+	cl::Buffer** temporaryBuffers[] = {&buf_dens_prev, &buf_u_prev, &buf_v_prev, &buf_w_prev};
+
+	Nx = nx;
+	Ny = ny;
+	Nz = nz;
+	voxels = (Nx+2)*(Ny+2)*(Nz+2);
+	size = voxels * fieldBytes;
+	int n[4] = {Nx, Ny, Nz, longest()};
+
+	bool grown = voxels > capacity;
+	std::vector<float> old[4];
+	float* sources[4];
+	float* targets[4];
+	for(int f = 0; f < 4; f++)
+	{
+		if(grown)
+		{
+			old[f].assign(*fields[f], *fields[f] + (n0[0]+2)*(n0[1]+2)*(n0[2]+2));
+			sources[f] = &old[f][0];
+		}
+		else
+			sources[f] = *fields[f];
+	}
+	if(grown)
+	{
+		deallocateBuffers();
+		releaseField(scratch, NULL);
+		capacity = voxels + voxels / 2;
+		allocateBuffers();
+		scratch = allocateField(NULL);
+	}
+	for(int f = 0; f < 4; f++)
+		targets[f] = grown ? *fields[f] : *temporaries[f];
+
+	//Velocities as in velocityScale of fluid.cl
+	bool up = n[0] >= n0[0] && n[1] >= n0[1] && n[2] >= n0[2];
+	for(int f = 0; f < 4; f++)
+	{
+		float scale = f == 0 ? 1 : (float)n[f - 1] / n0[f - 1] * n0[3] / n[3];
+		if(up)
+			upsampleField(n, n0, sources[f], targets[f], scale, pool);
+		else
+			downsampleField(n, n0, sources[f], targets[f], scale, pool);
+	}
+
+	//The old fields are the zeroed temporaries now, with the buffers wrapping
+	//them (the raycaster's view of dens, with rendering)
+	if(!grown)
+	{
+		for(int f = 0; f < 4; f++)
+		{
+			cl::Buffer* buffer = *temporaryBuffers[f];
+			*temporaries[f] = *fields[f];
+			*temporaryBuffers[f] = *buffers[f];
+			*fields[f] = targets[f];
+			*buffers[f] = buffer;
+			memset(*temporaries[f], 0, size);
+		}
+		memset(scratch, 0, size);
+		for(int b = 0; b < 4; b++)
+			emptySource[b] = true;
+	}
+	reportResize(e0, highResTime() - start);
+}
@@ -0,0 +1,358 @@
+#include "main.h"
+#include "File.h"
+#include <iterator>
+#include <sys/stat.h>
+
+/*
+ * Sets up the context and queues, and starts building the program. With
+ * count > 1 there is a queue per device, up to count devices. Short of
+ * devices, the first one is partitioned into sub-devices if it can be
+ * (CPUs usually can).
+ */
+void OpenCL::initialize(cl_device_type type, int count, Simulation::Placement requested, const vector<string>& sources)
+{
+	//Initialize OpenCL context
+	vector<cl::Platform> platformList;
+	cl::Platform::get(&platformList);
+	err = platformList.size() != 0 ? CL_SUCCESS : -1;
+	checkErr("cl::Platform::get");
+	std::string platformVendor;
+	platformList[0].getInfo((cl_platform_info)CL_PLATFORM_VENDOR, &platformVendor);
+	std::cerr << "Platform is by: " << platformVendor << "\n";
+	platformList[0].getInfo((cl_platform_info)CL_PLATFORM_VERSION, &platformVendor);
+	std::cerr << platformVendor << "\n";
+			
+	cl_context_properties cprops[3] =
+	{CL_CONTEXT_PLATFORM, (cl_context_properties)(platformList[0])(), 0};
+	context = new cl::Context(type, cprops, NULL, NULL, &err);
+	checkErr("Conext::Context()");
+
+	//Find devices
+	vector<cl::Device> devices;
+	devices = context->getInfo<CL_CONTEXT_DEVICES>();
+	err = devices.size() > 0 ? CL_SUCCESS : -1;
+	checkErr("devices.size() > 0");
+
+	//A device per queue (decomposed simulation)
+	if(count > 1)
+	{
+#ifdef CL_VERSION_1_2
+		if((int)devices.size() < count && devices[0].getInfo<CL_DEVICE_PARTITION_MAX_SUB_DEVICES>() > 1)
+		{
+			cl_uint units = devices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+			cl_device_partition_property partition[3] =
+			{CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)max(1u, units / count), 0};
+			vector<cl::Device> subDevices;
+			if(devices[0].createSubDevices(partition, &subDevices) == CL_SUCCESS && subDevices.size() > 1)
+				devices = subDevices;
+		}
+#endif
+		if((int)devices.size() > count)
+			devices.resize(count);
+		if((int)devices.size() < count)
+			cout<<"Only "<<devices.size()<<" devices to decompose the volume over"<<endl;
+		count = devices.size();
+
+		delete context;
+		context = new cl::Context(devices, cprops, NULL, NULL, &err);
+		checkErr("Context::Context() (devices)");
+	}
+
+	//Field placement: SVM if every device has it, fine-grained if they all do
+	placement = requested;
+	fineSVM = false;
+	if(placement == Simulation::SVM)
+	{
+#ifdef CL_VERSION_2_0
+		cl_device_svm_capabilities common = ~(cl_device_svm_capabilities)0;
+		for(cl::Device& device : devices)
+		{
+			cl_device_svm_capabilities svm = 0;
+			if(clGetDeviceInfo(device(), CL_DEVICE_SVM_CAPABILITIES, sizeof(svm), &svm, NULL) != CL_SUCCESS)
+				svm = 0;
+			common &= svm;
+		}
+		fineSVM = (common & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+		if(!(common & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER))
+#endif
+		{
+			cout<<"No shared virtual memory on these devices, using pinned buffers"<<endl;
+			placement = Simulation::PINNED;
+		}
+	}
+	const char* placements[] = {"host (page-aligned, used in place)", "device only", "pinned host (mapped)", "shared virtual memory"};
+	cout<<"Memory: "<<placements[placement];
+	if(placement == Simulation::SVM)
+		cout<<(fineSVM ? ", fine-grained" : ", coarse-grained");
+	cout<<endl;
+
+	//Make queues - out-of-order if the device allows it, so that the
+	//simulation's event graph can overlap independent kernels. One
+	//per device, the first is the one everything else uses.
+	cl_command_queue_properties queueProperties;
+	for(int d = 0; d < (int)devices.size() && d < count; d++)
+	{
+		queueProperties = logging ? CL_QUEUE_PROFILING_ENABLE : 0;
+		if(!serialized && (devices[d].getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
+			queueProperties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+		queues.push_back(new cl::CommandQueue(*context, devices[d], queueProperties, &err));
+		checkErr("CommandQueue::CommandQueue()");
+	}
+	queue = queues[0];
+	background = new cl::CommandQueue(*context, devices[0], logging ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+	checkErr("CommandQueue::CommandQueue() (background)");
+	if(serialized)
+		cout<<"Execution: serialized (host waits on every kernel)"<<endl;
+	else if(queueProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+		cout<<"Execution: event graph, out-of-order queue"<<endl;
+	else
+		cout<<"Execution: event graph, in-order queue"<<endl;
+
+	//The program, from the sources the mode needs (fluid.cl first if it's
+	//one, it defines the storage type the raycaster reads), is built in the
+	//background while the caller goes on; finishBuild waits for it
+	std::string source;
+	for(const string& name : sources)
+	{
+		File file(name);
+		const char* text = file.ReadAll();
+		source.append(text, file.GetLength());
+		source += '\n';
+		if(name == "fluid.cl")
+			fluidSource.assign(text, file.GetLength()); //kept for specialize
+	}
+	buildOptions = halfStorage ? "-DHALF_STORAGE" : "";
+	builder = std::thread([this, source]()
+	{
+		double start = highResTime();
+		program = build(source, buildOptions, &buildStatus, &buildLog, &buildCached);
+		buildTime = highResTime() - start;
+	});
+}
+
+//Waits for the program initialize started building
+void OpenCL::finishBuild()
+{
+	double start = highResTime();
+	builder.join();
+	cout<<buildLog;
+	err = buildStatus;
+	checkErr("Program::build()");
+	cout<<"Program: "<<(buildCached ? "binaries from clcache/" : "compiled from source")<<" in "<<buildTime * 1000
+		<<" ms, waited for "<<(highResTime() - start) * 1000<<" ms"<<endl;
+}
+
+//Build options of fluid.cl for volumes of the given extents
+static std::string specializeOptions(const std::string& buildOptions, cl_int4 n)
+{
+	ostringstream options;
+	options<<buildOptions<<" -DNX="<<n.s[0]<<" -DNY="<<n.s[1]<<" -DNZ="<<n.s[2]<<" -DNW="<<n.s[3];
+	return options.str();
+}
+
+/*
+ * fluid.cl with the extents of the volume as compile-time constants. Built
+ * the first time a volume of the extents asks for it, resizes back to them
+ * find it in the cache. Waits for the build thread if it's building these
+ * (or others, which are kept too).
+ */
+cl::Program* OpenCL::specialize(cl_int4 n)
+{
+	std::string options = specializeOptions(buildOptions, n);
+	queued = false;
+	if(!specializedPrograms.count(options))
+	{
+		if(!specializing.empty())
+		{
+			builder.join();
+			finishSpecializing();
+		}
+		if(!specializedPrograms.count(options))
+		{
+			startSpecializing(n);
+			builder.join();
+			finishSpecializing();
+		}
+	}
+	Specialized& specialized = specializedPrograms[options];
+	specialized.used = ++specializedUses;
+	specializedInUse = specialized.program;
+	return specialized.program;
+}
+
+//Starts building fluid.cl for the extents on the build thread, unless it's
+//cached; while another is building it goes after it, in place of any queued
+void OpenCL::specializeLater(cl_int4 n)
+{
+	std::string options = specializeOptions(buildOptions, n);
+	specializedReady(n);
+	if(specializedPrograms.count(options) || specializing == options)
+		return;
+	if(specializing.empty())
+		startSpecializing(n);
+	else
+	{
+		queuedExtents = n;
+		queued = true;
+	}
+}
+
+//Whether fluid.cl for the extents is cached, taking in a finished build
+bool OpenCL::specializedReady(cl_int4 n)
+{
+	if(!specializing.empty() && specializeDone)
+	{
+		builder.join();
+		finishSpecializing();
+		if(queued && !specializedPrograms.count(specializeOptions(buildOptions, queuedExtents)))
+			startSpecializing(queuedExtents);
+		queued = false;
+	}
+	return specializedPrograms.count(specializeOptions(buildOptions, n)) > 0;
+}
+
+void OpenCL::startSpecializing(cl_int4 n)
+{
+	std::string options = specializeOptions(buildOptions, n);
+	specializing = options;
+	specializingExtents = n;
+	specializeDone = false;
+	builder = std::thread([this, options]()
+	{
+		double start = highResTime();
+		specializeProgram = build(fluidSource, options, &buildStatus, &buildLog, &buildCached);
+		buildTime = highResTime() - start;
+		specializeDone = true;
+	});
+}
+
+//Takes in the program of the build thread, once it's joined
+void OpenCL::finishSpecializing()
+{
+	if(buildStatus != CL_SUCCESS)
+		cout<<buildLog;
+	err = buildStatus;
+	checkErr("Program::build() (specialized)");
+	cl_int4 n = specializingExtents;
+	cout<<"Kernels for "<<n.s[0]<<"x"<<n.s[1]<<"x"<<n.s[2]<<(buildCached ? " loaded" : " built")<<" in "<<buildTime * 1000<<" ms"<<endl;
+	keepSpecialized(specializing, specializeProgram);
+	specializing.clear();
+}
+
+//Caches a specialized program, dropping the least recently used beyond the
+//limit, but not the one the kernels are made from (a program made later at
+//its address would look like it)
+void OpenCL::keepSpecialized(const std::string& options, cl::Program* program)
+{
+	Specialized& specialized = specializedPrograms[options];
+	specialized.program = program;
+	specialized.used = ++specializedUses;
+	while(specializedPrograms.size() > specializedLimit)
+	{
+		auto oldest = specializedPrograms.end();
+		for(auto p = specializedPrograms.begin(); p != specializedPrograms.end(); ++p)
+			if(p->second.program != specializedInUse && (oldest == specializedPrograms.end() || p->second.used < oldest->second.used))
+				oldest = p;
+		delete oldest->second.program;
+		specializedPrograms.erase(oldest);
+	}
+}
+
+//FNV-1a, a hash of the cache key that's the same from run to run
+static unsigned long long fnv1a(const std::string& key)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for(unsigned char c : key)
+		hash = (hash ^ c) * 1099511628211ULL;
+	return hash;
+}
+
+//Cache file of a program's binary for a device
+static std::string cachePath(const cl::Device& device, const std::string& options, const std::string& source)
+{
+	std::string key = device.getInfo<CL_DEVICE_NAME>() + '\0' + device.getInfo<CL_DRIVER_VERSION>() + '\0' + options + '\0' + source;
+	char path[64];
+	snprintf(path, sizeof(path), "clcache/%016llx.bin", fnv1a(key));
+	return path;
+}
+
+/*
+ * A program for the devices of the context, from the binaries of an earlier
+ * run if clcache/ has them for every device (binaries that no longer load are
+ * deleted), otherwise compiled from source, with its binaries stored for the
+ * next run. Safe to call from the build thread: the outcome goes to status,
+ * log and cached.
+ */
+cl::Program* OpenCL::build(const std::string& source, const std::string& options, cl_int* status, std::string* log, bool* cached)
+{
+	vector<cl::Device> devices = context->getInfo<CL_CONTEXT_DEVICES>();
+	vector<string> paths;
+	vector<vector<char> > binaries(devices.size());
+	cl::Program::Binaries pieces;
+	bool complete = true;
+	for(size_t d = 0; d < devices.size(); d++)
+	{
+		paths.push_back(cachePath(devices[d], options, source));
+		ifstream in(paths[d].c_str(), ios::in | ios::binary);
+		binaries[d].assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+		pieces.push_back(std::make_pair((const void*)binaries[d].data(), binaries[d].size()));
+		complete = complete && !binaries[d].empty();
+	}
+
+	*cached = false;
+	log->clear();
+	if(complete)
+	{
+		vector<cl_int> loaded;
+		cl::Program* program = new cl::Program(*context, devices, pieces, &loaded, status);
+		for(cl_int l : loaded)
+			if(l != CL_SUCCESS)
+				*status = l;
+		if(*status == CL_SUCCESS)
+			*status = program->build(devices, options.c_str());
+		if(*status == CL_SUCCESS)
+		{
+			*cached = true;
+			return program;
+		}
+		delete program;
+		for(const string& path : paths) //stale or damaged, made again below
+			remove(path.c_str());
+	}
+
+	cl::Program::Sources sources(1, std::make_pair(source.c_str(), source.size()));
+	cl::Program* program = new cl::Program(*context, sources, status);
+	if(*status == CL_SUCCESS)
+		*status = program->build(devices, options.c_str());
+	*log = program->getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
+	if(*status != CL_SUCCESS)
+		return program;
+
+	//The binaries come in the order of the program's devices, the context's
+	vector<size_t> sizes(devices.size());
+	vector<unsigned char*> pointers(devices.size());
+	if(clGetProgramInfo((*program)(), CL_PROGRAM_BINARY_SIZES, sizes.size() * sizeof(size_t), &sizes[0], NULL) != CL_SUCCESS)
+		return program;
+	for(size_t d = 0; d < devices.size(); d++)
+	{
+		binaries[d].resize(sizes[d]);
+		pointers[d] = (unsigned char*)binaries[d].data();
+	}
+	if(clGetProgramInfo((*program)(), CL_PROGRAM_BINARIES, pointers.size() * sizeof(unsigned char*), &pointers[0], NULL) != CL_SUCCESS)
+		return program;
+	//Written to a file of this process and renamed into place, so other runs
+	//never load a partial one
+	mkdir("clcache", 0755);
+	for(size_t d = 0; d < devices.size(); d++)
+		if(sizes[d] > 0)
+		{
+			ostringstream temporary;
+			temporary<<paths[d]<<"."<<getpid();
+			ofstream out(temporary.str().c_str(), ios::out | ios::binary);
+			out.write(binaries[d].data(), sizes[d]);
+			out.close();
+			if(!out.good() || rename(temporary.str().c_str(), paths[d].c_str()) != 0)
+				remove(temporary.str().c_str());
+		}
+	return program;
+}
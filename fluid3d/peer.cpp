@@ -0,0 +1,228 @@
+#include "peer.h"
+#include "main.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <errno.h>
+
+//Socket address of the given rank's listener, for either kind of address
+static int address(const char* name, int rank, sockaddr_storage* result, socklen_t* length)
+{
+	memset(result, 0, sizeof(*result));
+	const char* colon = strrchr(name, ':');
+	if(colon == NULL)
+	{
+		sockaddr_un* local = (sockaddr_un*)result;
+		local->sun_family = AF_UNIX;
+		snprintf(local->sun_path, sizeof(local->sun_path), "%s.%d", name, rank);
+		*length = sizeof(sockaddr_un);
+		return AF_UNIX;
+	}
+
+	string host(name, colon - name);
+	char port[16];
+	snprintf(port, sizeof(port), "%d", atoi(colon + 1) + rank);
+	addrinfo hints, *found;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host.c_str(), port, &hints, &found) != 0)
+		return -1;
+	memcpy(result, found->ai_addr, found->ai_addrlen);
+	*length = found->ai_addrlen;
+	freeaddrinfo(found);
+	return AF_INET;
+}
+
+/*
+ * Opens the listener the process of rank + 1 connects to,
+ * -1 if it can't be had
+ */
+int Peer::listen(const char* name, int rank)
+{
+	sockaddr_storage where;
+	socklen_t length;
+	int family = address(name, rank, &where, &length);
+	if(family < 0)
+		return -1;
+
+	int listener = ::socket(family, SOCK_STREAM, 0);
+	if(family == AF_UNIX)
+		unlink(((sockaddr_un*)&where)->sun_path);
+	else
+	{
+		int reuse = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	}
+	if(listener < 0 || ::bind(listener, (sockaddr*)&where, length) < 0 || ::listen(listener, 1) < 0)
+	{
+		if(listener >= 0)
+			close(listener);
+		return -1;
+	}
+	return listener;
+}
+
+//Waits for rank + 1 on the listener, which is closed after
+bool Peer::accept(int listener)
+{
+	fd = ::accept(listener, NULL, NULL);
+	close(listener);
+	if(fd < 0)
+		return false;
+	start();
+	return true;
+}
+
+//Connects to the listener of the given rank, retrying while it starts up
+bool Peer::connect(const char* name, int rank)
+{
+	sockaddr_storage where;
+	socklen_t length;
+	int family = address(name, rank, &where, &length);
+	if(family < 0)
+		return false;
+
+	for(int attempt = 0; attempt < 300; attempt++)
+	{
+		fd = ::socket(family, SOCK_STREAM, 0);
+		if(fd >= 0 && ::connect(fd, (sockaddr*)&where, length) == 0)
+		{
+			start();
+			return true;
+		}
+		if(fd >= 0)
+			close(fd);
+		fd = -1;
+		usleep(100000);
+	}
+	return false;
+}
+
+void Peer::start()
+{
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); //fails harmlessly on Unix sockets
+	worker = std::thread(&Peer::run, this);
+}
+
+Peer::~Peer()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	pending.notify_one();
+	if(fd >= 0)
+		shutdown(fd, SHUT_RDWR);
+	if(worker.joinable())
+		worker.join();
+	if(fd >= 0)
+		close(fd);
+}
+
+/*
+ * Queues the exchange of a plane: the size bytes at sendOffset in the buffer
+ * go to the peer, and what it sends back is written at receiveOffset.
+ */
+void Peer::exchange(EventGraph& graph, cl::Buffer* buffer, size_t sendOffset, size_t receiveOffset, size_t size)
+{
+	Job job;
+	job.slot = next;
+	job.size = size;
+	Slot& slot = ring[next];
+	next = (next + 1) % slots;
+	if(slot.out.size() < size)
+	{
+		slot.out.resize(size);
+		slot.in.resize(size);
+	}
+
+	graph.download(buffer, sendOffset, size, &slot.out[0], slot.uploaded, &job.downloaded);
+	graph.flush(); //the thread is waiting for it
+	job.received = cl::UserEvent(*opencl->context, &opencl->err);
+	opencl->checkErr("UserEvent::UserEvent()");
+
+	//Queued before the upload, which may wait for it straight away (-serial)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		jobs.push_back(job);
+	}
+	pending.notify_one();
+
+	graph.upload(buffer, receiveOffset, size, &slot.in[0], job.received, &slot.uploaded);
+}
+
+//The peer's thread: sends and receives the queued planes in order
+void Peer::run()
+{
+	while(true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			pending.wait(guard, [this] { return stopping || !jobs.empty(); });
+			if(stopping)
+				return;
+			job = jobs.front();
+			jobs.pop_front();
+		}
+
+		Slot& slot = ring[job.slot];
+		job.downloaded.wait();
+		if(!transfer(&slot.out[0], &slot.in[0], job.size))
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if(stopping) //shut down by the destructor
+				return;
+			std::cerr << "ERROR: lost the connection to a peer" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		job.received.setStatus(CL_COMPLETE);
+	}
+}
+
+/*
+ * Sends out and receives in at the same time, as far as the socket takes
+ * them, so that neither side's send waits for the other to receive
+ */
+bool Peer::transfer(const char* out, char* in, size_t size)
+{
+	size_t sent = 0, received = 0;
+	while(sent < size || received < size)
+	{
+		pollfd ready;
+		ready.fd = fd;
+		ready.events = (sent < size ? POLLOUT : 0) | (received < size ? POLLIN : 0);
+		ready.revents = 0;
+		if(poll(&ready, 1, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		if(ready.revents & POLLERR)
+			return false;
+
+		if(sent < size && (ready.revents & POLLOUT))
+		{
+			ssize_t n = send(fd, out + sent, size - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return false;
+			if(n > 0)
+				sent += n;
+		}
+		if(received < size && (ready.revents & (POLLIN | POLLHUP)))
+		{
+			ssize_t n = recv(fd, in + received, size - received, MSG_DONTWAIT);
+			if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				return false;
+			if(n > 0)
+				received += n;
+		}
+	}
+	return true;
+}
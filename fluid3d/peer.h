@@ -0,0 +1,69 @@
+/*
+ * Connection to the process holding the neighbouring planes of a
+ * distributed simulation, over a Unix domain or a TCP socket.
+ *
+ * The simulation queues exchanges without waiting: the plane to send is
+ * downloaded into a staging slot, and the upload of the received plane
+ * waits on a user event. A thread of the peer sends and receives the
+ * planes in order, both at once without blocking (the other side does
+ * the same), and completes the user events. The device meanwhile goes
+ * on with whatever doesn't need the ghost planes.
+ */
+#pragma once
+#include <CL/cl.hpp>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "eventgraph.h"
+
+struct OpenCL;
+
+class Peer
+{
+public:
+	Peer(OpenCL* opencl) : opencl(opencl), next(0), fd(-1), stopping(false) {}
+	~Peer();
+
+	//Addresses are a path (rank r listens on path.r) or host:port (port + r)
+	static int listen(const char* address, int rank);
+	bool accept(int listener);
+	bool connect(const char* address, int rank);
+
+	void exchange(EventGraph& graph, cl::Buffer* buffer, size_t sendOffset, size_t receiveOffset, size_t size);
+
+private:
+	OpenCL* opencl; //the user events are made on its context
+
+	//Staging for the exchanges in flight. A slot is reused once its last
+	//upload is done, the plane size being fixed for the run.
+	static const int slots = 4;
+	struct Slot
+	{
+		std::vector<char> out, in;
+		cl::Event uploaded;
+	};
+	Slot ring[slots];
+	int next;
+
+	//What the thread needs of an exchange
+	struct Job
+	{
+		int slot;
+		size_t size;
+		cl::Event downloaded;
+		cl::UserEvent received;
+	};
+
+	int fd;
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable pending;
+	std::deque<Job> jobs;
+	bool stopping;
+
+	void start();
+	void run();
+	bool transfer(const char* out, char* in, size_t size);
+};
@@ -0,0 +1,92 @@
+#include "plan.h"
+#include "main.h"
+
+void PlanKernel::remember(cl_uint index, size_t size, const void* value)
+{
+	if(arguments.size() <= index)
+		arguments.resize(index + 1);
+	arguments[index].size = size;
+	arguments[index].value = value ? std::string((const char*)value, size) : std::string();
+}
+
+std::string PlanKernel::signature() const
+{
+	std::string s = name;
+	for(const Argument& argument : arguments)
+	{
+		s.append((const char*)&argument.size, sizeof(argument.size));
+		s += argument.value;
+	}
+	return s;
+}
+
+//A new kernel of the same function with the arguments set so far
+cl::Kernel* PlanKernel::instance(cl_int* err) const
+{
+	cl::Kernel* kernel = new cl::Kernel(*program, name.c_str(), err);
+	for(size_t a = 0; a < arguments.size() && *err == CL_SUCCESS; a++)
+	{
+		const Argument& argument = arguments[a];
+		*err = kernel->setArg(a, argument.size, argument.value.empty() ? NULL : argument.value.data());
+	}
+	return kernel;
+}
+
+void StepPlan::initialize(OpenCL* backend)
+{
+	opencl = backend;
+}
+
+void StepPlan::record(int steps)
+{
+	clear();
+	recording = true;
+	solverSteps = steps;
+}
+
+void StepPlan::clear()
+{
+	for(auto& instance : instances)
+		delete instance.second;
+	instances.clear();
+	launches.clear();
+	recording = false;
+}
+
+void StepPlan::launch(const PlanKernel& kernel, const cl::NDRange& global, const cl::NDRange& local,
+		const std::vector<cl::Buffer*>& reads, const std::vector<cl::Buffer*>& writes)
+{
+	if(!recording)
+		return;
+
+	cl::Kernel*& instance = instances[kernel.signature()];
+	if(!instance)
+	{
+		instance = kernel.instance(&opencl->err);
+		opencl->checkErr("Kernel::Kernel() (plan)");
+	}
+
+	Launch l = {instance, global, local, reads, writes, 0};
+	launches.push_back(l);
+}
+
+void StepPlan::copy(cl::Buffer* source, cl::Buffer* destination, size_t size)
+{
+	if(!recording)
+		return;
+
+	Launch l = {NULL, cl::NullRange, cl::NullRange, {source}, {destination}, size};
+	launches.push_back(l);
+}
+
+//The recorded step again, through the event graph as before
+void StepPlan::replay(EventGraph& graph)
+{
+	for(const Launch& l : launches)
+	{
+		if(l.kernel)
+			graph.launch(*l.kernel, l.global, l.reads, l.writes, l.local);
+		else
+			graph.copy(l.reads[0], l.writes[0], l.size);
+	}
+}
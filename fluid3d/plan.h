@@ -0,0 +1,102 @@
+/*
+ * Step plans.
+ *
+ * The parallel step sets the arguments of the same few kernels over and
+ * over - one setBound and one advect kernel serve every field - so a frame
+ * pays for dozens of setArg calls on top of its launches. A plan records
+ * the launches of one step instead, each on a kernel instance of its own
+ * that keeps the arguments it was launched with, and replays them on the
+ * following frames without setting a single argument.
+ *
+ * Launches with the same arguments share an instance (the sweeps of a
+ * solve mostly do). A plan holds as long as the extents, the buffers and
+ * the solver settings don't change.
+ */
+#pragma once
+#include <CL/cl.hpp>
+#include <vector>
+#include <map>
+#include <string>
+#include "eventgraph.h"
+
+struct OpenCL;
+
+/*
+ * Kernel that remembers its arguments as they are set, so that an
+ * instance with the same ones can be made for a plan
+ */
+class PlanKernel : public cl::Kernel
+{
+public:
+	PlanKernel(const cl::Program& program, const char* name, cl_int* err)
+		: cl::Kernel(program, name, err), program(&program), name(name) {}
+
+	template<typename T> cl_int setArg(cl_uint index, const T& value)
+	{
+		remember(index, sizeof(T), &value);
+		return cl::Kernel::setArg(index, value);
+	}
+	cl_int setArg(cl_uint index, const cl::Buffer& buffer)
+	{
+		cl_mem handle = buffer();
+		remember(index, sizeof(cl_mem), &handle);
+		return cl::Kernel::setArg(index, buffer);
+	}
+	cl_int setArg(cl_uint index, size_t size, const void* value) //NULL: local memory
+	{
+		remember(index, size, value);
+		return cl::Kernel::setArg(index, size, value);
+	}
+
+	std::string signature() const; //function name and argument bytes
+	cl::Kernel* instance(cl_int* err) const;
+
+private:
+	struct Argument
+	{
+		size_t size;
+		std::string value; //empty for local memory
+	};
+
+	const cl::Program* program;
+	std::string name;
+	std::vector<Argument> arguments;
+
+	void remember(cl_uint index, size_t size, const void* value);
+};
+
+class StepPlan
+{
+public:
+	StepPlan() : opencl(NULL), recording(false), solverSteps(0) {}
+	~StepPlan() { clear(); }
+
+	void initialize(OpenCL*);
+	void record(int steps); //the launches from here on, of a step doing that many solver steps
+	void stop() { recording = false; }
+	bool recorded(int steps) { return !recording && !launches.empty() && solverSteps == steps; }
+	void clear();
+
+	//Add to the plan being recorded, if any
+	void launch(const PlanKernel&, const cl::NDRange& global, const cl::NDRange& local,
+			const std::vector<cl::Buffer*>& reads, const std::vector<cl::Buffer*>& writes);
+	void copy(cl::Buffer* source, cl::Buffer* destination, size_t size);
+
+	void replay(EventGraph&);
+
+private:
+	//A kernel launch, or a copy if kernel is NULL
+	struct Launch
+	{
+		cl::Kernel* kernel;
+		cl::NDRange global, local;
+		std::vector<cl::Buffer*> reads, writes;
+		size_t size;
+	};
+
+	OpenCL* opencl;
+	bool recording;
+	int solverSteps;
+	std::vector<Launch> launches;
+	std::map<std::string, cl::Kernel*> instances; //by signature
+};
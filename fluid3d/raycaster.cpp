@@ -1,31 +1,36 @@
 #include "raycaster.h"
 #include "main.h"
 
-void RayCaster::initialize(int N, cl::Buffer* volume)
+void RayCaster::initialize(OpenCL* backend, cl_int4 extent, cl::Buffer* volume)
 {
+	opencl = backend;
+
 	//Output texture buffer allocation
 	textureLength = 256*256*4;
 	textureData = new unsigned char[textureLength];
 	memset(textureData, 0, textureLength);
-	buf_texture = new cl::Buffer(*opencl.context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, textureLength, textureData, &opencl.err);
-	opencl.checkErr("Buffer::Buffer()");
+	buf_texture = new cl::Buffer(*opencl->context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, textureLength, textureData, &opencl->err);
+	opencl->checkErr("Buffer::Buffer()");
 
 	//OpenCL kernel initialisation
-	rayCastKernel = new cl::Kernel(*opencl.program, "RayCaster", &opencl.err);
-	opencl.checkErr("Kernel::Kernel() (raycast)");
+	rayCastKernel = new cl::Kernel(*opencl->program, "RayCaster", &opencl->err);
+	opencl->checkErr("Kernel::Kernel() (raycast)");
 	rayCastKernel->setArg(0, 256);
 	rayCastKernel->setArg(1, 256);
 	rayCastKernel->setArg(2, *buf_texture);
 	rayCastKernel->setArg(3, 256);
 
-	setN(N);
+	setExtent(extent);
 	setVolume(volume);
 }
 
-//Volume resolution
-void RayCaster::setN(int N)
+//Volume resolution, interior cells along each axis and the longest side in w
+void RayCaster::setExtent(cl_int4 extent)
 {
-	rayCastKernel->setArg(9, N + 2);
+	//The kernel reads the whole volume, walls included
+	for(int a = 0; a < 4; a++)
+		extent.s[a] += 2;
+	rayCastKernel->setArg(9, extent);
 }
 
 //Volume data (pointer)
@@ -48,13 +53,13 @@ void RayCaster::setCamera(Camera& camera)
 void RayCaster::shoot()
 {
 	//Raycast
-	opencl.err = opencl.queue->enqueueNDRangeKernel( *rayCastKernel, cl::NullRange, cl::NDRange(256, 256), cl::NullRange, NULL, &opencl.event);
-	opencl.checkErr("ComamndQueue::enqueueNDRangeKernel() (render)");
+	opencl->err = opencl->queue->enqueueNDRangeKernel( *rayCastKernel, cl::NullRange, cl::NDRange(256, 256), cl::NullRange, NULL, &opencl->event);
+	opencl->checkErr("ComamndQueue::enqueueNDRangeKernel() (render)");
 
-	opencl.wait();
+	opencl->wait();
 
-	opencl.err = opencl.queue->enqueueReadBuffer( *buf_texture, CL_TRUE, 0, textureLength, textureData);
-	opencl.checkErr("ComamndQueue::enqueueReadBuffer()");
+	opencl->err = opencl->queue->enqueueReadBuffer( *buf_texture, CL_TRUE, 0, textureLength, textureData);
+	opencl->checkErr("ComamndQueue::enqueueReadBuffer()");
 }
 
 unsigned char* RayCaster::getTexture()
@@ -8,6 +8,8 @@
 #include <CL/cl.hpp>
 #include "camera.h"
 
+struct OpenCL;
+
 class RayCaster
 {
 public:
@@ -19,16 +21,18 @@ public:
 		delete rayCastKernel;
 	}
 
-	void initialize(int, cl::Buffer*);
+	void initialize(OpenCL*, cl_int4, cl::Buffer*);
 	void shoot();
 	unsigned char* getTexture();
 
 	void setCamera(Camera&);
-	void setN(int);
+	void setExtent(cl_int4);
 	void setVolume(cl::Buffer*);
 
 
 private:
+	OpenCL* opencl;
+
 	//Kernel
 	cl::Kernel *rayCastKernel;
 	
@@ -5,21 +5,39 @@
 /*
  * Generic initialisation
  */
-void Simulation::initialize(int volumeSide)
+void Simulation::initialize(int nx, int ny, int nz)
 {
 	//Set parameters
-	N = volumeSide;
-	voxels = (N+2)*(N+2)*(N+2); 
-	size = voxels * sizeof(float);
+	Nx = nx;
+	Ny = ny;
+	Nz = nz;
+	voxels = (Nx+2)*(Ny+2)*(Nz+2); 
+	fieldBytes = halfStorage ? 2 : sizeof(float);
+	size = voxels * fieldBytes;
 
 	solverSteps = 20;
+	solver = JACOBI;
+	omega = 0;
+	tolerance = 0;
+	checkEvery = 4;
+	sweepsPerLaunch = 1;
+	packed = false;
+	sparse = false;
+	activeThreshold = 1e-4;
 	dt = 0.1; //timestep
 	visc = 0.001; //viscosity (velocity)
 	diff = 0.0005; //dampening (density)
 
 	allocateBuffers();
 
-	resampleKernel = new cl::Kernel(*opencl.program, "resample", &opencl.err);
+	//The native simulation may run without OpenCL, and its program only has
+	//the raycaster's kernels
+	if(opencl && !opencl->fluidSource.empty())
+	{
+		downsampleKernel = new cl::Kernel(*opencl->program, "downsample", &opencl->err);
+		upsampleKernel = new cl::Kernel(*opencl->program, "upsample", &opencl->err);
+		clearKernel = new PlanKernel(*opencl->program, "clearField", &opencl->err);
+	}
 
 
 	/* Future work:
@@ -28,39 +46,209 @@ void Simulation::initialize(int volumeSide)
 	*/
 }
 
+//Reserves the fields' room for extents up to nx x ny x nz, before initialize
+void Simulation::reserve(int nx, int ny, int nz)
+{
+	capacity = (nx+2)*(ny+2)*(nz+2);
+}
+
 /*
- * Parallel initialisation (many kernels)
+ * Distributed: the volume being initialized is planes offset+1 to offset+Nz
+ * of a domain span planes deep. Only the cell size and the sources depend on
+ * it, the planes next to the other processes' are exchanged by the simulation.
  */
-void ParallelSimulation::initialize(int volumeSide)
+void Simulation::setDomain(int offset, int span)
 {
-	Simulation::initialize(volumeSide);
+	zOffset = offset;
+	zSpan = span;
+}
 
-	diffuseKernel = new cl::Kernel(*opencl.program, "diffuse", &opencl.err);
-	//diffuseKernelImage3D = new cl::Kernel(*opencl.program, "diffuse_", &opencl.err);
+/*
+ * Picks the solver for diffuse and the pressure projection. Can be
+ * called between any two steps, the solver's buffers are swapped too.
+ */
+void Simulation::setSolver(Solver s)
+{
+	deallocateSolverBuffers();
+	solver = s;
+	allocateSolverBuffers();
 
-	advectKernel = new cl::Kernel(*opencl.program, "advect", &opencl.err);
+	const char* names[] = {"Jacobi", "red-black SOR", "multigrid", "conjugate gradient"};
+	cout<<"Solver: "<<names[solver]<<endl;
+}
 
-	setBoundKernel = new cl::Kernel(*opencl.program, "setBound", &opencl.err);
+/*
+ * Early termination: solves stop once the RMS residual is below t,
+ * checked every k iterations. t = 0 turns it off.
+ */
+void Simulation::setTolerance(float t, int k)
+{
+	deallocateSolverBuffers();
+	tolerance = t;
+	checkEvery = k > 0 ? k : 1;
+	allocateSolverBuffers();
+}
 
-	addSourceKernel = new cl::Kernel(*opencl.program, "addSource", &opencl.err);
+/*
+ * Temporal blocking: the Jacobi solves do k sweeps per launch in local
+ * memory (at most 4, the depth of the halo). 1 turns it off.
+ */
+void Simulation::setSweepsPerLaunch(int k)
+{
+	deallocateSolverBuffers();
+	sweepsPerLaunch = k < 1 ? 1 : (k > 4 ? 4 : k);
+	allocateSolverBuffers();
+	setKernelArguments(); //local memory sizes depend on k
+}
 
-	projectKernel1 = new cl::Kernel(*opencl.program, "project1", &opencl.err);
-	projectKernel2 = new cl::Kernel(*opencl.program, "project2", &opencl.err);
-	projectKernel3 = new cl::Kernel(*opencl.program, "project3", &opencl.err);
+/*
+ * Packed velocity: the velocity step works on one float4 field instead of
+ * u, v and w, which are only updated at the end of it
+ */
+void Simulation::setPackedVelocity(bool enable)
+{
+	deallocateSolverBuffers();
+	packed = enable;
+	allocateSolverBuffers();
+}
 
+/*
+ * Sparse mode: the stencils only run over the bricks with fluid in or next
+ * to them. Applies to the Jacobi solves of the unpacked step without
+ * temporal blocking, otherwise the whole volume is simulated as usual.
+ */
+void Simulation::setSparse(bool enable)
+{
+	deallocateSolverBuffers();
+	sparse = enable;
+	allocateSolverBuffers();
+}
+
+/*
+ * Over-relaxation factor for red-black SOR at the current resolution.
+ *
+ * The optimum is 2 / (1 + sqrt(1 - rho^2)), rho being the spectral radius of
+ * the Jacobi iteration: 6a c / (1+6a) for diffusion and c for the pressure
+ * (a = 0 here), c being the mean of cos(pi/(n+1)) over the three sides n.
+ * So it's re-derived whenever the extents change, unless -omega fixed it
+ * (for the diffusion and the pressure solves alike).
+ */
+float Simulation::relaxation(float a)
+{
+	if(omega > 0)
+		return omega;
+
+	float rho = (cos(M_PI / (Nx + 1)) + cos(M_PI / (Ny + 1)) + cos(M_PI / (Nz + 1))) / 3;
+	if(a > 0)
+		rho *= 6*a / (1 + 6*a);
+	return 2 / (1 + sqrt(1 - rho*rho));
+}
+
+/*
+ * Parallel initialisation (many kernels)
+ */
+void ParallelSimulation::initialize(int nx, int ny, int nz)
+{
+	Simulation::initialize(nx, ny, nz);
+
+	//Bricks of the tiled stencils, 8x8x4 cells or less if the device can't
+	cl::Device device = opencl->queue->getInfo<CL_QUEUE_DEVICE>();
+	size_t maxGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	tileX = 8; tileY = 8; tileZ = 4;
+	while((size_t)(tileX * tileY * tileZ) > maxGroup)
+	{
+		if(tileZ > 1) tileZ /= 2;
+		else tileY /= 2;
+	}
+	localMemory = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+	graph.initialize(opencl, opencl->queue);
+	plan.initialize(opencl);
 
 	setKernelArguments();
 }
 
+//The program the kernels are made from, fluid.cl built for the extents with -specialize
+cl::Program* ParallelSimulation::program()
+{
+	return specialized ? opencl->specialize(extent()) : opencl->program;
+}
+
+void ParallelSimulation::makeKernels(cl::Program* program)
+{
+	diffuseKernel = new PlanKernel(*program, "diffuse", &opencl->err);
+	//diffuseKernelImage3D = new PlanKernel(*program, "diffuse_", &opencl->err);
+
+	advectKernel = new PlanKernel(*program, "advect", &opencl->err);
+
+	setBoundKernel = new PlanKernel(*program, "setBound", &opencl->err);
+
+	addSourceKernel = new PlanKernel(*program, "addSources", &opencl->err);
+
+	projectKernel1 = new PlanKernel(*program, "project1", &opencl->err);
+	projectKernel2 = new PlanKernel(*program, "project2", &opencl->err);
+	projectKernel3 = new PlanKernel(*program, "project3", &opencl->err);
+
+	//Stencil kernels that also write the walls
+	diffuseBoundKernel = new PlanKernel(*program, "diffuseBound", &opencl->err);
+	project1BoundKernel = new PlanKernel(*program, "project1Bound", &opencl->err);
+	project2BoundKernel = new PlanKernel(*program, "project2Bound", &opencl->err);
+	project3BoundKernel = new PlanKernel(*program, "project3Bound", &opencl->err);
+	advectBoundKernel = new PlanKernel(*program, "advectBound", &opencl->err);
+
+	diffuseRedBlackKernel = new PlanKernel(*program, "diffuseRedBlack", &opencl->err);
+	project2RedBlackKernel = new PlanKernel(*program, "project2RedBlack", &opencl->err);
+
+	mgSmoothKernel = new PlanKernel(*program, "mgSmooth", &opencl->err);
+	mgResidualKernel = new PlanKernel(*program, "mgResidual", &opencl->err);
+	mgRestrictKernel = new PlanKernel(*program, "mgRestrict", &opencl->err);
+	mgProlongKernel = new PlanKernel(*program, "mgProlong", &opencl->err);
+
+	pcgInitKernel = new PlanKernel(*program, "pcgInit", &opencl->err);
+	pcgApplyKernel = new PlanKernel(*program, "pcgApply", &opencl->err);
+	pcgUpdateKernel = new PlanKernel(*program, "pcgUpdate", &opencl->err);
+	pcgDirectionKernel = new PlanKernel(*program, "pcgDirection", &opencl->err);
+	dotPartialKernel = new PlanKernel(*program, "dotPartial", &opencl->err);
+	dotFinalKernel = new PlanKernel(*program, "dotFinal", &opencl->err);
+	residualPartialKernel = new PlanKernel(*program, "residualPartial", &opencl->err);
+
+	//Local-memory tiled stencils
+	diffuseTiledKernel = new PlanKernel(*program, "diffuseTiled", &opencl->err);
+	project1TiledKernel = new PlanKernel(*program, "project1Tiled", &opencl->err);
+	project2TiledKernel = new PlanKernel(*program, "project2Tiled", &opencl->err);
+	project3TiledKernel = new PlanKernel(*program, "project3Tiled", &opencl->err);
+
+	jacobiBlockedKernel = new PlanKernel(*program, "jacobiBlocked", &opencl->err);
+
+	//Packed velocity
+	packVelocityKernel = new PlanKernel(*program, "packVelocity", &opencl->err);
+	unpackVelocityKernel = new PlanKernel(*program, "unpackVelocity", &opencl->err);
+	diffusePackedKernel = new PlanKernel(*program, "diffusePacked", &opencl->err);
+	advectPackedKernel = new PlanKernel(*program, "advectPacked", &opencl->err);
+	project1PackedKernel = new PlanKernel(*program, "project1Packed", &opencl->err);
+	project3PackedKernel = new PlanKernel(*program, "project3Packed", &opencl->err);
+
+	//Sparse mode
+	markBricksKernel = new PlanKernel(*program, "markBricks", &opencl->err);
+	listBricksKernel = new PlanKernel(*program, "listBricks", &opencl->err);
+	clearBricksKernel = new PlanKernel(*program, "clearBricks", &opencl->err);
+	diffuseSparseKernel = new PlanKernel(*program, "diffuseSparse", &opencl->err);
+	advectSparseKernel = new PlanKernel(*program, "advectSparse", &opencl->err);
+	project1SparseKernel = new PlanKernel(*program, "project1Sparse", &opencl->err);
+	project2SparseKernel = new PlanKernel(*program, "project2Sparse", &opencl->err);
+	project3SparseKernel = new PlanKernel(*program, "project3Sparse", &opencl->err);
+	kernelProgram = program;
+}
+
 /*
  * Sequential initialisation (1 kernel)
  */
-void SequentialSimulation::initialize(int volumeSide)
+void SequentialSimulation::initialize(int nx, int ny, int nz)
 {
-	Simulation::initialize(volumeSide);
+	Simulation::initialize(nx, ny, nz);
 
-	fluidKernel = new cl::Kernel(*opencl.program, "fluid");
-	opencl.checkErr("Kernel::Kernel() (fluid)");
+	fluidKernel = new cl::Kernel(*opencl->program, "fluid");
+	opencl->checkErr("Kernel::Kernel() (fluid)");
 	setKernelArguments();
 }
 
@@ -69,30 +257,103 @@ void SequentialSimulation::initialize(int volumeSide)
  */
 void ParallelSimulation::setKernelArguments()
 {
+	cl_int4 n = extent();
+
+	//Specialized, the kernels of other extents are no use
+	cl::Program* wanted = program();
+	if(wanted != kernelProgram)
+	{
+		if(kernelProgram)
+			deleteKernels();
+		makeKernels(wanted);
+		replan = true;
+	}
+
 	//Diffuse kernel
-	diffuseKernel->setArg(0, N);
-	//diffuseKernelImage3D->setArg(0, N);
+	diffuseKernel->setArg(0, n);
+	diffuseBoundKernel->setArg(0, n);
+	diffuseRedBlackKernel->setArg(0, n);
+	//diffuseKernelImage3D->setArg(0, n);
 
 	//Advect kernel
-	advectKernel->setArg(0, N);
+	advectKernel->setArg(0, n);
 	advectKernel->setArg(1, 0);
 	advectKernel->setArg(7, (float)dt);
+	advectBoundKernel->setArg(0, n);
+	advectBoundKernel->setArg(7, (float)dt);
+	cl_float2 zClamp;
+	zClamp.s[0] = 0.5f;
+	zClamp.s[1] = Nz + 0.5f;
+	advectKernel->setArg(8, zClamp);
+	advectBoundKernel->setArg(8, zClamp);
 
 	//Set Bound kernel
-	setBoundKernel->setArg(0, N);
+	setBoundKernel->setArg(0, n);
 
 	//Add source kernel
-	addSourceKernel->setArg(0, dt);
+	addSourceKernel->setArg(0, voxels);
+	addSourceKernel->setArg(1, dt);
 
 	//Project kernel
-	projectKernel1->setArg(0, N);
-	projectKernel2->setArg(0, N);
-	projectKernel3->setArg(0, N);
+	projectKernel1->setArg(0, n);
+	projectKernel2->setArg(0, n);
+	projectKernel3->setArg(0, n);
+	project1BoundKernel->setArg(0, n);
+	project2BoundKernel->setArg(0, n);
+	project3BoundKernel->setArg(0, n);
+	project2RedBlackKernel->setArg(0, n);
+
+	//Tiled kernels: extents and the local memory for the brick and its halo
+	size_t tileBytes = (tileX + 2) * (tileY + 2) * (tileZ + 2) * sizeof(float);
+	diffuseTiledKernel->setArg(0, n);
+	diffuseTiledKernel->setArg(5, tileBytes, NULL);
+	project1TiledKernel->setArg(0, n);
+	project1TiledKernel->setArg(6, 3 * tileBytes, NULL); //u, v and w
+	project2TiledKernel->setArg(0, n);
+	project2TiledKernel->setArg(6, tileBytes, NULL);
+	project3TiledKernel->setArg(0, n);
+	project3TiledKernel->setArg(6, tileBytes, NULL);
+
+	//Temporal blocking: three arrays of the brick with a halo of launchSweeps cells
+	launchSweeps = sweepsPerLaunch;
+	size_t blockBytes;
+	for(;; launchSweeps--)
+	{
+		int halo = 2 * launchSweeps;
+		blockBytes = (tileX + halo) * (tileY + halo) * (tileZ + halo) * sizeof(float);
+		if(launchSweeps == 1 || 3 * blockBytes <= localMemory)
+			break;
+	}
+	jacobiBlockedKernel->setArg(0, n);
+	jacobiBlockedKernel->setArg(8, blockBytes, NULL);
+	jacobiBlockedKernel->setArg(9, blockBytes, NULL);
+	jacobiBlockedKernel->setArg(10, blockBytes, NULL);
+
+	//Packed velocity
+	packVelocityKernel->setArg(0, dt);
+	diffusePackedKernel->setArg(0, n);
+	advectPackedKernel->setArg(0, n);
+	advectPackedKernel->setArg(4, dt);
+	project1PackedKernel->setArg(0, n);
+	project3PackedKernel->setArg(0, n);
+
+	//Sparse mode
+	markBricksKernel->setArg(0, n);
+	markBricksKernel->setArg(1, activeThreshold);
+	listBricksKernel->setArg(0, brickGrid());
+	listBricksKernel->setArg(7, (float)(dt * longest() / brick));
+	clearBricksKernel->setArg(0, n);
+	diffuseSparseKernel->setArg(0, n);
+	advectSparseKernel->setArg(0, n);
+	advectSparseKernel->setArg(9, dt);
+	project1SparseKernel->setArg(0, n);
+	project2SparseKernel->setArg(0, n);
+	project3SparseKernel->setArg(0, n);
 }
 
 void SequentialSimulation::setKernelArguments()
 {
-	fluidKernel->setArg(0, N);
+	fluidKernel->setArg(0, Nx); //a cube, see main
 	fluidKernel->setArg(1, visc);
 	fluidKernel->setArg(2, diff);
 	fluidKernel->setArg(3, dt);
@@ -107,12 +368,35 @@ void SequentialSimulation::setKernelArguments()
 }
 
 ParallelSimulation::~ParallelSimulation()
+{
+	if(kernelProgram)
+		deleteKernels();
+	abandon();
+	releaseTargets(unused);
+}
+
+void ParallelSimulation::deleteKernels()
 {
 	delete diffuseKernel;
 	delete advectKernel;
 	delete setBoundKernel;
 	delete addSourceKernel;
 	delete projectKernel1; delete projectKernel2; delete projectKernel3;
+	delete diffuseBoundKernel; delete advectBoundKernel;
+	delete project1BoundKernel; delete project2BoundKernel; delete project3BoundKernel;
+	delete diffuseRedBlackKernel; delete project2RedBlackKernel;
+	delete mgSmoothKernel; delete mgResidualKernel; delete mgRestrictKernel; delete mgProlongKernel;
+	delete pcgInitKernel; delete pcgApplyKernel; delete pcgUpdateKernel; delete pcgDirectionKernel;
+	delete dotPartialKernel; delete dotFinalKernel; delete residualPartialKernel;
+	delete diffuseTiledKernel;
+	delete project1TiledKernel; delete project2TiledKernel; delete project3TiledKernel;
+	delete jacobiBlockedKernel;
+	delete packVelocityKernel; delete unpackVelocityKernel;
+	delete diffusePackedKernel; delete advectPackedKernel;
+	delete project1PackedKernel; delete project3PackedKernel;
+	delete markBricksKernel; delete listBricksKernel; delete clearBricksKernel;
+	delete diffuseSparseKernel; delete advectSparseKernel;
+	delete project1SparseKernel; delete project2SparseKernel; delete project3SparseKernel;
 }
 
 SequentialSimulation::~SequentialSimulation()
@@ -137,120 +421,413 @@ void Simulation::allocateBuffers(bool all)
 
 	if(all)
 	{
-		u = new float[voxels];
-		v = new float[voxels];
-		w = new float[voxels];
-		dens = new float[voxels];
-
-		memset(u, 0, size);
-		memset(v, 0, size);
-		memset(w, 0, size);
-		memset(dens, 0, size);
+		//Simulations working on the host arrays need them to be the fields
+		placement = fieldsOnHost() ? HOST : opencl->placement;
+		capacity = max(capacity, voxels);
 
-		buf_u = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, u, &opencl.err);
-		buf_v = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, v, &opencl.err);
-		buf_w = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, w, &opencl.err);
-		buf_dens = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, dens, &opencl.err);
+		u = allocateField(&buf_u);
+		v = allocateField(&buf_v);
+		w = allocateField(&buf_w);
+		dens = allocateField(&buf_dens);
 
 		//Image3D: Creating the image object for dens
-		//image_dens = clCreateImage3D((*opencl.context)(), CL_MEM_READ_ONLY|CL_MEM_USE_HOST_PTR, &imageFormat, N+2, N+2, N+2, 0, 0, dens, &opencl.err);
+		//image_dens = clCreateImage3D((*opencl->context)(), CL_MEM_READ_ONLY|CL_MEM_USE_HOST_PTR, &imageFormat, Nx+2, Ny+2, Nz+2, 0, 0, dens, &opencl->err);
 	}
 
 	//Temporary working buffers (non-rendered)
-	u_prev = new float[voxels];
-	v_prev = new float[voxels];
-	w_prev = new float[voxels];
-	dens_prev = new float[voxels];
+	u_prev = allocateField(&buf_u_prev);
+	v_prev = allocateField(&buf_v_prev);
+	w_prev = allocateField(&buf_w_prev);
+	dens_prev = allocateField(&buf_dens_prev);
+	for(int b = 0; b < 4; b++)
+		emptySource[b] = true;
 
-	memset(u_prev, 0, size);
-	memset(v_prev, 0, size);
-	memset(w_prev, 0, size);
-	memset(dens_prev, 0, size);
-
-	buf_u_prev = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, u_prev, &opencl.err);
-	buf_v_prev = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, v_prev, &opencl.err);
-	buf_w_prev = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, w_prev, &opencl.err);
-	buf_dens_prev = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, dens_prev, &opencl.err);
+	allocateSolverBuffers();
 
 	//Image3D objects
 	/*
-	image_dens_prev = clCreateImage3D((*opencl.context)(), CL_MEM_READ_ONLY|CL_MEM_USE_HOST_PTR, &imageFormat, N+2, N+2, N+2, 0, 0, dens_prev, &opencl.err);
-	image_write_dens_prev = clCreateImage3D((*opencl.context)(), CL_MEM_WRITE_ONLY|CL_MEM_USE_HOST_PTR, &imageFormat, N+2, N+2, N+2, 0, 0, dens_prev, &opencl.err);
+	image_dens_prev = clCreateImage3D((*opencl->context)(), CL_MEM_READ_ONLY|CL_MEM_USE_HOST_PTR, &imageFormat, Nx+2, Ny+2, Nz+2, 0, 0, dens_prev, &opencl->err);
+	image_write_dens_prev = clCreateImage3D((*opencl->context)(), CL_MEM_WRITE_ONLY|CL_MEM_USE_HOST_PTR, &imageFormat, Nx+2, Ny+2, Nz+2, 0, 0, dens_prev, &opencl->err);
 	*/
 }
 
+//Interior extents as the kernels take them, the longest side in w
+static cl_int4 makeExtent(int x, int y, int z)
+{
+	cl_int4 n;
+	n.s[0] = x;
+	n.s[1] = y;
+	n.s[2] = z;
+	n.s[3] = max(x, max(y, z));
+	return n;
+}
+
+cl_int4 Simulation::extent()
+{
+	cl_int4 n = makeExtent(Nx, Ny, Nz);
+	n.s[3] = longest();
+	return n;
+}
+
+int Simulation::longest()
+{
+	return max(Nx, max(Ny, max(Nz, zSpan)));
+}
+
+//Bricks along each axis in sparse mode
+cl_int4 Simulation::brickGrid()
+{
+	return makeExtent((Nx + brick - 1) / brick, (Ny + brick - 1) / brick, (Nz + brick - 1) / brick);
+}
+
+//Device-only working buffer of the given number of cells, zeroed
+cl::Buffer* Simulation::newScratch(int cells)
+{
+	if(cl::Buffer* buffer = reuse(cells * sizeof(float)))
+		return buffer;
+	std::vector<float> zero(cells, 0.0f);
+	cl::Buffer* buffer = new cl::Buffer(*opencl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, cells * sizeof(float), &zero[0], &opencl->err);
+	opencl->checkErr("Buffer::Buffer() (solver)");
+	return buffer;
+}
+
+//Like newScratch, but for buffers the kernels treat as fields (store_t, maybe half)
+cl::Buffer* Simulation::newField(int cells)
+{
+	if(cl::Buffer* buffer = reuse(cells * fieldBytes))
+		return buffer;
+	std::vector<char> zero(cells * fieldBytes, 0);
+	cl::Buffer* buffer = new cl::Buffer(*opencl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, cells * fieldBytes, &zero[0], &opencl->err);
+	opencl->checkErr("Buffer::Buffer() (field)");
+	return buffer;
+}
+
+/*
+ * Solver buffers are given back to a pool when they're deallocated, and the
+ * next allocateSolverBuffers takes what it needs from it (zeroed on the
+ * device), so that changing a setting or the extents doesn't go to the
+ * driver. A spare buffer is only taken for at least half its size, the ones
+ * left over are released.
+ */
+cl::Buffer* Simulation::reuse(size_t bytes)
+{
+	auto fit = spare.lower_bound(bytes);
+	if(fit == spare.end() || fit->first > 2 * bytes)
+		return NULL;
+	cl::Buffer* buffer = fit->second;
+	spare.erase(fit);
+	clearBuffer(buffer, bytes);
+	return buffer;
+}
+
+void Simulation::recycle(cl::Buffer*& buffer)
+{
+	if(buffer)
+	{
+		size_t bytes;
+		buffer->getInfo(CL_MEM_SIZE, &bytes);
+		spare.insert(std::make_pair(bytes, buffer));
+	}
+	buffer = NULL;
+}
+
+void Simulation::releaseSpare()
+{
+	for(auto& s : spare)
+		delete s.second;
+	spare.clear();
+}
+
+//Page-aligned host memory, which the runtimes can use in place (zero-copy)
+static float* pageAligned(size_t bytes)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	void* memory = NULL;
+	if(posix_memalign(&memory, page, (bytes + page - 1) / page * page) != 0)
+	{
+		cerr<<"ERROR: posix_memalign() ("<<bytes<<" bytes)"<<endl;
+		exit(EXIT_FAILURE);
+	}
+	memset(memory, 0, bytes);
+	return (float*)memory;
+}
+
+/*
+ * One of the eight fields, with room for capacity voxels (or the given
+ * room), zeroed and placed as the placement says. Returns
+ * its host array, NULL if it has none (device-only and pinned fields are
+ * reached through the buffer), and makes its buffer if there is a backend.
+ */
+float* Simulation::allocateField(cl::Buffer** buffer, int room)
+{
+	if(room == 0)
+		room = capacity;
+	size_t bytes = room * fieldBytes; //half storage holds fp16 bit patterns on the host too
+	float* field = NULL;
+	if(placement == HOST)
+		field = pageAligned(bytes);
+#ifdef CL_VERSION_2_0
+	if(placement == SVM)
+	{
+		field = (float*)clSVMAlloc((*opencl->context)(), CL_MEM_READ_WRITE | (opencl->fineSVM ? CL_MEM_SVM_FINE_GRAIN_BUFFER : 0),
+				bytes, sysconf(_SC_PAGESIZE));
+		opencl->err = field ? CL_SUCCESS : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+		opencl->checkErr("clSVMAlloc()");
+		opencl->err = clEnqueueSVMMap((*opencl->queue)(), CL_TRUE, CL_MAP_WRITE, field, bytes, 0, NULL, NULL);
+		opencl->checkErr("clEnqueueSVMMap()");
+		memset(field, 0, bytes);
+		cl::Event unmapped;
+		opencl->err = clEnqueueSVMUnmap((*opencl->queue)(), field, 0, NULL, &unmapped());
+		opencl->checkErr("clEnqueueSVMUnmap()");
+		unmapped.wait();
+	}
+#endif
+
+	if(!buffer || !opencl) //no buffer wanted, or the native simulation without rendering
+	{
+		if(buffer)
+			*buffer = NULL;
+		return field;
+	}
+
+	if(field) //host memory or SVM, the buffer works on it
+		*buffer = new cl::Buffer(*opencl->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, bytes, field, &opencl->err);
+	else
+	{
+		std::vector<char> zero(bytes, 0);
+		cl_mem_flags flags = CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | (placement == PINNED ? CL_MEM_ALLOC_HOST_PTR : 0);
+		*buffer = new cl::Buffer(*opencl->context, flags, bytes, &zero[0], &opencl->err);
+	}
+	opencl->checkErr("Buffer::Buffer() (field)");
+	return field;
+}
+
+void Simulation::releaseField(float* field, cl::Buffer* buffer)
+{
+	delete buffer;
+#ifdef CL_VERSION_2_0
+	if(placement == SVM)
+	{
+		clSVMFree((*opencl->context)(), field);
+		return;
+	}
+#endif
+	free(field);
+}
+
+/*
+ * Buffers the selected solver needs on top of the fields. For multigrid
+ * that's the level hierarchy, coarsened until the shortest side is 4 cells
+ * or less (every side halves, so the spacing stays the same along each).
+ */
+void Simulation::allocateSolverBuffers()
+{
+	replan = true;
+
+	if(solver == MULTIGRID)
+	{
+		for(cl_int4 n = extent(); ; n = makeExtent((n.s[0] + 1) / 2, (n.s[1] + 1) / 2, (n.s[2] + 1) / 2))
+		{
+			int cells = (n.s[0]+2)*(n.s[1]+2)*(n.s[2]+2);
+			bool fine = mgN.empty();
+			mgN.push_back(n);
+			mgPressure.push_back(fine ? NULL : newField(cells));
+			mgRhs.push_back(fine ? NULL : newField(cells));
+			mgResidual.push_back(newField(cells));
+			if(min(n.s[0], min(n.s[1], n.s[2])) <= 4)
+				break;
+		}
+	}
+
+	if(solver == PCG)
+	{
+		pcgR = newScratch(voxels);
+		pcgZ = newScratch(voxels);
+		pcgD = newScratch(voxels);
+		pcgQ = newScratch(voxels);
+	}
+
+	if(sweepsPerLaunch > 1)
+		for(int b = 0; b < 5; b++)
+			blockScratch[b] = newField(voxels);
+
+	if(packed)
+	{
+		packedVelocity = newScratch(4 * voxels);
+		packedVelocityPrev = newScratch(4 * voxels);
+		packedPressure = newField(voxels);
+		packedDivergence = newField(voxels);
+	}
+
+	//Brick flags and lists, one int per brick
+	if(sparse)
+	{
+		cl_int4 bricks = brickGrid();
+		int count = bricks.s[0] * bricks.s[1] * bricks.s[2];
+		brickFlags = newScratch(count);
+		brickActive[0] = newScratch(count);
+		brickActive[1] = newScratch(count);
+		brickList = newScratch(count);
+		brickRetired = newScratch(count);
+		brickCount = newScratch(3);
+		brickFlip = 0;
+	}
+
+	//Reductions: PCG's dot products and the residual checks
+	if(solver == PCG || tolerance > 0)
+	{
+		partialSums = newScratch((Nx*Ny*Nz + reduceGroup - 1) / reduceGroup);
+		scalars = newScratch(4);
+	}
+
+	releaseSpare();
+}
+
+void Simulation::deallocateSolverBuffers()
+{
+	for(size_t i = 0; i < mgN.size(); i++)
+	{
+		recycle(mgPressure[i]);
+		recycle(mgRhs[i]);
+		recycle(mgResidual[i]);
+	}
+	mgN.clear();
+	mgPressure.clear();
+	mgRhs.clear();
+	mgResidual.clear();
+
+	recycle(pcgR); recycle(pcgZ); recycle(pcgD); recycle(pcgQ);
+	recycle(partialSums); recycle(scalars);
+
+	for(int b = 0; b < 5; b++)
+		recycle(blockScratch[b]);
+
+	recycle(packedVelocity); recycle(packedVelocityPrev);
+	recycle(packedPressure); recycle(packedDivergence);
+
+	recycle(brickFlags); recycle(brickActive[0]); recycle(brickActive[1]);
+	recycle(brickList); recycle(brickRetired); recycle(brickCount);
+}
+
 void Simulation::deallocateBuffers()
 {
-	delete buf_u;
-	delete buf_v;
-	delete buf_w;
-	delete buf_u_prev;
-	delete buf_v_prev;
-	delete buf_w_prev;
-	delete buf_dens;
-	delete buf_dens_prev;
+	deallocateSolverBuffers();
+	releaseSpare();
+
+	releaseField(u, buf_u);
+	releaseField(v, buf_v);
+	releaseField(w, buf_w);
+	releaseField(u_prev, buf_u_prev);
+	releaseField(v_prev, buf_v_prev);
+	releaseField(w_prev, buf_w_prev);
+	releaseField(dens, buf_dens);
+	releaseField(dens_prev, buf_dens_prev);
 
 	//Image3D: release
 	//clReleaseMemObject(image_dens); 
+}
+
+/*
+ * The kernel resampling dens, u, v, w (targets and sources in that order)
+ * from extents n0 to n, with its arguments set. It writes the whole new
+ * volume when launched over it, walls included.
+ */
+cl::Kernel* Simulation::resampler(cl_int4 n, cl_int4 n0, cl::Buffer** targets, cl::Buffer** sources)
+{
+	bool up = n.s[0] >= n0.s[0] && n.s[1] >= n0.s[1] && n.s[2] >= n0.s[2];
+	cl::Kernel* kernel = up ? upsampleKernel : downsampleKernel;
+	kernel->setArg(0, n);
+	kernel->setArg(1, n0);
+	for(int f = 0; f < 4; f++)
+	{
+		kernel->setArg(2 + 2*f, *targets[f]);
+		kernel->setArg(3 + 2*f, *sources[f]);
+	}
+	return kernel;
+}
+
+//Resize latency: how long the host was held up by one
+void Simulation::reportResize(cl_int4 n0, double stalled)
+{
+	cout<<"RESIZE: "<<n0.s[0]<<"x"<<n0.s[1]<<"x"<<n0.s[2]<<" -> "<<Nx<<"x"<<Ny<<"x"<<Nz
+		<<(Nx >= n0.s[0] && Ny >= n0.s[1] && Nz >= n0.s[2] ? " (upsample) " : " (downsample) ")
+		<<stalled * 1000<<" ms"<<endl;
+	if(logging)
+		profileLog<<"resize "<<(long)(stalled * 1e9)<<endl;
+}
 
-	delete[] u;
-	delete[] v;
-	delete[] w;
-	delete[] u_prev;
-	delete[] v_prev;
-	delete[] w_prev;
-	delete[] dens;
-	delete[] dens_prev;
-}
-
-//Resizes the simulation volume to newN
-void Simulation::resize(int newN)
-{
-	int N0 = N;
-	N = newN;
-	voxels = (N+2)*(N+2)*(N+2);
-	size = voxels * sizeof(float);
-
-	//Only dens, u, v, w need to be reallocated
-	float* u_new = new float[voxels];
-	float* v_new = new float[voxels];
-	float* w_new = new float[voxels];
-	float* dens_new = new float[voxels];
-
-	memset(u_new, 0, size);
-	memset(v_new, 0, size);
-	memset(w_new, 0, size);
-	memset(dens_new, 0, size);
-
-	//New buffer objects
-	cl::Buffer* buf_u_new = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, u_new, &opencl.err);
-	cl::Buffer* buf_v_new = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, v_new, &opencl.err);
-	cl::Buffer* buf_w_new = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, w_new, &opencl.err);
-	cl::Buffer* buf_dens_new = new cl::Buffer(*opencl.context, CL_MEM_USE_HOST_PTR, size, dens_new, &opencl.err);
+/*
+ * Resizes the simulation volume to nx x ny x nz. Within the capacity the
+ * fields are resampled into the _prev ones, which then take their place, so
+ * there is nothing to allocate. Beyond it everything is made again, with
+ * half as much room to spare.
+ */
+void Simulation::resize(int nx, int ny, int nz)
+{
+	double start = highResTime();
+	cl_int4 n0 = extent();
+	Nx = nx;
+	Ny = ny;
+	Nz = nz;
+	voxels = (Nx+2)*(Ny+2)*(Nz+2);
+	size = voxels * fieldBytes;
+
+	//Only dens, u, v, w are resampled
+	bool grow = voxels > capacity;
+	cl::Buffer *buf_u_new, *buf_v_new, *buf_w_new, *buf_dens_new;
+	float *u_new, *v_new, *w_new, *dens_new;
+	if(grow)
+	{
+		capacity = voxels + voxels / 2;
+		u_new = allocateField(&buf_u_new);
+		v_new = allocateField(&buf_v_new);
+		w_new = allocateField(&buf_w_new);
+		dens_new = allocateField(&buf_dens_new);
+	}
+	else
+	{
+		u_new = u_prev; buf_u_new = buf_u_prev;
+		v_new = v_prev; buf_v_new = buf_v_prev;
+		w_new = w_prev; buf_w_new = buf_w_prev;
+		dens_new = dens_prev; buf_dens_new = buf_dens_prev;
+	}
 
 	/* Image3D:
 	cl_image_format imageFormat;
 	imageFormat.image_channel_order = CL_R;
 	imageFormat.image_channel_data_type = CL_FLOAT;
-	cl_mem image_dens_new = clCreateImage3D((*opencl.context)(), CL_MEM_READ_ONLY|CL_MEM_USE_HOST_PTR, &imageFormat, N+2, N+2, N+2, 0, 0, dens_new, &opencl.err);
+	cl_mem image_dens_new = clCreateImage3D((*opencl->context)(), CL_MEM_READ_ONLY|CL_MEM_USE_HOST_PTR, &imageFormat, Nx+2, Ny+2, Nz+2, 0, 0, dens_new, &opencl->err);
 	*/
 
 	//Resample whole volume (including bounds)
-	resampleKernel->setArg(0, N + 2);
-	resampleKernel->setArg(1, N0 + 2);
-	resampleKernel->setArg(2, *buf_dens_new);
-	resampleKernel->setArg(3, *buf_dens);
-	resampleKernel->setArg(4, *buf_u_new);
-	resampleKernel->setArg(5, *buf_u);
-	resampleKernel->setArg(6, *buf_v_new);
-	resampleKernel->setArg(7, *buf_v);
-	resampleKernel->setArg(8, *buf_w_new);
-	resampleKernel->setArg(9, *buf_w);
-	opencl.enqueue(*resampleKernel, cl::NullRange, cl::NDRange(min(N,N0) + 2, min(N,N0) + 2, min(N,N0) + 2), cl::NullRange);
-	opencl.wait();
-
-	deallocateBuffers(); //delete all current buffers
-	allocateBuffers(false); //allocate only temporary buffers (_prev)
+	cl::Buffer* targets[] = {buf_dens_new, buf_u_new, buf_v_new, buf_w_new};
+	cl::Buffer* sources[] = {buf_dens, buf_u, buf_v, buf_w};
+	opencl->enqueue(*resampler(extent(), n0, targets, sources), cl::NullRange, cl::NDRange(Nx + 2, Ny + 2, Nz + 2), cl::NullRange);
+	opencl->wait();
+
+	if(grow)
+	{
+		deallocateBuffers(); //delete all current buffers
+		allocateBuffers(false); //allocate only temporary buffers (_prev)
+	}
+	else
+	{
+		//The old fields are the temporaries now
+		u_prev = u; buf_u_prev = buf_u;
+		v_prev = v; buf_v_prev = buf_v;
+		w_prev = w; buf_w_prev = buf_w;
+		dens_prev = dens; buf_dens_prev = buf_dens;
+		clearField(u_prev, buf_u_prev);
+		clearField(v_prev, buf_v_prev);
+		clearField(w_prev, buf_w_prev);
+		clearField(dens_prev, buf_dens_prev);
+		for(int b = 0; b < 4; b++)
+			emptySource[b] = true;
+
+		//Solver buffers come from the pool
+		deallocateSolverBuffers();
+		allocateSolverBuffers();
+	}
 
 	//Assign the non-_prev buffers to resized data
 	u = u_new;
@@ -263,7 +840,171 @@ void Simulation::resize(int newN)
 	buf_dens = buf_dens_new;
 	//image_dens = image_dens_new; //Image3D
 	
-	setKernelArguments(); //N has changed, arguments need to be re-set
+	setKernelArguments(); //The extents have changed, arguments need to be re-set
+	reportResize(n0, highResTime() - start);
+}
+
+void ParallelSimulation::reset()
+{
+	abandon();
+	Simulation::reset();
+}
+
+void ParallelSimulation::resize(int nx, int ny, int nz)
+{
+	abandon();
+	Simulation::resize(nx, ny, nz);
+}
+
+/*
+ * Resizes in the background: the fields at the new extents are resampled
+ * from the current ones on the background queue while the step goes on at
+ * the old extents, and switchOver puts them in place after the next frame.
+ * That frame's writes to the fields wait for the resample, so the fields
+ * switched to hold the state before it. With -specialize the resample waits
+ * for the kernels of the new extents, built on the build thread, so the
+ * switch never has to. Asking again before the switch drops the pending
+ * resize (asking for the current extents only does that).
+ */
+void ParallelSimulation::resizeLater(int nx, int ny, int nz)
+{
+	if(pending.room && pending.n[0] == nx && pending.n[1] == ny && pending.n[2] == nz)
+		return;
+	abandon();
+	if(nx == Nx && ny == Ny && nz == Nz)
+		return;
+	double start = highResTime();
+
+	//Within the capacity the targets are the fields left over from the last
+	//switch, beyond it they're made with half as much room to spare
+	int cells = (nx+2)*(ny+2)*(nz+2);
+	int room = cells > capacity ? cells + cells / 2 : capacity;
+	pending = unused;
+	unused.room = 0;
+	if(pending.room != room)
+	{
+		releaseTargets(pending);
+		for(int f = 0; f < 4; f++)
+			pending.fields[f] = allocateField(&pending.buffers[f], room);
+		pending.room = room;
+	}
+	pending.n[0] = nx;
+	pending.n[1] = ny;
+	pending.n[2] = nz;
+	pending.kernel = NULL;
+	if(specialized)
+		opencl->specializeLater(makeExtent(nx, ny, nz));
+	pending.stalled = highResTime() - start;
+	resampleLater();
+}
+
+//Starts the pending resize's resample, once the kernels it switches to are built
+void ParallelSimulation::resampleLater()
+{
+	cl_int4 n = makeExtent(pending.n[0], pending.n[1], pending.n[2]);
+	if(specialized && !opencl->specializedReady(n))
+		return;
+	double start = highResTime();
+
+	cl::Buffer* sources[] = {buf_dens, buf_u, buf_v, buf_w};
+	pending.n0 = extent();
+	pending.kernel = resampler(n, pending.n0, pending.buffers, sources);
+	opencl->err = opencl->background->enqueueNDRangeKernel(*pending.kernel, cl::NullRange,
+			cl::NDRange(n.s[0] + 2, n.s[1] + 2, n.s[2] + 2), cl::NullRange, NULL, &resampled);
+	opencl->checkErr("CommandQueue::enqueueNDRangeKernel() (resample, background)");
+	opencl->background->flush();
+
+	for(cl::Buffer* source : sources)
+		graph.readElsewhere(source, resampled);
+	pending.stalled += highResTime() - start;
+}
+
+/*
+ * Puts the fields of the pending resize in place, between frames. As in
+ * resize the old fields become the temporaries within the capacity, and the
+ * old temporaries the targets of the next one. Beyond it the temporaries are
+ * made again with the targets' room.
+ */
+bool ParallelSimulation::switchOver()
+{
+	if(!pending.room)
+		return false;
+	if(!pending.kernel)
+	{
+		resampleLater(); //switched to after the next frame
+		return false;
+	}
+	double start = highResTime();
+	resampled.wait(); //done already, the last frame waited for it
+	if(logging)
+		opencl->profile(*pending.kernel, resampled);
+
+	Nx = pending.n[0];
+	Ny = pending.n[1];
+	Nz = pending.n[2];
+	voxels = (Nx+2)*(Ny+2)*(Nz+2);
+	size = voxels * fieldBytes;
+
+	float** fields[] = {&dens, &u, &v, &w};
+	float** temporaries[] = {&dens_prev, &u_prev, &v_prev, &w_prev};
+	cl::Buffer** buffers[] = {&buf_dens, &buf_u, &buf_v, &buf_w};
+	cl::Buffer** temporaryBuffers[] = {&buf_dens_prev, &buf_u_prev, &buf_v_prev, &buf_w_prev};
+	bool grown = pending.room != capacity;
+	if(grown)
+		capacity = pending.room;
+	for(int f = 0; f < 4; f++)
+	{
+		if(grown)
+		{
+			releaseField(*fields[f], *buffers[f]);
+			releaseField(*temporaries[f], *temporaryBuffers[f]);
+			*temporaries[f] = allocateField(temporaryBuffers[f]);
+		}
+		else
+		{
+			unused.fields[f] = *temporaries[f];
+			unused.buffers[f] = *temporaryBuffers[f];
+			*temporaries[f] = *fields[f];
+			*temporaryBuffers[f] = *buffers[f];
+			clearField(*temporaries[f], *temporaryBuffers[f]);
+		}
+		*fields[f] = pending.fields[f];
+		*buffers[f] = pending.buffers[f];
+	}
+	if(!grown)
+		unused.room = capacity;
+	pending.room = 0;
+	for(int b = 0; b < 4; b++)
+		emptySource[b] = true;
+
+	//Solver buffers come from the pool
+	deallocateSolverBuffers();
+	allocateSolverBuffers();
+
+	setKernelArguments();
+	reportResize(pending.n0, pending.stalled + highResTime() - start);
+	return true;
+}
+
+//Drops the pending resize, if any, keeping its fields for the next
+void ParallelSimulation::abandon()
+{
+	if(!pending.room)
+		return;
+	if(pending.kernel)
+		resampled.wait();
+	releaseTargets(unused);
+	unused = pending;
+	pending.room = 0;
+}
+
+void ParallelSimulation::releaseTargets(Targets& targets)
+{
+	if(!targets.room)
+		return;
+	for(int f = 0; f < 4; f++)
+		releaseField(targets.fields[f], targets.buffers[f]);
+	targets.room = 0;
 }
 
 /*
@@ -271,322 +1012,958 @@ void Simulation::resize(int newN)
  */
 void SequentialSimulation::step()
 {
-	opencl.enqueue( *fluidKernel, cl::NullRange, cl::NDRange(1), cl::NullRange);
-	opencl.checkErr("ComamndQueue::enqueueNDRangeKernel() (simulate)");
-	opencl.wait();
+	opencl->enqueue( *fluidKernel, cl::NullRange, cl::NDRange(1), cl::NullRange);
+	opencl->checkErr("ComamndQueue::enqueueNDRangeKernel() (simulate)");
+	opencl->wait();
 
 	// Clear the garbage in dens_prev (it was used as a temp buffer)
-	memset(dens_prev, 0, size);
+	clearField(dens_prev, buf_dens_prev);
 }
 
 /*
- * One parallel simulation step - enacts the simulation pipeline using OpenCL
+ * Pipeline stages of the parallel step, named after the functions of the C
+ * version (fluid.cpp). Each launches its kernels through the event graph
+ * with the buffers they read and write.
  *
- * All the action takes place here.
- *
- * All kernel calls are on an extra indentation under the comments showing their 
- * source lines in the C version. Hope this makes it easier to read.
+ * With fused kernels (the default) the walls are written by the stencil
+ * kernels themselves, otherwise a setBound launch follows each of them.
+ * Tiled kernels always write the walls.
  */
-void ParallelSimulation::step()
+void ParallelSimulation::addSources(std::initializer_list<int> modes)
 {
-	// add_source ( N, u, u0, dt ); add_source ( N, v, v0, dt ); add_source ( N, w, w0, dt );
-		addSourceKernel->setArg(1, *buf_u);
-		addSourceKernel->setArg(2, *buf_u_prev);
-		opencl.enqueue(*addSourceKernel, cl::NullRange, cl::NDRange(voxels / 4), cl::NullRange);
-		opencl.wait();
+	//By setBound mode: density, u, v, w
+	cl::Buffer* fields[] = {buf_dens, buf_u, buf_v, buf_w};
+	cl::Buffer* sources[] = {buf_dens_prev, buf_u_prev, buf_v_prev, buf_w_prev};
+
+	//One launch for all of them, skipping the sources known to be empty
+	int mask = 0;
+	std::vector<cl::Buffer*> reads, writes;
+	for(int b : modes)
+		if(!emptySource[b])
+		{
+			mask |= 1 << b;
+			reads.push_back(sources[b]);
+			writes.push_back(fields[b]);
+		}
+	if(mask == 0)
+		return;
 
-		addSourceKernel->setArg(1, *buf_v);
-		addSourceKernel->setArg(2, *buf_v_prev);
-		opencl.enqueue(*addSourceKernel, cl::NullRange, cl::NDRange(voxels / 4), cl::NullRange);
-		opencl.wait();
+	for(int b = 0; b < 4; b++)
+	{
+		addSourceKernel->setArg(3 + 2*b, *fields[b]);
+		addSourceKernel->setArg(4 + 2*b, *sources[b]);
+	}
+	addSourceKernel->setArg(2, mask);
+	launch(addSourceKernel, cl::NDRange((voxels + 3) / 4), reads, writes);
+}
 
-		addSourceKernel->setArg(1, *buf_w);
-		addSourceKernel->setArg(2, *buf_w_prev);
-		opencl.enqueue(*addSourceKernel, cl::NullRange, cl::NDRange(voxels / 4), cl::NullRange);
-		opencl.wait();
+void ParallelSimulation::setBound(int b, cl::Buffer* x)
+{
+	setBoundKernel->setArg(1, b);
+	setBoundKernel->setArg(2, *x);
+	launch(setBoundKernel, cl::NDRange(longest() + 1, longest() + 1), {}, {x});
+}
 
+//Zeroes a field on the device, walls included
+void ParallelSimulation::clear(cl::Buffer* x)
+{
+	clearKernel->setArg(0, *x);
+	launch(clearKernel, cl::NDRange(voxels), {}, {x});
+}
 
-	//SWAP ( u0, u ); diffuse ( N, 1, u, u0, visc, dt);
-	//SWAP ( v0, v ); diffuse ( N, 2, v, v0, visc, dt);
-	//SWAP ( w0, w ); diffuse ( N, 3, w, w0, visc, dt);
-		diffuseKernel->setArg(1, (float)dt*visc*N*N);
-		diffuseKernel->setArg(2, *buf_u_prev);
-		diffuseKernel->setArg(3, *buf_u);
-		for(int i = 0; i < solverSteps; i++)
-		{
-			opencl.enqueue(*diffuseKernel, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-			opencl.wait();
+/*
+ * Temporally blocked Jacobi solve of c x - a (sum of neighbours) = x0,
+ * launchSweeps sweeps per launch. Launches alternate between x and the
+ * given scratch buffer, with a copy at the end if the result isn't in x.
+ */
+void ParallelSimulation::blockedJacobi(int b, cl::Buffer* x, cl::Buffer* x0, float a, float c, int scratch)
+{
+	cl::Buffer* in = x;
+	cl::Buffer* out = blockScratch[scratch];
+	jacobiBlockedKernel->setArg(1, a);
+	jacobiBlockedKernel->setArg(2, c);
+	jacobiBlockedKernel->setArg(4, *x0);
+	jacobiBlockedKernel->setArg(6, b);
+
+	//Residual checks can only fall between launches
+	int every = launchSweeps * max(1, checkEvery / launchSweeps);
+	for(int done = 0; done < solverSteps; )
+	{
+		int sweeps = min(launchSweeps, solverSteps - done);
+		jacobiBlockedKernel->setArg(3, *in);
+		jacobiBlockedKernel->setArg(5, *out);
+		jacobiBlockedKernel->setArg(7, sweeps);
+		launch(jacobiBlockedKernel, tiledVolume(), {in, x0}, {out}, cl::NDRange(tileX, tileY, tileZ));
+		swap(in, out);
+
+		done += sweeps;
+		if(converged(done, solverSteps, every, a, c, in, x0))
+			break;
+	}
 
-			setBoundKernel->setArg(1, 1);
-			setBoundKernel->setArg(2, *buf_u_prev);
-			opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-			opencl.wait();
-		}
+	if(in != x)
+		copy(in, x, size);
+}
 
-		diffuseKernel->setArg(2, *buf_v_prev);
-		diffuseKernel->setArg(3, *buf_v);
-		for(int i = 0; i < solverSteps; i++)
-		{
-			opencl.enqueue(*diffuseKernel, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-			opencl.wait();
+//Whether this step's stencils run over the active bricks only
+bool ParallelSimulation::sparseStencils()
+{
+	return sparse && !packed && solver == JACOBI && launchSweeps == 1;
+}
 
-			setBoundKernel->setArg(1, 2);
-			setBoundKernel->setArg(2, *buf_v_prev);
-			opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-			opencl.wait();
-		}
+/*
+ * Refreshes the active brick list from the fields after the sources were
+ * added, and clears the bricks that dropped out of it. The list lengths
+ * stay on the device (see fluid.cl), so nothing is read back and the sparse
+ * stencils can be planned like the rest of the step.
+ */
+void ParallelSimulation::findActiveBricks()
+{
+	cl_int4 bricks = brickGrid();
+	cl::NDRange all(bricks.s[0], bricks.s[1], bricks.s[2]);
+	cl::Buffer* active = brickActive[brickFlip];
+	cl::Buffer* wasActive = brickActive[1 - brickFlip];
+	brickFlip = 1 - brickFlip;
+
+	markBricksKernel->setArg(2, *buf_dens);
+	markBricksKernel->setArg(3, *buf_u);
+	markBricksKernel->setArg(4, *buf_v);
+	markBricksKernel->setArg(5, *buf_w);
+	markBricksKernel->setArg(6, *brickFlags);
+	markBricksKernel->setArg(7, *brickCount);
+	launch(markBricksKernel, all, {buf_dens, buf_u, buf_v, buf_w}, {brickFlags, brickCount});
+
+	listBricksKernel->setArg(1, *brickFlags);
+	listBricksKernel->setArg(2, *active);
+	listBricksKernel->setArg(3, *wasActive);
+	listBricksKernel->setArg(4, *brickList);
+	listBricksKernel->setArg(5, *brickRetired);
+	listBricksKernel->setArg(6, *brickCount);
+	launch(listBricksKernel, all, {brickFlags, wasActive}, {active, brickList, brickRetired, brickCount});
+
+	cl::Buffer* fields[] = {buf_dens, buf_u, buf_v, buf_w, buf_dens_prev, buf_u_prev, buf_v_prev, buf_w_prev};
+	clearBricksKernel->setArg(1, *brickRetired);
+	clearBricksKernel->setArg(2, *brickCount);
+	for(int f = 0; f < 8; f++)
+		clearBricksKernel->setArg(3 + f, *fields[f]);
+	std::vector<cl::Buffer*> writes(fields, fields + 8);
+	writes.push_back(brickCount);
+	launch(clearBricksKernel, cl::NDRange(bricks.s[0] * bricks.s[1] * bricks.s[2] * brick * brick * brick), {brickRetired}, writes);
+}
+
+//One work-item per cell of every brick, the kernel's second and third
+//arguments are the list and its length, past which the work-items return
+void ParallelSimulation::launchSparse(PlanKernel* kernel, const std::vector<cl::Buffer*>& reads, const std::vector<cl::Buffer*>& writes)
+{
+	cl_int4 bricks = brickGrid();
+	std::vector<cl::Buffer*> withList(reads);
+	withList.push_back(brickList);
+	withList.push_back(brickCount);
+	kernel->setArg(1, *brickList);
+	kernel->setArg(2, *brickCount);
+	launch(kernel, cl::NDRange(bricks.s[0] * bricks.s[1] * bricks.s[2] * brick * brick * brick), withList, writes);
+}
+
+//Global size of a tiled launch: the volume rounded up to whole bricks
+cl::NDRange ParallelSimulation::tiledVolume()
+{
+	return cl::NDRange((Nx + tileX - 1) / tileX * tileX, (Ny + tileY - 1) / tileY * tileY, (Nz + tileZ - 1) / tileZ * tileZ);
+}
 
-		diffuseKernel->setArg(2, *buf_w_prev);
-		diffuseKernel->setArg(3, *buf_w);
+void ParallelSimulation::diffuse(int b, cl::Buffer* x, cl::Buffer* x0, float diff)
+{
+	float a = dt*diff*longest()*longest();
+	const char* names[] = {"diffuse-dens", "diffuse-u", "diffuse-v", "diffuse-w"};
+	if(solver == SOR)
+	{
+		//A red and a black sweep per step, walls always written in the same launch
+		diffuseRedBlackKernel->setArg(1, a);
+		diffuseRedBlackKernel->setArg(2, *x);
+		diffuseRedBlackKernel->setArg(3, *x0);
+		diffuseRedBlackKernel->setArg(4, b);
+		diffuseRedBlackKernel->setArg(6, relaxation(a));
 		for(int i = 0; i < solverSteps; i++)
 		{
-			opencl.enqueue(*diffuseKernel, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-			opencl.wait();
-
-			setBoundKernel->setArg(1, 3);
-			setBoundKernel->setArg(2, *buf_w_prev);
-			opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-			opencl.wait();
+			for(int parity = 0; parity < 2; parity++)
+			{
+				diffuseRedBlackKernel->setArg(5, parity);
+				launch(diffuseRedBlackKernel, cl::NDRange((Nx + 1) / 2, Ny, Nz), {x0}, {x});
+			}
+			if(converged(i + 1, solverSteps, checkEvery, a, 1 + 6*a, x, x0))
+				break;
 		}
+		report(names[b]);
+		return;
+	}
+
+	if(launchSweeps > 1)
+	{
+		blockedJacobi(b, x, x0, a, 1 + 6*a, b);
+		report(names[b]);
+		return;
+	}
 
-	//project ( N, u, v, w, u0, v0 ); (part 1)
-		projectKernel1->setArg(1, *buf_u_prev); projectKernel2->setArg(1, *buf_u_prev); projectKernel3->setArg(1, *buf_u_prev);
-		projectKernel1->setArg(2, *buf_v_prev); projectKernel2->setArg(2, *buf_v_prev); projectKernel3->setArg(2, *buf_v_prev);
-		projectKernel1->setArg(3, *buf_w_prev); projectKernel2->setArg(3, *buf_w_prev); projectKernel3->setArg(3, *buf_w_prev);
-		projectKernel1->setArg(4, *buf_u); projectKernel2->setArg(4, *buf_u); projectKernel3->setArg(4, *buf_u);
-		projectKernel1->setArg(5, *buf_v); projectKernel2->setArg(5, *buf_v); projectKernel3->setArg(5, *buf_v);
-		opencl.enqueue(*projectKernel1, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-		opencl.wait();
-
-		//setBoundSeq (N, 0, div ); setBoundSeq (N, 0, p );
-		setBoundKernel->setArg(1, 0);
-		setBoundKernel->setArg(2, *buf_u);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		setBoundKernel->setArg(2, *buf_v);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-
-	//project ( N, u, v, w, u0, v0 ); (part 2)
+	if(sparseStencils())
+	{
+		diffuseSparseKernel->setArg(3, a);
+		diffuseSparseKernel->setArg(4, *x);
+		diffuseSparseKernel->setArg(5, *x0);
+		diffuseSparseKernel->setArg(6, b);
 		for(int i = 0; i < solverSteps; i++)
 		{
-			opencl.enqueue(*projectKernel2, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-			opencl.wait();
-
-			setBoundKernel->setArg(1, 0);
-			setBoundKernel->setArg(2, *buf_u);
-			opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-			opencl.wait();
+			launchSparse(diffuseSparseKernel, {x0}, {x});
+			if(converged(i + 1, solverSteps, checkEvery, a, 1 + 6*a, x, x0))
+				break;
 		}
-		
-	//project ( N, u, v, w, u0, v0 ); (part 3)
-		opencl.enqueue(*projectKernel3, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-		opencl.wait();
-	
-		//setBoundSeq (N, 1, u ); setBoundSeq (N, 2, v ); setBoundSeq (N, 3, w );
-		setBoundKernel->setArg(1, 1);
-		setBoundKernel->setArg(2, *buf_u_prev);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		setBoundKernel->setArg(1, 2);
-		setBoundKernel->setArg(2, *buf_v_prev);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		setBoundKernel->setArg(1, 3);
-		setBoundKernel->setArg(2, *buf_w_prev);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		opencl.wait();
+		report(names[b]);
+		return;
+	}
 
-	//advect ( N, 1, u, u0, u0, v0, w0, dt );
-	//advect ( N, 2, v, v0, u0, v0, w0, dt );
-	//advect ( N, 3, w, w0, u0, v0, w0, dt );
-		advectKernel->setArg(1, 1);
-		advectKernel->setArg(2, *buf_u);
-		advectKernel->setArg(3, *buf_u_prev);
-		advectKernel->setArg(4, *buf_u_prev);
-		advectKernel->setArg(5, *buf_v_prev);
-		advectKernel->setArg(6, *buf_w_prev);
-		opencl.enqueue(*advectKernel, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-		opencl.wait();
-		setBoundKernel->setArg(1, 1);
-		setBoundKernel->setArg(2, *buf_u);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		opencl.wait();
-
-		advectKernel->setArg(1, 2);
-		advectKernel->setArg(2, *buf_v);
-		advectKernel->setArg(3, *buf_v_prev);
-		opencl.enqueue(*advectKernel, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-		opencl.wait();
-		setBoundKernel->setArg(1, 2);
-		setBoundKernel->setArg(2, *buf_v);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		opencl.wait();
-
-		advectKernel->setArg(1, 3);
-		advectKernel->setArg(2, *buf_w);
-		advectKernel->setArg(3, *buf_w_prev);
-		opencl.enqueue(*advectKernel, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-		opencl.wait();
-		setBoundKernel->setArg(1, 3);
-		setBoundKernel->setArg(2, *buf_w);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		opencl.wait();
-
-	//project ( N, u, v, w, u0, v0 ); (part 1)
-		projectKernel1->setArg(1, *buf_u); projectKernel2->setArg(1, *buf_u); projectKernel3->setArg(1, *buf_u);
-		projectKernel1->setArg(2, *buf_v); projectKernel2->setArg(2, *buf_v); projectKernel3->setArg(2, *buf_v);
-		projectKernel1->setArg(3, *buf_w); projectKernel2->setArg(3, *buf_w); projectKernel3->setArg(3, *buf_w);
-		projectKernel1->setArg(4, *buf_u_prev); projectKernel2->setArg(4, *buf_u_prev); projectKernel3->setArg(4, *buf_u_prev);
-		projectKernel1->setArg(5, *buf_v_prev); projectKernel2->setArg(5, *buf_v_prev); projectKernel3->setArg(5, *buf_v_prev);
-		opencl.enqueue(*projectKernel1, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-		opencl.wait();
-
-		//setBoundSeq (N, 0, div ); setBoundSeq (N, 0, p );
-		setBoundKernel->setArg(1, 0);
-		setBoundKernel->setArg(2, *buf_u_prev);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		setBoundKernel->setArg(2, *buf_v_prev);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-
-	//project ( N, u, v, w, u0, v0 ); (part 2)
-		for(int i = 0; i < solverSteps; i++)
+	bool walls = fused || tiled;
+	PlanKernel* kernel = tiled ? diffuseTiledKernel : fused ? diffuseBoundKernel : diffuseKernel;
+	cl::NDRange global = tiled ? tiledVolume() : cl::NDRange(Nx, Ny, Nz);
+	cl::NDRange local = tiled ? cl::NDRange(tileX, tileY, tileZ) : cl::NullRange;
+	kernel->setArg(1, a);
+	kernel->setArg(2, *x);
+	kernel->setArg(3, *x0);
+	if(walls)
+		kernel->setArg(4, b);
+
+	//Image3D: diffuse_image3d (fluid.cl) would be launched here instead
+	for(int i = 0; i < solverSteps; i++)
+	{
+		launch(kernel, global, {x0}, {x}, local);
+		if(!walls)
+			setBound(b, x);
+		if(converged(i + 1, solverSteps, checkEvery, a, 1 + 6*a, x, x0))
+			break;
+	}
+	report(names[b]);
+}
+
+void ParallelSimulation::project(cl::Buffer* u, cl::Buffer* v, cl::Buffer* w, cl::Buffer* p, cl::Buffer* div)
+{
+	bool walls = fused || tiled;
+	PlanKernel* kernel1 = tiled ? project1TiledKernel : fused ? project1BoundKernel : projectKernel1;
+	PlanKernel* kernel3 = tiled ? project3TiledKernel : fused ? project3BoundKernel : projectKernel3;
+	kernel1->setArg(1, *u); kernel3->setArg(1, *u);
+	kernel1->setArg(2, *v); kernel3->setArg(2, *v);
+	kernel1->setArg(3, *w); kernel3->setArg(3, *w);
+	kernel1->setArg(4, *p); kernel3->setArg(4, *p);
+	kernel1->setArg(5, *div); kernel3->setArg(5, *div);
+	cl::NDRange volume = tiled ? tiledVolume() : cl::NDRange(Nx, Ny, Nz);
+	cl::NDRange local = tiled ? cl::NDRange(tileX, tileY, tileZ) : cl::NullRange;
+
+	if(sparseStencils())
+	{
+		project1SparseKernel->setArg(3, *u);
+		project1SparseKernel->setArg(4, *v);
+		project1SparseKernel->setArg(5, *w);
+		project1SparseKernel->setArg(6, *p);
+		project1SparseKernel->setArg(7, *div);
+		launchSparse(project1SparseKernel, {u, v, w}, {p, div});
+		solvePressure(p, div);
+		project3SparseKernel->setArg(3, *u);
+		project3SparseKernel->setArg(4, *v);
+		project3SparseKernel->setArg(5, *w);
+		project3SparseKernel->setArg(6, *p);
+		launchSparse(project3SparseKernel, {p}, {u, v, w});
+		return;
+	}
+
+	//(part 1)
+		launch(kernel1, volume, {u, v, w}, {p, div}, local);
+		if(!walls)
 		{
-			opencl.enqueue(*projectKernel2, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-			opencl.wait();
+			//setBoundSeq (N, 0, div ); setBoundSeq (N, 0, p );
+			setBound(0, div);
+			setBound(0, p);
+		}
 
-			setBoundKernel->setArg(1, 0);
-			setBoundKernel->setArg(2, *buf_u_prev);
-			opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-			opencl.wait();
+	//(part 2)
+		solvePressure(p, div);
+
+	//(part 3)
+		launch(kernel3, volume, {p}, {u, v, w}, local);
+		if(!walls)
+		{
+			//setBoundSeq (N, 1, u ); setBoundSeq (N, 2, v ); setBoundSeq (N, 3, w );
+			setBound(1, u);
+			setBound(2, v);
+			setBound(3, w);
 		}
+}
 
-	//project ( N, u, v, w, u0, v0 ); (part 3)
-		opencl.enqueue(*projectKernel3, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-		opencl.wait();
-
-		//setBoundSeq (N, 1, u ); setBoundSeq (N, 2, v ); setBoundSeq (N, 3, w );
-		setBoundKernel->setArg(1, 1);
-		setBoundKernel->setArg(2, *buf_u);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		setBoundKernel->setArg(1, 2);
-		setBoundKernel->setArg(2, *buf_v);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		setBoundKernel->setArg(1, 3);
-		setBoundKernel->setArg(2, *buf_w);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		opencl.wait();
+//Part 2 of project - solves for the pressure p given the divergence
+void ParallelSimulation::solvePressure(cl::Buffer* p, cl::Buffer* div)
+{
+	bool walls = fused || tiled;
+	PlanKernel* kernel2 = tiled ? project2TiledKernel : fused ? project2BoundKernel : projectKernel2;
+	cl::NDRange volume = tiled ? tiledVolume() : cl::NDRange(Nx, Ny, Nz);
+	cl::NDRange local = tiled ? cl::NDRange(tileX, tileY, tileZ) : cl::NullRange;
 
-//dens_step:
-	//add_source ( N, x, x0, dt );
-		addSourceKernel->setArg(1, *buf_dens);
-		addSourceKernel->setArg(2, *buf_dens_prev);
-		opencl.enqueue(*addSourceKernel, cl::NullRange, cl::NDRange(voxels / 4), cl::NullRange);
-		opencl.wait();
+	//u, v and w are arguments of the project2 kernels but aren't used
+	for(int arg = 1; arg <= 3; arg++)
+	{
+		kernel2->setArg(arg, *p);
+		project2RedBlackKernel->setArg(arg, *p);
+	}
+	kernel2->setArg(4, *p);
+	kernel2->setArg(5, *div);
 
-	//Image3D:
-	//SWAP ( x0,x ); diffuse ( N, 0, x, x0, diff, dt );
-	/*
-		diffuseKernelImage3D->setArg(1, (float)dt*diff*N*N);
-		diffuseKernelImage3D->setArg(2, image_dens_prev);
-		diffuseKernelImage3D->setArg(3, image_dens);
-		diffuseKernelImage3D->setArg(4, image_write_dens_prev);
-		for(int i = 0; i < solverSteps; i++)
+		if(solver == SOR)
 		{
-			opencl.enqueue(*diffuseKernelImage3D, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-			opencl.wait();
-
-			//set_bnd ( N, b = 0, x );
-			setBoundKernel->setArg(1, 0);
-			setBoundKernel->setArg(2, *buf_dens_prev);
-			opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-			opencl.wait();
+			project2RedBlackKernel->setArg(4, *p);
+			project2RedBlackKernel->setArg(5, *div);
+			project2RedBlackKernel->setArg(7, relaxation(0));
+			for(int i = 0; i < solverSteps; i++)
+			{
+				for(int parity = 0; parity < 2; parity++)
+				{
+					project2RedBlackKernel->setArg(6, parity);
+					launch(project2RedBlackKernel, cl::NDRange((Nx + 1) / 2, Ny, Nz), {div}, {p});
+				}
+				if(converged(i + 1, solverSteps, checkEvery, 1, 6, p, div))
+					break;
+			}
 		}
-		opencl.wait();
-	*/
-
-		diffuseKernel->setArg(1, (float)dt*diff*N*N);
-		diffuseKernel->setArg(2, *buf_dens_prev);
-		diffuseKernel->setArg(3, *buf_dens);
-		for(int i = 0; i < solverSteps; i++)
+		else if(solver == MULTIGRID)
+			multigrid(p, div);
+		else if(solver == PCG)
+			conjugateGradient(p, div);
+		else if(launchSweeps > 1)
+			blockedJacobi(0, p, div, 1, 6, pressureScratch);
+		else if(sparseStencils())
 		{
-			opencl.enqueue(*diffuseKernel, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
+			project2SparseKernel->setArg(3, *p);
+			project2SparseKernel->setArg(4, *div);
+			for(int i = 0; i < solverSteps; i++)
+			{
+				launchSparse(project2SparseKernel, {div}, {p});
+				if(converged(i + 1, solverSteps, checkEvery, 1, 6, p, div))
+					break;
+			}
+		}
+		else for(int i = 0; i < solverSteps; i++)
+		{
+			launch(kernel2, volume, {div}, {p}, local);
+			if(!walls)
+				setBound(0, p);
+			if(converged(i + 1, solverSteps, checkEvery, 1, 6, p, div))
+				break;
+		}
+		report("project");
+}
+
+/*
+ * Packed velocity stages: diffuse, project and advect u, v and w together
+ * in the float4 fields. The pressure solve is the same as for project.
+ */
+void ParallelSimulation::diffusePacked(cl::Buffer* x, cl::Buffer* x0)
+{
+	diffusePackedKernel->setArg(1, dt*visc*longest()*longest());
+	diffusePackedKernel->setArg(2, *x);
+	diffusePackedKernel->setArg(3, *x0);
+	for(int i = 0; i < solverSteps; i++)
+		launch(diffusePackedKernel, cl::NDRange(Nx, Ny, Nz), {x0}, {x});
+}
+
+void ParallelSimulation::projectPacked(cl::Buffer* velocity)
+{
+	project1PackedKernel->setArg(1, *velocity);
+	project1PackedKernel->setArg(2, *packedPressure);
+	project1PackedKernel->setArg(3, *packedDivergence);
+	launch(project1PackedKernel, cl::NDRange(Nx, Ny, Nz), {velocity}, {packedPressure, packedDivergence});
+
+	solvePressure(packedPressure, packedDivergence);
+
+	project3PackedKernel->setArg(1, *velocity);
+	project3PackedKernel->setArg(2, *packedPressure);
+	launch(project3PackedKernel, cl::NDRange(Nx, Ny, Nz), {packedPressure}, {velocity});
+}
+
+void ParallelSimulation::advectPacked(cl::Buffer* d, cl::Buffer* d0)
+{
+	advectPackedKernel->setArg(1, *d);
+	advectPackedKernel->setArg(2, *d0);
+	advectPackedKernel->setArg(3, *d0);
+	launch(advectPackedKernel, cl::NDRange(Nx, Ny, Nz), {d0}, {d});
+}
+
+/*
+ * Multigrid pressure solve - V-cycles over the hierarchy in mgN.
+ *
+ * A V-cycle costs about as much as 8 Jacobi sweeps on the fine grid, so
+ * solverSteps / 8 of them keep the tuner's precision parameter meaningful.
+ */
+void ParallelSimulation::multigrid(cl::Buffer* p, cl::Buffer* div)
+{
+	int cycles = (solverSteps + 7) / 8;
+	for(int i = 0; i < cycles; i++)
+	{
+		vCycle(0, p, div);
+		if(converged(i + 1, cycles, 1, 1, 6, p, div)) //checked after every cycle
+			break;
+	}
+}
+
+//Solves Ae = r on one level, using the coarser ones for the smooth error
+void ParallelSimulation::vCycle(int level, cl::Buffer* e, cl::Buffer* r)
+{
+	cl_int4 n = mgN[level];
+
+	//Coarsest level: few enough cells for smoothing alone
+	if(level == (int)mgN.size() - 1)
+	{
+		smooth(level, e, r, 10);
+		return;
+	}
+
+	//Pre-smoothing
+	smooth(level, e, r, 2);
+
+	//Residual, restricted to the next level
+	cl::Buffer* res = mgResidual[level];
+	mgResidualKernel->setArg(0, n);
+	mgResidualKernel->setArg(1, *e);
+	mgResidualKernel->setArg(2, *r);
+	mgResidualKernel->setArg(3, *res);
+	launch(mgResidualKernel, cl::NDRange(n.s[0], n.s[1], n.s[2]), {e, r}, {res});
+
+	cl_int4 nc = mgN[level + 1];
+	cl::Buffer* ec = mgPressure[level + 1];
+	cl::Buffer* rc = mgRhs[level + 1];
+	mgRestrictKernel->setArg(0, nc);
+	mgRestrictKernel->setArg(1, n);
+	mgRestrictKernel->setArg(2, *res);
+	mgRestrictKernel->setArg(3, *rc);
+	mgRestrictKernel->setArg(4, *ec);
+	launch(mgRestrictKernel, cl::NDRange(nc.s[0], nc.s[1], nc.s[2]), {res}, {rc, ec});
+
+	//Coarse correction
+	vCycle(level + 1, ec, rc);
+
+	mgProlongKernel->setArg(0, n);
+	mgProlongKernel->setArg(1, nc);
+	mgProlongKernel->setArg(2, *e);
+	mgProlongKernel->setArg(3, *ec);
+	launch(mgProlongKernel, cl::NDRange(n.s[0], n.s[1], n.s[2]), {ec}, {e});
+
+	//Post-smoothing
+	smooth(level, e, r, 2);
+}
 
-			//set_bnd ( N, b = 0, x );
-			setBoundKernel->setArg(1, 0);
-			setBoundKernel->setArg(2, *buf_dens_prev);
-			opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-			opencl.wait();
+//Red-black Gauss-Seidel sweeps on one level
+void ParallelSimulation::smooth(int level, cl::Buffer* e, cl::Buffer* r, int sweeps)
+{
+	cl_int4 n = mgN[level];
+	mgSmoothKernel->setArg(0, n);
+	mgSmoothKernel->setArg(1, *e);
+	mgSmoothKernel->setArg(2, *r);
+	for(int i = 0; i < sweeps; i++)
+		for(int parity = 0; parity < 2; parity++)
+		{
+			mgSmoothKernel->setArg(3, parity);
+			launch(mgSmoothKernel, cl::NDRange((n.s[0] + 1) / 2, n.s[1], n.s[2]), {r}, {e});
 		}
-		opencl.wait();
-	
+}
+
+/*
+ * Preconditioned conjugate gradient pressure solve, solverSteps iterations.
+ *
+ * r.z alternates between scalars[0] and [1] (old and new value of the
+ * iteration), d.q is kept in scalars[2]. The kernels read them straight
+ * from the buffer, the host never sees them.
+ */
+void ParallelSimulation::conjugateGradient(cl::Buffer* p, cl::Buffer* div)
+{
+	cl::NDRange volume(Nx, Ny, Nz);
+	const int dq = 2;
+
+	pcgInitKernel->setArg(0, extent());
+	pcgInitKernel->setArg(1, *p);
+	pcgInitKernel->setArg(2, *div);
+	pcgInitKernel->setArg(3, *pcgR);
+	pcgInitKernel->setArg(4, *pcgZ);
+	pcgInitKernel->setArg(5, *pcgD);
+	launch(pcgInitKernel, volume, {p, div}, {pcgR, pcgZ, pcgD});
+	dot(pcgR, pcgZ, 0);
+
+	pcgApplyKernel->setArg(0, extent());
+	pcgApplyKernel->setArg(1, *pcgD);
+	pcgApplyKernel->setArg(2, *pcgQ);
+
+	pcgUpdateKernel->setArg(0, extent());
+	pcgUpdateKernel->setArg(1, *p);
+	pcgUpdateKernel->setArg(2, *pcgR);
+	pcgUpdateKernel->setArg(3, *pcgZ);
+	pcgUpdateKernel->setArg(4, *pcgD);
+	pcgUpdateKernel->setArg(5, *pcgQ);
+	pcgUpdateKernel->setArg(6, *scalars);
+	pcgUpdateKernel->setArg(8, dq);
+
+	pcgDirectionKernel->setArg(0, extent());
+	pcgDirectionKernel->setArg(1, *pcgZ);
+	pcgDirectionKernel->setArg(2, *pcgD);
+	pcgDirectionKernel->setArg(3, *scalars);
+
+	for(int i = 0; i < solverSteps; i++)
+	{
+		int rzOld = i % 2, rzNew = 1 - rzOld;
+
+		//q = Ad, alpha = r.z / d.q
+		launch(pcgApplyKernel, volume, {pcgD}, {pcgQ});
+		dot(pcgD, pcgQ, dq);
+
+		//Step along d, precondition the new residual
+		pcgUpdateKernel->setArg(7, rzOld);
+		launch(pcgUpdateKernel, volume, {pcgD, pcgQ, scalars}, {p, pcgR, pcgZ});
+		dot(pcgR, pcgZ, rzNew);
+
+		//Next search direction
+		pcgDirectionKernel->setArg(4, rzNew);
+		pcgDirectionKernel->setArg(5, rzOld);
+		launch(pcgDirectionKernel, volume, {pcgZ, scalars}, {pcgD});
+
+		if(converged(i + 1, solverSteps, checkEvery, 1, 6, p, div))
+			break;
+	}
+}
+
+//a.b over the interior into scalars[slot], as a two stage reduction on the device
+void ParallelSimulation::dot(cl::Buffer* a, cl::Buffer* b, int slot)
+{
+	int groups = (Nx*Ny*Nz + reduceGroup - 1) / reduceGroup;
+
+	dotPartialKernel->setArg(0, extent());
+	dotPartialKernel->setArg(1, *a);
+	dotPartialKernel->setArg(2, *b);
+	dotPartialKernel->setArg(3, *partialSums);
+	dotPartialKernel->setArg(4, reduceGroup * sizeof(float), NULL);
+	launch(dotPartialKernel, cl::NDRange(groups * reduceGroup), {a, b}, {partialSums}, cl::NDRange(reduceGroup));
+
+	reduce(groups, slot);
+}
+
+//Second stage of a device reduction: partialSums into scalars[slot]
+void ParallelSimulation::reduce(int groups, int slot)
+{
+	dotFinalKernel->setArg(0, groups);
+	dotFinalKernel->setArg(1, *partialSums);
+	dotFinalKernel->setArg(2, *scalars);
+	dotFinalKernel->setArg(3, slot);
+	dotFinalKernel->setArg(4, reduceGroup * sizeof(float), NULL);
+	launch(dotFinalKernel, cl::NDRange(reduceGroup), {partialSums}, {scalars}, cl::NDRange(reduceGroup));
+}
+
+/*
+ * Early termination check, after every `every` iterations and the last one.
+ * The RMS residual of c x - a (sum of neighbours) = x0 is reduced on the
+ * device and only that one value is read back. Without a tolerance this
+ * returns straight away, so there is no extra host sync.
+ */
+bool ParallelSimulation::converged(int done, int total, int every, float a, float c, cl::Buffer* x, cl::Buffer* x0)
+{
+	lastIterations = done;
+	if(tolerance <= 0 || (done % every != 0 && done != total))
+		return false;
+
+	int groups = (Nx*Ny*Nz + reduceGroup - 1) / reduceGroup;
+	residualPartialKernel->setArg(0, extent());
+	residualPartialKernel->setArg(1, a);
+	residualPartialKernel->setArg(2, c);
+	residualPartialKernel->setArg(3, *x);
+	residualPartialKernel->setArg(4, *x0);
+	residualPartialKernel->setArg(5, *partialSums);
+	residualPartialKernel->setArg(6, reduceGroup * sizeof(float), NULL);
+	launch(residualPartialKernel, cl::NDRange(groups * reduceGroup), {x, x0}, {partialSums}, cl::NDRange(reduceGroup));
+	reduce(groups, 3);
+
+	float sum;
+	graph.read(scalars, 3 * sizeof(float), sizeof(float), &sum);
+	lastResidual = sqrt(sum / (Nx*Ny*Nz));
+	return lastResidual < tolerance;
+}
+
+//Adds the last solve to this frame's line in solver.log
+void ParallelSimulation::report(const char* name)
+{
+	if(tolerance > 0)
+		solveReport<<name<<" "<<lastIterations<<" "<<lastResidual<<" ";
+}
+
+void ParallelSimulation::advect(int b, cl::Buffer* d, cl::Buffer* d0, cl::Buffer* u, cl::Buffer* v, cl::Buffer* w)
+{
+	if(sparseStencils())
+	{
+		advectSparseKernel->setArg(3, b);
+		advectSparseKernel->setArg(4, *d);
+		advectSparseKernel->setArg(5, *d0);
+		advectSparseKernel->setArg(6, *u);
+		advectSparseKernel->setArg(7, *v);
+		advectSparseKernel->setArg(8, *w);
+		launchSparse(advectSparseKernel, {d0, u, v, w}, {d});
+		return;
+	}
+
+	PlanKernel* kernel = fused ? advectBoundKernel : advectKernel;
+	kernel->setArg(1, b);
+	kernel->setArg(2, *d);
+	kernel->setArg(3, *d0);
+	kernel->setArg(4, *u);
+	kernel->setArg(5, *v);
+	kernel->setArg(6, *w);
+	launch(kernel, cl::NDRange(Nx, Ny, Nz), {d0, u, v, w}, {d});
+
+	// set_bnd ( N, b, d );
+	if(!fused)
+		setBound(b, d);
+}
+
+//vel_step on the packed velocity: one field through every stage instead of three
+void ParallelSimulation::packedVelocityStep()
+{
+	//add_source for u, v, w while packing them
+	packVelocityKernel->setArg(1, *buf_u);
+	packVelocityKernel->setArg(2, *buf_v);
+	packVelocityKernel->setArg(3, *buf_w);
+	packVelocityKernel->setArg(4, *buf_u_prev);
+	packVelocityKernel->setArg(5, *buf_v_prev);
+	packVelocityKernel->setArg(6, *buf_w_prev);
+	packVelocityKernel->setArg(7, *packedVelocity);
+	launch(packVelocityKernel, cl::NDRange(voxels), {buf_u, buf_v, buf_w, buf_u_prev, buf_v_prev, buf_w_prev},
+			{packedVelocity});
+
+	diffusePacked(packedVelocityPrev, packedVelocity);
+	projectPacked(packedVelocityPrev);
+	advectPacked(packedVelocity, packedVelocityPrev);
+	projectPacked(packedVelocity);
+
+	unpackVelocityKernel->setArg(0, *packedVelocity);
+	unpackVelocityKernel->setArg(1, *buf_u);
+	unpackVelocityKernel->setArg(2, *buf_v);
+	unpackVelocityKernel->setArg(3, *buf_w);
+	unpackVelocityKernel->setArg(4, *packedVelocityPrev);
+	unpackVelocityKernel->setArg(5, *packedPressure);
+	unpackVelocityKernel->setArg(6, *packedDivergence);
+	unpackVelocityKernel->setArg(7, *buf_u_prev);
+	unpackVelocityKernel->setArg(8, *buf_v_prev);
+	unpackVelocityKernel->setArg(9, *buf_w_prev);
+	launch(unpackVelocityKernel, cl::NDRange(voxels), {packedVelocity, packedVelocityPrev, packedPressure, packedDivergence},
+			{buf_u, buf_v, buf_w, buf_u_prev, buf_v_prev, buf_w_prev});
+}
+
+/*
+ * One parallel simulation step - enacts the simulation pipeline using OpenCL
+ *
+ * All the action takes place here.
+ *
+ * The calls are on an extra indentation under the comments showing their 
+ * source lines in the C version. Hope this makes it easier to read.
+ *
+ * Kernels go through the event graph with the buffers they read and write,
+ * so nothing waits on the host until graph.finish() at the end.
+ */
+void ParallelSimulation::step()
+{
+	// add_source ( N, u, u0, dt ); add_source ( N, v, v0, dt ); add_source ( N, w, w0, dt );
+	// add_source ( N, x, x0, dt ); (of dens_step, batched in here)
+	//The packed step adds the velocity sources while packing
+		if(packed)
+			addSources({0});
+		else
+			addSources({0, 1, 2, 3});
+
+	//Sparse mode: the bricks to simulate this frame
+		if(sparseStencils())
+			findActiveBricks();
+
+	//The rest is the same launches every frame, unless the solver, the
+	//buffers or the number of solver steps changed since it was recorded
+	if(!planned())
+		stages();
+	else if(replan || !plan.recorded(solverSteps))
+	{
+		plan.record(solverSteps);
+		stages();
+		plan.stop();
+		replan = false;
+	}
+	else
+		plan.replay(graph);
+
+	//The one host sync of the frame (besides residual checks, if enabled)
+	graph.finish();
+
+	if(tolerance > 0 && logging)
+		solverLog<<solveReport.str()<<endl;
+	solveReport.str("");
+
+	//u0, v0, w0 were temporaries (in the packed step too)
+	emptySource[0] = true;
+	for(int b = 1; b < 4; b++)
+		emptySource[b] = false;
+}
+
+/*
+ * Whether the step can be planned: not when it depends on values read back
+ * in the middle of it (the residual checks). Sparse steps are, the active
+ * bricks are found before the planned part and the launches over them are
+ * sized by the brick grid, not by the list.
+ */
+bool ParallelSimulation::planned()
+{
+	return tolerance <= 0;
+}
+
+//The step after the sources
+void ParallelSimulation::stages()
+{
+//vel_step:
+	if(packed)
+		packedVelocityStep();
+	else
+	{
+	//SWAP ( u0, u ); diffuse ( N, 1, u, u0, visc, dt);
+	//SWAP ( v0, v ); diffuse ( N, 2, v, v0, visc, dt);
+	//SWAP ( w0, w ); diffuse ( N, 3, w, w0, visc, dt);
+		diffuse(1, buf_u_prev, buf_u, visc);
+		diffuse(2, buf_v_prev, buf_v, visc);
+		diffuse(3, buf_w_prev, buf_w, visc);
+
+	//project ( N, u, v, w, u0, v0 );
+		project(buf_u_prev, buf_v_prev, buf_w_prev, buf_u, buf_v);
+
+	//SWAP ( u0, u ); SWAP ( v0, v ); SWAP ( w0, w );
+	//advect ( N, 1, u, u0, u0, v0, w0, dt );
+	//advect ( N, 2, v, v0, u0, v0, w0, dt );
+	//advect ( N, 3, w, w0, u0, v0, w0, dt );
+		advect(1, buf_u, buf_u_prev, buf_u_prev, buf_v_prev, buf_w_prev);
+		advect(2, buf_v, buf_v_prev, buf_u_prev, buf_v_prev, buf_w_prev);
+		advect(3, buf_w, buf_w_prev, buf_u_prev, buf_v_prev, buf_w_prev);
+
+	//project ( N, u, v, w, u0, v0 );
+		project(buf_u, buf_v, buf_w, buf_u_prev, buf_v_prev);
+	}
+
+//dens_step:
+	//SWAP ( x0,x ); diffuse ( N, 0, x, x0, diff, dt );
+	//The density chain only depends on the velocity at the advection, so the
+	//event graph can overlap this diffusion with the velocity step above
+		diffuse(0, buf_dens_prev, buf_dens, diff);
 
 	// SWAP ( x0,x ); advect ( N, 0, x, x0, u, v, w, dt );
-		advectKernel->setArg(0, N);
-		advectKernel->setArg(1, 0);
-		advectKernel->setArg(2, *buf_dens);
-		advectKernel->setArg(3, *buf_dens_prev);
-		advectKernel->setArg(4, *buf_u);
-		advectKernel->setArg(5, *buf_v);
-		advectKernel->setArg(6, *buf_w);
-		opencl.enqueue(*advectKernel, cl::NullRange, cl::NDRange(N, N, N), cl::NullRange);
-		opencl.wait();
-
-		// set_bnd ( N, b, d );
-		setBoundKernel->setArg(1, 0);
-		setBoundKernel->setArg(2, *buf_dens);
-		opencl.enqueue(*setBoundKernel, cl::NullRange, cl::NDRange(N + 1, N + 1), cl::NullRange);
-		opencl.wait();
+		advect(0, buf_dens, buf_dens_prev, buf_u, buf_v, buf_w);
 
 	// Clear the garbage in dens_prev (it was used as a temp buffer)
-	memset(dens_prev, 0, size);
+		clear(buf_dens_prev);
+}
+
+//Launches through the event graph, and into the plan when one is being recorded
+void ParallelSimulation::launch(PlanKernel* kernel, const cl::NDRange& global,
+		const std::vector<cl::Buffer*>& reads, const std::vector<cl::Buffer*>& writes,
+		const cl::NDRange& local)
+{
+	graph.launch(*kernel, global, reads, writes, local);
+	plan.launch(*kernel, global, local, reads, writes);
+}
+
+void ParallelSimulation::copy(cl::Buffer* source, cl::Buffer* destination, size_t size)
+{
+	graph.copy(source, destination, size);
+	plan.copy(source, destination, size);
 }
 
 //3d -> 1d indexer into the volume, used for setting data and debugging
 inline int Simulation::ix(int i, int j, int l)
 {
-	return ((i)+(N+2)*(j)+(N+2)*(N+2)*l);
+	return ((i)+(Nx+2)*(j)+(Nx+2)*(Ny+2)*l);
+}
+
+/*
+ * Host access to a field cell. With half storage the host arrays hold
+ * fp16 bit patterns in their first half, which is what the buffers map.
+ * Rounded to nearest even, with denormals, as vstore_half does on the device.
+ */
+static unsigned short toHalf(float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	unsigned short sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = bits & 0x7fffff;
+
+	if(exponent == 128 + 15) //Infinity or NaN, which stays one
+		return sign | 0x7c00 | (mantissa ? 0x200 | (mantissa >> 13) : 0);
+	if(exponent >= 31) //Too large, infinity
+		return sign | 0x7c00;
+
+	//Denormal: the implicit bit goes into the mantissa, shifted down further
+	int shift = 13;
+	if(exponent <= 0)
+	{
+		if(exponent < -10) //Below half the smallest denormal, zero
+			return sign;
+		mantissa |= 0x800000;
+		shift += 1 - exponent;
+		exponent = 0;
+	}
+
+	//A carry out of the mantissa goes into the exponent, up to infinity
+	unsigned int half = (exponent << 10) + (mantissa >> shift);
+	unsigned int rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+	if(rest > halfway || (rest == halfway && (half & 1)))
+		half++;
+	return sign | half;
+}
+
+static float fromHalf(unsigned short half)
+{
+	unsigned int sign = (half & 0x8000) << 16;
+	unsigned int exponent = (half >> 10) & 0x1f;
+	unsigned int mantissa = half & 0x3ff;
+	unsigned int bits;
+
+	if(exponent == 0)
+	{
+		if(!mantissa)
+			bits = sign; //Zero
+		else
+		{
+			//Denormal, normalised for the float
+			int shifted = 0;
+			while(!(mantissa & 0x400))
+			{
+				mantissa <<= 1;
+				shifted++;
+			}
+			bits = sign | ((1 - shifted - 15 + 127) << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	}
+	else if(exponent == 31)
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	else
+		bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+void Simulation::setValue(float* field, int index, float value)
+{
+	if(fieldBytes == sizeof(float))
+		field[index] = value;
+	else
+		((unsigned short*)field)[index] = toHalf(value);
+}
+
+float Simulation::getValue(float* field, int index)
+{
+	if(fieldBytes == sizeof(float))
+		return field[index];
+	return fromHalf(((unsigned short*)field)[index]);
 }
 
 //Clears everything
 void Simulation::reset()
 {
-	memset(u, 0, size);
-	memset(v, 0, size);
-	memset(w, 0, size);
-	memset(dens, 0, size);
+	clearField(u, buf_u);
+	clearField(v, buf_v);
+	clearField(w, buf_w);
+	clearField(dens, buf_dens);
 	clearEffects();
 }
 
 void Simulation::addFluid()
 {
 	cout<<"adding fluid"<<endl;
-	dens_prev[ix(6, 6, 6)] = 10.0;
+	if(!ownsPlane(6))
+		return;
+	writeValue(dens_prev, buf_dens_prev, ix(6, 6, 6 - zOffset), 10.0);
+	emptySource[0] = false;
 }
 
 void Simulation::addForce()
 {
-	u_prev[ix(2, 2, 2)] = 1000.0;
-	v_prev[ix(2, 2, 2)] = 1000.0;
-	w_prev[ix(2, 2, 2)] = 1000.0;
+	if(!ownsPlane(2))
+		return;
+	writeValue(u_prev, buf_u_prev, ix(2, 2, 2 - zOffset), 1000.0);
+	writeValue(v_prev, buf_v_prev, ix(2, 2, 2 - zOffset), 1000.0);
+	writeValue(w_prev, buf_w_prev, ix(2, 2, 2 - zOffset), 1000.0);
+	emptySource[1] = emptySource[2] = emptySource[3] = false;
 }
 
 //Clears just the velocity
 void Simulation::clearEffects()
 {
 	cout<<"clearing effects"<<endl;
-	memset(u_prev, 0, size);
-	memset(v_prev, 0, size);
-	memset(w_prev, 0, size);
-	memset(dens_prev, 0, size);
+	clearField(u_prev, buf_u_prev);
+	clearField(v_prev, buf_v_prev);
+	clearField(w_prev, buf_w_prev);
+	clearField(dens_prev, buf_dens_prev);
+	for(int b = 0; b < 4; b++)
+		emptySource[b] = true;
+}
+
+/*
+ * A field cleared, or one cell of it written, between steps. On the device
+ * it's a kernel or a one-cell write instead of touching the host array the
+ * buffer was made on, which would have to be made coherent again.
+ */
+void Simulation::clearField(float* field, cl::Buffer* buffer)
+{
+	if(fieldsOnHost())
+	{
+		memset(field, 0, size);
+		return;
+	}
+	clearBuffer(buffer, size);
+}
+
+//Zeroes the first bytes of a buffer on the device
+void Simulation::clearBuffer(cl::Buffer* buffer, size_t bytes)
+{
+	clearKernel->setArg(0, *buffer);
+	opencl->enqueue(*clearKernel, cl::NullRange, cl::NDRange(bytes / fieldBytes), cl::NullRange);
+	opencl->wait();
+}
+
+void Simulation::writeValue(float* field, cl::Buffer* buffer, int index, float value)
+{
+	if(fieldsOnHost())
+	{
+		setValue(field, index, value);
+		return;
+	}
+	float stored; //in the storage format, half fills just the first bytes
+	setValue(&stored, 0, value);
+	if(placement == PINNED) //mapped, it's host memory already
+	{
+		void* cell = opencl->queue->enqueueMapBuffer(*buffer, CL_TRUE, CL_MAP_WRITE, index * fieldBytes, fieldBytes, NULL, NULL, &opencl->err);
+		opencl->checkErr("CommandQueue::enqueueMapBuffer()");
+		memcpy(cell, &stored, fieldBytes);
+		cl::Event unmapped;
+		opencl->queue->enqueueUnmapMemObject(*buffer, cell, NULL, &unmapped);
+		unmapped.wait();
+		return;
+	}
+	opencl->err = opencl->queue->enqueueWriteBuffer(*buffer, CL_TRUE, index * fieldBytes, fieldBytes, &stored);
+	opencl->checkErr("CommandQueue::enqueueWriteBuffer()");
 }
 
 //Not used for the time being
 void Simulation::debug()
 {
+	if(!dens) //device-only fields
+		return;
 	float sum = 0, sump = 0;
-	for(int i = 0; i < N; i++)
-		for(int j = 0; j < N; j++)
-			for(int k = 0; k < N; k++)
+	for(int i = 0; i < Nx; i++)
+		for(int j = 0; j < Ny; j++)
+			for(int k = 0; k < Nz; k++)
 			{
-				sum += dens[ix(i, j, k)];
-				sump += dens_prev[ix(i, j, k)];
+				sum += getValue(dens, ix(i, j, k));
+				sump += getValue(dens_prev, ix(i, j, k));
 			}
 	cout<<"sum/prev: "<<sum<<" "<<sump<<endl;
 }
@@ -2,26 +2,67 @@
  * The main simulation class - conducts the simulation, keeps
  * state and uses OpenCL to perform the calculations
  *
+ * The buffers and kernels are made on the OpenCL backend the simulation
+ * is given, so several simulations can share a process (and a backend).
+ *
  * Is friends with the Tuner class, which changes parameters.
  */
 #pragma once 
 #include <CL/cl.hpp>
+#include <vector>
+#include <initializer_list>
+#include <sstream>
+#include <functional>
+#include <map>
+#include "eventgraph.h"
+#include "plan.h"
 
+class Peer;
+struct OpenCL;
+class ThreadPool;
+struct Row;
 
 class Simulation
 {
 public:
-	Simulation() {};
+	Simulation(OpenCL* opencl) : opencl(opencl), placement(HOST), capacity(0), downsampleKernel(NULL), upsampleKernel(NULL), clearKernel(NULL),
+		replan(true), zOffset(0), zSpan(0), pcgR(NULL), pcgZ(NULL), pcgD(NULL), pcgQ(NULL), partialSums(NULL), scalars(NULL),
+		packedVelocity(NULL), packedVelocityPrev(NULL), packedPressure(NULL), packedDivergence(NULL),
+		brickFlags(NULL), brickList(NULL), brickRetired(NULL), brickCount(NULL)
+	{
+		for(int b = 0; b < 5; b++)
+			blockScratch[b] = NULL;
+		brickActive[0] = brickActive[1] = NULL;
+	};
 	virtual ~Simulation()
 	{
-		delete resampleKernel;
+		delete downsampleKernel;
+		delete upsampleKernel;
+		delete clearKernel;
 		deallocateBuffers();
 	}
 
 	friend class Tuner;
 
+	//Iterative solvers for diffusion and the pressure projection
+	//(multigrid and PCG only replace the pressure solve, diffusion stays Jacobi)
+	enum Solver {JACOBI, SOR, MULTIGRID, PCG, SOLVERS};
+	void setSolver(Solver);
+	void setRelaxation(float w) { omega = w; replan = true; }
+	void setTolerance(float, int);
+	void setSweepsPerLaunch(int);
+	void setPackedVelocity(bool);
+	void setSparse(bool);
+
+	//Where the fields are kept: in host memory the buffers work on (zero-copy),
+	//on the device only, in pinned host memory the host maps to get at, or in
+	//shared virtual memory (OpenCL 2.0). Picked with -memory.
+	enum Placement {HOST, DEVICE, PINNED, SVM, PLACEMENTS};
+
 	// General control
-	virtual void initialize(int);
+	void setDomain(int offset, int span);
+	void reserve(int, int, int); //room for resizes up to these extents
+	virtual void initialize(int, int, int);
 	virtual void setKernelArguments() = 0;
 	virtual void step() = 0;
 	void allocateBuffers(bool = true);
@@ -30,17 +71,29 @@ public:
 
 	// Getters
 	cl::Buffer* getOutputVolume() { return buf_dens; }
-	int getN() {return N;}
+	cl_int4 getExtent() {return extent();}
+	Solver getSolver() {return solver;}
 
 	// Volume modification
 	inline int ix(int, int, int);
 	void addFluid(); 
 	void addForce();
 	void clearEffects();
-	void reset();
-	void resize(int);
+	virtual void reset();
+	virtual void resize(int, int, int);
+
+	//Resize when it suits the simulation: right away, or prepared in the
+	//background and swapped in by switchOver between two later frames
+	virtual void resizeLater(int nx, int ny, int nz) { resize(nx, ny, nz); }
+	virtual bool switchOver() { return false; } //whether the extents changed
 	
 protected:
+	OpenCL* opencl; //NULL for the native simulation without rendering
+	Placement placement; //of the fields, HOST if the simulation works on the host arrays
+	int capacity; //voxels the fields have room for, resizes within it don't allocate
+	float* allocateField(cl::Buffer** buffer, int room = 0); //room in voxels, 0: capacity
+	void releaseField(float* field, cl::Buffer* buffer);
+
 	// Simulation buffers
 	float *u,
 	      *v,
@@ -51,43 +104,336 @@ protected:
 	      *dens,
 	      *dens_prev;
 	cl::Buffer *buf_u, *buf_v, *buf_w, *buf_u_prev, *buf_v_prev, *buf_w_prev, *buf_dens, *buf_dens_prev;
-	cl::Kernel *resampleKernel;
+	bool emptySource[4]; //dens_prev, u_prev, v_prev, w_prev known to be all zeros
+	cl::Kernel *downsampleKernel, *upsampleKernel;
+	cl::Kernel* resampler(cl_int4 n, cl_int4 n0, cl::Buffer** targets, cl::Buffer** sources);
+	void reportResize(cl_int4 n0, double stalled);
+	PlanKernel *clearKernel;
+
+	//Fields are cleared and written on the device, through their buffers,
+	//unless the simulation keeps them in the host arrays
+	virtual bool fieldsOnHost() { return opencl == NULL; }
+	void clearField(float* field, cl::Buffer* buffer);
+	void clearBuffer(cl::Buffer* buffer, size_t bytes);
+	void writeValue(float* field, cl::Buffer* buffer, int index, float value);
 
 	//Image3D: Image objects for the modified density kernel
 	//cl_mem image_dens, image_dens_prev, image_write_dens_prev;
 
 	// Simulation kernels
-	int N ;
+	int Nx, Ny, Nz; //interior cells along each axis
 	int voxels;
 	int size;
+	int fieldBytes; //bytes per stored value, 2 with half storage
 	float dt; //timestep
 	float visc;
 	float diff; //dampening
 	int solverSteps;
+	Solver solver;
+	float omega; //SOR factor of every solve, 0 = derived from the extents and a
+	float tolerance; //RMS residual to stop iterating at, 0 = always solverSteps
+	int checkEvery; //iterations between residual checks
+	int sweepsPerLaunch; //temporal blocking of the Jacobi solves, 1 = off
+	bool packed; //velocity step on a float4 field
+	bool sparse; //stencils only over the active bricks
+	float activeThreshold; //density or speed that makes a brick active
+	bool replan; //buffers or settings changed since the step was planned
+
+	float relaxation(float);
+	cl_int4 extent(); //Nx, Ny, Nz and the longest of them, as the kernels take it
+	int longest(); //the side the cell size and velocities are scaled by
+
+	//Distributed: this volume is planes zOffset+1 to zOffset+Nz of a domain
+	//zSpan planes deep, the others held by other processes (0: all here)
+	int zOffset, zSpan;
+	bool ownsPlane(int l) { return l > zOffset && l <= zOffset + Nz; }
+
+	//Solver working memory, allocated with the temporaries
+	void allocateSolverBuffers();
+	void deallocateSolverBuffers();
+	cl::Buffer* newScratch(int);
+	cl::Buffer* newField(int);
+
+	//Solver buffers deallocated since the last allocation, by size
+	std::multimap<size_t, cl::Buffer*> spare;
+	cl::Buffer* reuse(size_t bytes);
+	void recycle(cl::Buffer*& buffer);
+	void releaseSpare();
+
+	//Cell access that follows the storage format
+	void setValue(float* field, int index, float value);
+	float getValue(float* field, int index);
+
+	//Multigrid hierarchy: mgN[0] is the extent and level 0 works on the p and div
+	//fields handed to project, so only its residual buffer lives here
+	std::vector<cl_int4> mgN;
+	std::vector<cl::Buffer*> mgPressure, mgRhs, mgResidual;
+
+	//Conjugate gradient vectors, and the device-side reduction results
+	//(one partial sum per work-group of reduceGroup cells, then the scalars:
+	//r.z twice, d.q and the squared residual of the early termination check)
+	static const int reduceGroup = 64;
+	cl::Buffer *pcgR, *pcgZ, *pcgD, *pcgQ;
+	cl::Buffer *partialSums, *scalars;
+
+	//Out-of-place targets of the temporally blocked solves, one per setBound mode
+	//and one for the pressure, so the u, v, w, density and pressure solves don't
+	//have to wait for each other
+	static const int pressureScratch = 4;
+	cl::Buffer* blockScratch[5];
+
+	//Packed velocity (float4 per cell) and the pressure and divergence for its projection
+	cl::Buffer *packedVelocity, *packedVelocityPrev, *packedPressure, *packedDivergence;
 
+	//Sparse mode: bricks of brick^3 cells (BRICK in fluid.cl). Flags from the
+	//marking pass, the active set of this and the last frame (alternating),
+	//the active and retired brick lists, and their lengths with the fastest
+	//speed, all kept on the device
+	static const int brick = 8;
+	cl::Buffer *brickFlags, *brickActive[2], *brickList, *brickRetired, *brickCount;
+	int brickFlip; //which of brickActive is this frame's
+	cl_int4 brickGrid();
 };
 
 class ParallelSimulation : public Simulation
 {
 public:
+	ParallelSimulation(OpenCL* opencl) : Simulation(opencl), kernelProgram(NULL) { pending.room = unused.room = 0; }
 	~ParallelSimulation();
-	void initialize(int);
+	void initialize(int, int, int);
 	void setKernelArguments();
 	void step();
+	void reset();
+	void resize(int, int, int);
+	void resizeLater(int, int, int);
+	bool switchOver();
 private:
-	cl::Kernel *diffuseKernel, *advectKernel,
+	//Background resize: dens, u, v, w at the pending extents, resampled on
+	//the background queue, and the four fields left over from the last one
+	//for the next to use (room 0: none)
+	struct Targets
+	{
+		int n[3];
+		int room;
+		cl_int4 n0; //extents resized from
+		cl::Kernel* kernel; //resampling them, NULL until it's started
+		double stalled; //seconds the host spent on it
+		float* fields[4];
+		cl::Buffer* buffers[4];
+	} pending, unused;
+	cl::Event resampled;
+	void resampleLater();
+	void abandon();
+	void releaseTargets(Targets&);
+
+	//Step plan: the launches after the sources, recorded once and replayed
+	StepPlan plan;
+	bool planned();
+	void stages();
+	void launch(PlanKernel* kernel, const cl::NDRange& global,
+			const std::vector<cl::Buffer*>& reads, const std::vector<cl::Buffer*>& writes,
+			const cl::NDRange& local = cl::NullRange);
+	void copy(cl::Buffer* source, cl::Buffer* destination, size_t size);
+
+	// Pipeline stages (see the C version)
+	void addSources(std::initializer_list<int> modes);
+	void setBound(int b, cl::Buffer* x);
+	void clear(cl::Buffer* x);
+	void diffuse(int b, cl::Buffer* x, cl::Buffer* x0, float diff);
+	void project(cl::Buffer* u, cl::Buffer* v, cl::Buffer* w, cl::Buffer* p, cl::Buffer* div);
+	void solvePressure(cl::Buffer* p, cl::Buffer* div);
+	void advect(int b, cl::Buffer* d, cl::Buffer* d0, cl::Buffer* u, cl::Buffer* v, cl::Buffer* w);
+	cl::NDRange tiledVolume();
+
+	// Sparse mode
+	bool sparseStencils();
+	void findActiveBricks();
+	void launchSparse(PlanKernel* kernel, const std::vector<cl::Buffer*>& reads, const std::vector<cl::Buffer*>& writes);
+
+	// Packed velocity stages
+	void diffusePacked(cl::Buffer* x, cl::Buffer* x0);
+	void projectPacked(cl::Buffer* velocity);
+	void advectPacked(cl::Buffer* d, cl::Buffer* d0);
+	void packedVelocityStep();
+	void blockedJacobi(int b, cl::Buffer* x, cl::Buffer* x0, float a, float c, int scratch);
+
+	// Multigrid pressure solve
+	void multigrid(cl::Buffer* p, cl::Buffer* div);
+	void vCycle(int level, cl::Buffer* e, cl::Buffer* r);
+	void smooth(int level, cl::Buffer* e, cl::Buffer* r, int sweeps);
+
+	// Conjugate gradient pressure solve
+	void conjugateGradient(cl::Buffer* p, cl::Buffer* div);
+	void dot(cl::Buffer* a, cl::Buffer* b, int slot);
+	void reduce(int groups, int slot);
+
+	// Early termination
+	bool converged(int done, int total, int every, float a, float c, cl::Buffer* x, cl::Buffer* x0);
+	void report(const char* name);
+	int lastIterations;
+	float lastResidual;
+	std::ostringstream solveReport; //iterations and residual of each solve this frame
+
+	PlanKernel *diffuseKernel, *advectKernel,
 		*setBoundKernel, *addSourceKernel,
 		*projectKernel1, *projectKernel2, *projectKernel3;
 	//*diffuseKernelImage3D;
+
+	//Fused stencil + setBound kernels
+	PlanKernel *diffuseBoundKernel, *advectBoundKernel,
+		*project1BoundKernel, *project2BoundKernel, *project3BoundKernel;
+
+	//Red-black SOR sweeps
+	PlanKernel *diffuseRedBlackKernel, *project2RedBlackKernel;
+
+	//Multigrid
+	PlanKernel *mgSmoothKernel, *mgResidualKernel, *mgRestrictKernel, *mgProlongKernel;
+
+	//Conjugate gradient and reductions
+	PlanKernel *pcgInitKernel, *pcgApplyKernel, *pcgUpdateKernel, *pcgDirectionKernel,
+		*dotPartialKernel, *dotFinalKernel, *residualPartialKernel;
+
+	//Local-memory tiled stencils and their brick (work-group) size
+	PlanKernel *diffuseTiledKernel, *project1TiledKernel, *project2TiledKernel, *project3TiledKernel;
+	int tileX, tileY, tileZ;
+
+	//Temporal blocking, with sweepsPerLaunch cut down to what fits in local memory
+	PlanKernel *jacobiBlockedKernel;
+	int launchSweeps;
+	cl_ulong localMemory;
+
+	//Packed velocity
+	PlanKernel *packVelocityKernel, *unpackVelocityKernel, *diffusePackedKernel, *advectPackedKernel,
+		*project1PackedKernel, *project3PackedKernel;
+
+	//Sparse mode
+	PlanKernel *markBricksKernel, *listBricksKernel, *clearBricksKernel,
+		*diffuseSparseKernel, *advectSparseKernel,
+		*project1SparseKernel, *project2SparseKernel, *project3SparseKernel;
+
+	EventGraph graph; //Dependencies between the kernels of a step
+
+	//Kernels, made again when the program changes (specialized to other extents)
+	cl::Program* kernelProgram;
+	cl::Program* program();
+	void makeKernels(cl::Program*);
+	void deleteKernels();
 };
 
 class SequentialSimulation : public Simulation
 {
 public:
+	SequentialSimulation(OpenCL* opencl) : Simulation(opencl) {}
 	~SequentialSimulation();
-	void initialize(int);
+	void initialize(int, int, int);
 	void setKernelArguments();
 	void step();
 private:
 	cl::Kernel *fluidKernel;
 };
+
+/*
+ * Decomposed simulation (-slabs): the volume is cut into slabs of whole z
+ * planes, one per device, each stepped on its own queue and event graph.
+ * The z walls of a slab next to another one are ghost planes holding that
+ * neighbour's edge plane, exchanged through host memory after every Jacobi
+ * sweep and every stage that writes a field. Always Jacobi, unpacked and
+ * over the whole volume.
+ *
+ * Distributed (-ranks), the volume is this process's part of the domain
+ * and its outer ghost planes are exchanged with the processes next to it
+ * in the same way, through sockets.
+ */
+class DecomposedSimulation : public Simulation
+{
+public:
+	//Peers hold the planes below and above this process's, if distributed (taken over)
+	DecomposedSimulation(OpenCL* opencl, Peer* below = NULL, Peer* above = NULL) : Simulation(opencl),
+		activeSlabs(0), planeBytes(0), below(below), above(above) {}
+	~DecomposedSimulation();
+	void initialize(int, int, int);
+	void setKernelArguments();
+	void step();
+	void reset();
+	void resize(int, int, int);
+private:
+	bool fieldsOnHost() { return true; } //the host arrays carry the volume to and from the slabs
+
+	//Fields of a slab: by setBound mode, then their sources/temporaries
+	enum Field {DENS, U, V, W, DENS_PREV, U_PREV, V_PREV, W_PREV, FIELDS};
+
+	struct Slab
+	{
+		EventGraph graph;
+		int z0; //interior planes of the volume below the slab
+		int nz; //interior planes of the slab, 0 if it sits out
+		cl::Buffer* fields[FIELDS];
+		cl::Kernel *diffuseKernel, *advectKernel, *setBoundKernel, *addSourceKernel,
+			*projectKernel1, *projectKernel2, *projectKernel3;
+	};
+
+	//Host copy of one ghost plane on its way between two slabs
+	struct Halo
+	{
+		std::vector<char> plane;
+		cl::Event downloaded, uploaded;
+	};
+
+	std::vector<Slab*> slabs; //one per device (opencl->queues)
+	int activeSlabs; //the first ones, with at least a plane each
+	std::vector<Halo> halos; //per seam, the plane going up and the one going down
+	int planeBytes;
+	Peer *below, *above;
+
+	void split();
+	void exchange(int field);
+	void upload(int field, const char* volume);
+	void download(int field, char* volume);
+	void scatter(int field, cl::Buffer* volume);
+	void gather(int field, cl::Buffer* volume);
+	void finish();
+
+	// Pipeline stages, as in ParallelSimulation
+	void addSources();
+	void setBound(Slab* slab, int b, int x);
+	void diffuse(int b, int x, int x0, float diff);
+	void project(int u, int v, int w, int p, int div);
+	void advect(int b, int d, int d0, int u, int v, int w);
+};
+
+/*
+ * Native simulation (-native): the step of ParallelSimulation in plain C++
+ * on the host arrays, no OpenCL needed. The stages go over blocks of the
+ * volume on a work-stealing thread pool, and the rows of the Jacobi and
+ * advection stencils use AVX2 or AVX-512 where the CPU has them. Always
+ * Jacobi, float storage, unpacked and over the whole volume.
+ */
+class NativeSimulation : public Simulation
+{
+public:
+	NativeSimulation(OpenCL* opencl, int threads = 0); //threads: 0 = one per hardware thread
+	~NativeSimulation();
+	void initialize(int, int, int);
+	void setKernelArguments() {}
+	void step();
+	void resize(int, int, int);
+private:
+	bool fieldsOnHost() { return true; }
+	ThreadPool* pool;
+	float* scratch; //out-of-place target of the Jacobi sweeps
+
+	//Row functions for the instructions the CPU has
+	void (*jacobiRows)(float*, const float*, const float*, int, int, int, float, float, int);
+	void (*advectRows)(float*, const float*, const float*, const float*, const float*, const Row&, int);
+
+	void forBlocks(const std::function<void(int, int, int, int)>& body);
+	void profile(const char* stage, double since);
+
+	// Pipeline stages, as in ParallelSimulation
+	void addSources();
+	void setBound(int b, float* x);
+	void jacobi(int b, float*& x, float* x0, float a, float c);
+	void diffuse(int b, float*& x, float* x0, float diff);
+	void project(float* u, float* v, float* w, float*& p, float* div);
+	void advect(int b, float* d, float* d0, float* u, float* v, float* w);
+};
@@ -0,0 +1,84 @@
+#include "threadpool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int count) : job(NULL), generation(0), busy(0), stopping(false)
+{
+	threads = count > 0 ? count : std::max(1u, std::thread::hardware_concurrency());
+	shares = new Share[threads];
+	for(int t = 1; t < threads; t++)
+		workers.push_back(std::thread(&ThreadPool::work, this, t));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	started.notify_all();
+	for(std::thread& worker : workers)
+		worker.join();
+	delete[] shares;
+}
+
+void ThreadPool::run(int tasks, const std::function<void(int)>& task)
+{
+	//Even shares, the first tasks % threads get one more
+	for(int t = 0; t < threads; t++)
+	{
+		int begin = t * (tasks / threads) + std::min(t, tasks % threads);
+		shares[t].next.store(begin, std::memory_order_relaxed);
+		shares[t].end = begin + tasks / threads + (t < tasks % threads ? 1 : 0);
+	}
+
+	if(threads > 1)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			job = &task;
+			busy = threads - 1;
+			generation++;
+		}
+		started.notify_all();
+	}
+	else
+		job = &task;
+
+	drain(0);
+
+	std::unique_lock<std::mutex> guard(lock);
+	finished.wait(guard, [this] { return busy == 0; });
+}
+
+//A worker's thread: waits for a job, works through it, reports back
+void ThreadPool::work(int self)
+{
+	unsigned done = 0;
+	while(true)
+	{
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			started.wait(guard, [this, done] { return stopping || generation != done; });
+			if(stopping)
+				return;
+			done = generation;
+		}
+
+		drain(self);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if(--busy == 0)
+			finished.notify_one();
+	}
+}
+
+//Own share first, then stealing from the threads after this one in turn
+void ThreadPool::drain(int self)
+{
+	for(int k = 0; k < threads; k++)
+	{
+		Share& share = shares[(self + k) % threads];
+		for(int t = share.next++; t < share.end; t = share.next++)
+			(*job)(t);
+	}
+}
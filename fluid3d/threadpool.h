@@ -0,0 +1,49 @@
+/*
+ * Worker threads for the native simulation.
+ *
+ * run() hands out tasks 0 to n-1 and returns when they are all done. Every
+ * thread (the caller is one of them) starts on an even share of the range,
+ * and one that runs out of its own takes the next tasks of the others' -
+ * the shares are counters, so taking a task is one atomic increment.
+ */
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+class ThreadPool
+{
+public:
+	ThreadPool(int threads = 0); //0 = one per hardware thread
+	~ThreadPool();
+
+	int size() { return threads; }
+	void run(int tasks, const std::function<void(int)>& task);
+
+private:
+	//A thread's share of the tasks: the next one to take and the end,
+	//padded out to a cache line so the counters don't share one
+	struct Share
+	{
+		std::atomic<int> next;
+		int end;
+		char padding[64 - sizeof(std::atomic<int>) - sizeof(int)];
+	};
+
+	int threads;
+	Share* shares;
+	std::vector<std::thread> workers;
+
+	const std::function<void(int)>* job;
+	unsigned generation; //of the job, a worker starts on every new one
+	int busy; //workers not done with the job yet
+	bool stopping;
+	std::mutex lock;
+	std::condition_variable started, finished;
+
+	void work(int self);
+	void drain(int self);
+};
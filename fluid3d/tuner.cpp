@@ -2,7 +2,7 @@
 #include "main.h"
 
 
-void Tuner::initialize(Simulation* sim, int c, int fps, cl_device_type devType)
+void Tuner::initialize(Simulation* sim, int c, int fps, cl_device_type devType, const char* axes)
 {
 	simulation = sim;
 	historySize = c;
@@ -13,8 +13,47 @@ void Tuner::initialize(Simulation* sim, int c, int fps, cl_device_type devType)
 	deviceType = devType;
 
 	//Locally kept parameters
-	resolution = simulation->N;
+	resolution = side();
 	precision = simulation->solverSteps;
+
+	base[0] = simulation->Nx;
+	base[1] = simulation->Ny;
+	base[2] = simulation->Nz;
+	tunedCount = 0;
+	for(int a = 0; a < 3; a++)
+	{
+		tuned[a] = strchr(axes, "xyz"[a]) != NULL;
+		tunedCount += tuned[a];
+	}
+}
+
+//Side of the cube with the volume's number of cells, what the change functions expect
+int Tuner::side()
+{
+	return (int)(cbrt((double)simulation->Nx * simulation->Ny * simulation->Nz) + 0.5);
+}
+
+/*
+ * Resizes the simulation to the current resolution. Scaling k of the axes
+ * by f changes the side by f^(k/3), so they're scaled by (resolution/side)^(3/k)
+ * of the base extents. The simulation may only switch to them a frame or so
+ * later (see Simulation::resizeLater). Returns whether the extents changed
+ * already, a later switch is reported by Simulation::switchOver.
+ */
+bool Tuner::resize()
+{
+	if(tunedCount == 0)
+		return false;
+
+	int baseSide = (int)(cbrt((double)base[0] * base[1] * base[2]) + 0.5);
+	float factor = pow(resolution / baseSide, 3.0f / tunedCount);
+	int n[3];
+	for(int a = 0; a < 3; a++)
+		n[a] = tuned[a] ? max(2, (int)(base[a] * factor + 0.5f)) : base[a];
+
+	int n0[3] = {simulation->Nx, simulation->Ny, simulation->Nz};
+	simulation->resizeLater(n[0], n[1], n[2]); //the current extents drop a pending resize
+	return n0[0] != simulation->Nx || n0[1] != simulation->Ny || n0[2] != simulation->Nz;
 }
 
 /*
@@ -57,18 +96,19 @@ bool Tuner::tune()
 	cout<<"TUNER: difference = "<<difference;
 
 	bool changed = false;
+	int N = side();
 	//Positive difference = bad, negative = good
-	if(difference > 0.01 && simulation->solverSteps > 1 && simulation->N > 4)
+	if(difference > 0.01 && simulation->solverSteps > 1 && N > 4)
 	{
 		//how much a resolution change should cause a precision change?
 		float dydx = 
 		(deviceType == CL_DEVICE_TYPE_CPU)
 		?
-			(y_CPU_res(simulation->N) - y_CPU_res(simulation->N - 1))
+			(y_CPU_res(N) - y_CPU_res(N - 1))
 			/
 			(y_CPU_prec(simulation->solverSteps) - y_CPU_prec(simulation->solverSteps - 1))
 		:
-			(y_GPU_res(simulation->N) - y_GPU_res(simulation->N - 1))
+			(y_GPU_res(N) - y_GPU_res(N - 1))
 			/
 			(y_GPU_prec(simulation->solverSteps) - y_GPU_prec(simulation->solverSteps - 1));
 
@@ -91,11 +131,11 @@ bool Tuner::tune()
 		float dydx = 
 		(deviceType == CL_DEVICE_TYPE_CPU)
 		?
-			(y_CPU_res(simulation->N + 1) - y_CPU_res(simulation->N))
+			(y_CPU_res(N + 1) - y_CPU_res(N))
 			/
 			(y_CPU_prec(simulation->solverSteps + 1) - y_CPU_prec(simulation->solverSteps))
 		:
-			(y_GPU_res(simulation->N + 1) - y_GPU_res(simulation->N))
+			(y_GPU_res(N + 1) - y_GPU_res(N))
 			/
 			(y_GPU_prec(simulation->solverSteps + 1) - y_GPU_prec(simulation->solverSteps));
 
@@ -113,13 +153,10 @@ bool Tuner::tune()
 		cout<<" (changing up) ";
 	}
 
-	if(int(resolution) != simulation->N)
-	{
-		simulation->resize(int(resolution));
-		changed = true;
-	}
+	if(int(resolution) != N)
+		changed = resize();
 	simulation->solverSteps = int(precision);
-	cout<<" R/P = "<<simulation->N<<"/"<<simulation->solverSteps<<endl;
+	cout<<" R/P = "<<simulation->Nx<<"x"<<simulation->Ny<<"x"<<simulation->Nz<<"/"<<simulation->solverSteps<<endl;
 
 	return changed;
 }
@@ -135,7 +172,7 @@ bool Tuner::benchmark()
 	if(count % 20 == 0 && count != 0)
 	{
 		//Resolution change (solvers fixed at 20 iterations)
-		simulation->resize(1);
+		simulation->resize(1, 1, 1);
 		return true;
 		
 		
@@ -14,7 +14,7 @@ public:
 	Tuner()	{}
 	~Tuner() {}
 
-	void initialize(Simulation*, int, int, cl_device_type);
+	void initialize(Simulation*, int, int, cl_device_type, const char* axes);
 	void start();
 	bool report(double);
 	bool tune();
@@ -35,6 +35,14 @@ private:
 	cl_device_type deviceType;
 
 	float resolution, precision;
+
+	//Resolution is the side of a cube with as many cells as the volume. It's
+	//reached by scaling the tuned axes of the starting extents (base) together
+	int base[3];
+	bool tuned[3];
+	int tunedCount;
+	int side();
+	bool resize();
   
 	int historySize;
 	double averageLatest;